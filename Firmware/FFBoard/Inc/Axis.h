@@ -99,6 +99,9 @@ public:
 
 	void saveFlash() override;
 	void restoreFlash() override;
+	uint16_t getProfileKey() override {return flashAddrs.config;};
+	uint8_t saveProfile(uint16_t* buf,uint8_t maxLen) override;
+	void loadProfile(const uint16_t* buf,uint8_t len) override;
 
 	void prepareForUpdate();  // called before the effects are calculated
 	void updateDriveTorque(); //int32_t effectTorque);
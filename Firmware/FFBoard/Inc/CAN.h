@@ -12,6 +12,7 @@
 #include "CanHandler.h"
 #include "main.h"
 #include <vector>
+#include <array>
 #include "semaphore.hpp"
 
 typedef struct{
@@ -26,16 +27,121 @@ typedef struct{
 
 
 
-class CANPort { //  : public CanHandler if interrupt callbacks needed
+/*
+ * High priority frames (torque commands) are sent before all normal frames.
+ * A queued high priority frame is replaced by a newer frame with the same id
+ */
+enum class CANPriority : uint8_t {high,normal};
+
+/*
+ * Ring buffer for frames waiting for a free transmit mailbox
+ */
+template<uint8_t SIZE>
+class CAN_tx_queue {
+public:
+	bool push(const CAN_tx_msg& msg){
+		if(count >= SIZE)
+			return false;
+		buf[(head + count) % SIZE] = msg;
+		count++;
+		return true;
+	}
+	bool pop(CAN_tx_msg& msg){
+		if(count == 0)
+			return false;
+		msg = buf[head];
+		head = (head + 1) % SIZE;
+		count--;
+		return true;
+	}
+	/*
+	 * Returns a queued frame with the same id or nullptr
+	 */
+	CAN_tx_msg* find(const CAN_TxHeaderTypeDef& header){
+		for(uint8_t i = 0; i < count; i++){
+			CAN_tx_msg* msg = &buf[(head + i) % SIZE];
+			if(msg->header.IDE == header.IDE && msg->header.RTR == header.RTR &&
+					(header.IDE == CAN_ID_EXT ? msg->header.ExtId == header.ExtId : msg->header.StdId == header.StdId)){
+				return msg;
+			}
+		}
+		return nullptr;
+	}
+	void clear(){head = 0; count = 0;}
+	uint8_t size(){return count;}
+	bool empty(){return count == 0;}
+private:
+	std::array<CAN_tx_msg,SIZE> buf;
+	uint8_t head = 0;
+	uint8_t count = 0;
+};
+
+/*
+ * Bus statistics of a port. Rates and load are computed over a window of statsWindow ms
+ */
+struct CANPortStats {
+	uint32_t rxFrames = 0;
+	uint32_t txFrames = 0;
+	uint32_t busOff = 0;		// Bus off events
+	uint32_t errorPassive = 0;	// Error passive events
+	uint32_t errorWarning = 0;	// Error warning events
+	uint32_t rxOverrun = 0;		// Frames lost because a receive fifo was full
+	uint32_t txErrors = 0;		// Arbitration lost or transmit errors
+	uint32_t untracked = 0;		// Frames of ids not fitting in the id table
+	uint16_t rxRate = 0;		// Frames/s
+	uint16_t txRate = 0;		// Frames/s
+	uint16_t load = 0;			// Estimated bus load in 0.1%
+	uint8_t tec = 0;			// Transmit error counter
+	uint8_t rec = 0;			// Receive error counter
+};
+
+/*
+ * Frame rate of a single id and direction
+ */
+struct CANIdStats {
+	uint32_t id = 0;
+	bool ext = false;
+	bool tx = false;
+	uint32_t frames = 0;
+	uint32_t windowFrames = 0;
+	uint16_t rate = 0; // Frames/s
+};
+
+enum class CANStatField : uint8_t {rxRate,txRate,load,tec,rec,busOff,errorPassive,errorWarning,rxOverrun,txErrors,txQueued,txDropped,txOverrun};
+
+class CANPort { // Gets tx callbacks directly from the global callbacks
 public:
 	CANPort(CAN_HandleTypeDef &hcan);
 	virtual ~CANPort();
 
-	bool sendMessage(CAN_tx_msg msg);
-	bool sendMessage(CAN_TxHeaderTypeDef *pHeader, uint8_t aData[],uint32_t *pTxMailbox = nullptr);
+	bool sendMessage(CAN_tx_msg msg,CANPriority priority = CANPriority::normal);
+	bool sendMessage(CAN_TxHeaderTypeDef *pHeader, uint8_t aData[],uint32_t *pTxMailbox = nullptr,CANPriority priority = CANPriority::normal);
+
+	void canTxCpltCallback(CAN_HandleTypeDef *hcan,uint32_t mailbox);
+	void canTxAbortCallback(CAN_HandleTypeDef *hcan,uint32_t mailbox);
+	void canErrorCallback(CAN_HandleTypeDef *hcan);
+
+	CANPortStats getStats();
+	uint32_t getStat(CANStatField field);
+	std::vector<CANIdStats> getIdStats();
+	void resetStats();
+	static uint8_t frameBits(bool ext,uint8_t dlc);
 
-	int32_t addCanFilter(CAN_FilterTypeDef sFilterConfig);
+	uint32_t getTxDropped(){return txDropped;}
+	uint32_t getTxOverrun(){return txOverrun;}
+	uint8_t getTxQueued(){return txQueueHigh.size() + txQueueNormal.size();}
+
+	static std::vector<CANPort*>& getPorts() {
+		static std::vector<CANPort*> canPorts{};
+		return canPorts;
+	}
+
+	int32_t addCanFilter(CAN_FilterTypeDef sFilterConfig,CanHandler* handler = nullptr);
 	void removeCanFilter(uint8_t filterId);
+	static CAN_FilterTypeDef stdIdFilter(uint32_t id,uint32_t mask,uint32_t fifo = CAN_RX_FIFO0);
+	static CAN_FilterTypeDef extIdFilter(uint32_t id,uint32_t mask,uint32_t fifo = CAN_RX_FIFO0);
+	bool dispatchRxMessage(CAN_HandleTypeDef *hcan,uint8_t* rxBuf,CAN_RxHeaderTypeDef* rxHeader,uint32_t fifo);
+	void setRxMonitor(CanHandler* handler); // Receives all frames including the ones owned by other filters. nullptr to disable
 
 	void setSpeed(uint32_t speed);
 	void setSpeedPreset(uint8_t preset);
@@ -58,6 +164,33 @@ private:
 	std::vector<CAN_FilterTypeDef> canFilters;
 	uint32_t txMailbox;
 	cpp_freertos::BinarySemaphore semaphore = cpp_freertos::BinarySemaphore(true);
+
+	uint8_t firstFilterBank();
+	uint8_t lastFilterBank();
+	void updateFilterIndex();
+	std::array<CanHandler*,28> filterHandlers{}; // Receiver of frames matching a filter bank. nullptr passes frames to all handlers
+	std::array<std::array<uint8_t,4*slaveFilterStart>,2> filterMatchBank; // Filter match index per fifo to filter bank
+	CanHandler* volatile rxMonitor = nullptr;
+
+	void fillMailboxes(); // Moves queued frames to free mailboxes. Call with interrupts locked
+	CAN_tx_queue<8> txQueueHigh;
+	CAN_tx_queue<16> txQueueNormal;
+	uint32_t txDropped = 0; // Frames rejected because the queue was full
+	uint32_t txOverrun = 0; // High priority frames replaced by a newer frame before sending
+
+	void activateNotifications();
+	bool notificationsActive = false;
+
+	void countFrame(uint32_t id,bool ext,uint8_t dlc,bool tx); // Call from interrupts
+	void updateStatsWindow(); // Call with interrupts locked
+	static const uint32_t statsWindow = 1000;
+	CANPortStats stats;
+	std::array<CANIdStats,16> idStats;
+	uint8_t idStatsCount = 0;
+	uint32_t statsWindowStart = 0;
+	uint32_t windowRx = 0;
+	uint32_t windowTx = 0;
+	uint32_t windowBits = 0;
 };
 
 #endif /* SRC_CAN_H_ */
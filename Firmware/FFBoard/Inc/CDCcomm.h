@@ -12,20 +12,49 @@
 #include "cppmain.h"
 #include "semaphore.hpp"
 
+#define CDC_TX_BUFFER_SIZE 2048 // Must be a power of 2
+
+struct CDCTxStats {
+	uint32_t stalls = 0;	// Sends that had to wait for free space
+	uint32_t stallTime = 0;	// Total time waited in ms
+	uint32_t dropped = 0;	// Bytes discarded after the timeout
+	uint32_t peakUsed = 0;	// Highest fill level of the buffer
+	uint32_t sent = 0;		// Bytes passed to usb
+};
+
+enum class CDCTxStatField : uint8_t {stalls=0,stallTime,dropped,peakUsed,sent,used,size};
+
+/**
+ * Transmit ring buffer per cdc interface.
+ * Producers append directly and the usb transmit complete callback drains it
+ */
 class CDCcomm {
 public:
 
-	static uint16_t cdcSend(std::string* reply,uint8_t itf);
+	static const uint32_t txTimeout = 100; // ms to wait for free space before data is dropped
+
+	static uint32_t cdcSend(std::string* reply,uint8_t itf,uint32_t timeout = txTimeout);
+	static uint32_t cdcSend(const char* buf,uint32_t len,uint8_t itf,uint32_t timeout = txTimeout);
 	static void cdcFinished(uint8_t itf = 0);
 	static uint32_t remainingData(uint8_t itf = 0);
+	static uint32_t freeSpace(uint8_t itf = 0);
+	static bool readyToSend(uint8_t itf = 0);
+
+	static CDCTxStats getStats(uint8_t itf = 0);
+	static uint32_t getStat(CDCTxStatField field,uint8_t itf = 0);
+	static void resetStats(uint8_t itf = 0);
 
 private:
-	static bool usb_busy_retry;
-	static std::string remainingStrs[CFG_TUD_CDC];
-	static std::string tString;
+	static bool drain(uint8_t itf);
+	static uint8_t txBuf[CFG_TUD_CDC][CDC_TX_BUFFER_SIZE];
+	static volatile uint32_t txHead[CFG_TUD_CDC]; // Written only by producers
+	static volatile uint32_t txTail[CFG_TUD_CDC]; // Written only by the drain
+	static CDCTxStats txStats[CFG_TUD_CDC];
 	CDCcomm();
 	virtual ~CDCcomm();
-	static cpp_freertos::BinarySemaphore cdcSems[CFG_TUD_CDC];
+	static cpp_freertos::BinarySemaphore cdcSems[CFG_TUD_CDC]; // Producer lock
+	static cpp_freertos::BinarySemaphore drainSems[CFG_TUD_CDC];
+	static cpp_freertos::BinarySemaphore spaceSems[CFG_TUD_CDC]; // Given when a finished transfer frees space
 };
 
 #endif /* SRC_CDCCOMM_H_ */
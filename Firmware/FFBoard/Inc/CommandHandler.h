@@ -13,6 +13,7 @@
 #include "mutex.hpp"
 #include "ClassIDs.h"
 #include <vector>
+#include <memory>
 
 
 #define CMDFLAG_GET	 	0x01
@@ -37,10 +38,11 @@ enum class CMDtype : uint32_t{
 };
 
 enum class CommandStatus : uint8_t {NOT_FOUND,OK,ERR,NO_REPLY,BROADCAST};
-enum class CommandReplyType : uint8_t {NONE,ACK,INT,STRING,STRING_OR_INT,STRING_OR_DOUBLEINT,DOUBLEINTS};
+enum class CommandReplyType : uint8_t {NONE,ACK,INT,STRING,STRING_OR_INT,STRING_OR_DOUBLEINT,DOUBLEINTS,STREAM};
 
 class CommandInterface;
 class CommandHandler; // defined lower
+class ReplyWriter;
 
 struct CmdHandlerCommanddef
 {
@@ -67,9 +69,24 @@ struct ParsedCommand
     uint8_t instance = 0xFF; // instance number. decided by the class. 0xFF if all instances are targeted
     CommandHandler* target = nullptr; // Directly target a handler
     CMDtype type = CMDtype::none;
+    uint8_t seq = 0; // Optional sequence id set by the interface to match replies to requests
 };
 
 
+/**
+ * Produces a long string reply piece by piece while it is written to a string interface.
+ * pos is a cursor owned by the caller and starts at 0. Returns false when finished.
+ * Keeps no state itself so multiple interfaces can format the same reply
+ */
+class ReplyGenerator {
+public:
+	virtual ~ReplyGenerator(){};
+	virtual bool generate(ReplyWriter& out,uint32_t& pos) = 0;
+protected:
+	static const uint32_t POS_STARTED = 0x80000000; // Set in the cursor after the first item
+	static uint32_t writeSeparator(ReplyWriter& out,uint32_t& pos,const char* separator);
+};
+
 /**
  * Reply object for command handlers
  */
@@ -82,8 +99,10 @@ public:
 	CommandReply(std::string reply) : reply(reply), type(CommandReplyType::STRING){};
 	CommandReply(std::string reply,int64_t val) : reply(reply),val(val), type(CommandReplyType::STRING_OR_INT){};
 	CommandReply(std::string reply,int64_t val,int64_t adr) : reply(reply),val(val),adr(adr), type(CommandReplyType::STRING_OR_DOUBLEINT){};
+	CommandReply(std::shared_ptr<ReplyGenerator> generator) : generator(generator), type(CommandReplyType::STREAM){};
 
     std::string reply;
+    std::shared_ptr<ReplyGenerator> generator; // Only for streamed replies
     int64_t val = 0;
     int64_t adr = 0;
     CommandReplyType type = CommandReplyType::ACK;
@@ -115,6 +134,7 @@ public:
 	static std::vector<CommandHandler*> cmdHandlers; //!< List of all registered command handlers to be called on commands
 	static std::set<uint16_t> cmdHandlerIDs; //!< Reserves dynamic unique IDs to keep track of command handlers
 	static cpp_freertos::MutexStandard cmdHandlerListMutex;
+	static cpp_freertos::MutexRecursive commandMutex; //!< Locked while a command executes. Handlers are not reentrant
 	/**
 	 * Type of this class. Mainclass, motordriver...
 	 * Should be implemented by the parent class so it is not in the info struct
@@ -166,6 +186,7 @@ public:
 
 	virtual CmdHandlerCommanddef* getCommandFromName(const std::string& cmd,uint32_t ignoredFlags=0);
 	virtual CmdHandlerCommanddef* getCommandFromId(const uint32_t id,uint32_t ignoredFlags=0);
+	const std::vector<CmdHandlerCommanddef>& getRegisteredCommands(){return registeredCommands;};
 
 protected:
 	void setInstance(uint8_t instance);
@@ -247,4 +268,16 @@ protected:
 
 };
 
+/**
+ * Streams the help or csv help of a command handler
+ */
+class CommandHelpGenerator : public ReplyGenerator {
+public:
+	CommandHelpGenerator(CommandHandler* handler,bool csv) : handler(handler),csv(csv){};
+	bool generate(ReplyWriter& out,uint32_t& pos) override;
+private:
+	CommandHandler* handler;
+	bool csv;
+};
+
 #endif /* COMMANDHANDLER_H_ */
@@ -17,6 +17,49 @@
 
 class FFBoardMainCommandThread;
 
+/**
+ * Output for formatted string replies. Integers are formatted in place without temporary strings
+ */
+class ReplyWriter {
+public:
+	virtual ~ReplyWriter(){};
+	virtual void write(const char* buf,uint32_t len) = 0;
+	void write(const char* str){write(str,strlen(str));};
+	void write(const std::string& str){write(str.data(),str.size());};
+	void write(char c){write(&c,1);};
+	void writeInt(int64_t val);
+};
+
+/**
+ * Appends replies to a string
+ */
+class StringReplyWriter : public ReplyWriter {
+public:
+	StringReplyWriter(std::string& str) : str(str){};
+	void write(const char* buf,uint32_t len) override {str.append(buf,len);};
+	using ReplyWriter::write;
+private:
+	std::string& str;
+};
+
+/**
+ * Collects replies in a fixed buffer and passes full chunks to the cdc transmit buffer
+ */
+class CDCReplyWriter : public ReplyWriter {
+public:
+	CDCReplyWriter(uint8_t itf = 0,bool waitForSpace = true) : itf(itf),waitForSpace(waitForSpace){};
+	~CDCReplyWriter(){flush();};
+	void write(const char* buf,uint32_t len) override;
+	using ReplyWriter::write;
+	void flush();
+private:
+	static const uint32_t bufferSize = 128;
+	char buffer[bufferSize];
+	uint32_t used = 0;
+	uint8_t itf;
+	bool waitForSpace; // Drop immediately if the buffer is full if false
+};
+
 /**
  * Different command interface implementations
  */
@@ -30,9 +73,10 @@ public:
 	const virtual std::string getHelpstring(){return "";};
 	virtual bool getNewCommands(std::vector<ParsedCommand>& commands) = 0;
 	virtual bool hasNewCommands();
-	static void broadcastCommandReplyAsync(std::vector<CommandReply>& reply,CommandHandler* handler, uint32_t cmdId,CMDtype type);
+	static void broadcastCommandReplyAsync(std::vector<CommandReply>& reply,CommandHandler* handler, uint32_t cmdId,CMDtype type,uint8_t seq = 0);
 	virtual void sendReplies(std::vector<CommandResult>& results,CommandInterface* originalInterface); // All commands from batch done
 	virtual bool readyToSend();
+	virtual bool streamsReplies(){return false;}; // True if STREAM replies can be expanded by this interface
 protected:
 	bool parserReady = false;
 };
@@ -47,9 +91,11 @@ public:
 	uint32_t bufferCapacity();
 	bool getNewCommands(std::vector<ParsedCommand>& commands) override;
 	static void formatReply(std::string& reply,const std::vector<CommandResult>& results,const bool formatWriteAsRead=false);
-	static std::string formatOriginalCommandFromResult(const ParsedCommand& originalCommand,CommandHandler* commandHandler,const bool formatWriteAsRead=false);
-	static void generateReplyValueString(std::string& replyPart,const CommandReply& reply);
-	static void generateReplyFromCmd(std::string& replyPart,const ParsedCommand& originalCommand);
+	static void formatReply(ReplyWriter& out,const std::vector<CommandResult>& results,const bool formatWriteAsRead=false);
+	static void formatOriginalCommandFromResult(ReplyWriter& out,const ParsedCommand& originalCommand,CommandHandler* commandHandler,const bool formatWriteAsRead=false);
+	static void generateReplyValueString(ReplyWriter& out,const CommandReply& reply);
+	static void generateReplyFromCmd(ReplyWriter& out,const ParsedCommand& originalCommand);
+	bool streamsReplies() override {return true;};
 	const std::string getHelpstring(){return "Syntax:\nGet: cls.(instance.)cmd? or cls.(instance.)cmd?adr\nSet: cls.(instance.)cmd=val or cls.(instance.)cmd=val?adr";};
 
 
@@ -70,6 +116,7 @@ public:
 private:
 	bool enableBroadcastFromOtherInterfaces = true;
 	const uint32_t parserTimeout = 2000;
+	cpp_freertos::MutexStandard replyMutex; // Streamed replies may block. Prevents interleaving with broadcasts
 };
 
 
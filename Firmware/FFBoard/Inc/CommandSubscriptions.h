@@ -0,0 +1,63 @@
+/*
+ * CommandSubscriptions.h
+ *
+ *  Created on: 19.10.2026
+ *      Author: Yannick
+ */
+
+#ifndef INC_COMMANDSUBSCRIPTIONS_H_
+#define INC_COMMANDSUBSCRIPTIONS_H_
+
+#include "CommandHandler.h"
+#include "thread.hpp"
+#include "mutex.hpp"
+
+#define SUBSCRIPTIONS_MAX 16
+#define SUBSCRIPTIONS_MINPERIOD 10 // ms
+
+struct CommandSubscription {
+	uint16_t clsid = 0;
+	uint8_t instance = 0;
+	uint32_t cmdId = 0;
+	uint8_t seq = 0; // Sequence id of the subscribing command. Values are streamed to that interface
+};
+
+/**
+ * Streams the values of subscribed get commands periodically to all command interfaces.
+ * Replaces polling single values by the host
+ */
+class CommandSubscriptions : public CommandHandler, public cpp_freertos::Thread {
+	enum class CommandSubscriptions_commands : uint32_t{
+		add,remove,clear,list,rate,data
+	};
+public:
+	CommandSubscriptions();
+	virtual ~CommandSubscriptions();
+
+	static ClassIdentifier info;
+	const ClassIdentifier getInfo();
+	const ClassType getClassType() {return ClassType::Internal;};
+
+	void registerCommands();
+	CommandStatus command(const ParsedCommand& cmd,std::vector<CommandReply>& replies);
+	std::string getHelpstring(){return "Periodic streaming of command values. Add commands with add=cmdid?(clsid<<8|instance)";};
+
+	bool addSubscription(uint16_t clsid,uint8_t instance,uint32_t cmdId,uint8_t seq = 0);
+	bool removeSubscription(uint8_t idx);
+	void clearSubscriptions();
+	bool setRate(uint32_t period);
+
+	void Run();
+
+private:
+	void sample(std::vector<CommandReply>& replies,int16_t seq = -1);
+	void wake();
+
+	CommandSubscription subs[SUBSCRIPTIONS_MAX];
+	uint8_t subCount = 0;
+	uint32_t period = 0; // ms between samples. 0 = stopped
+	cpp_freertos::MutexStandard subsMutex; // Subscriptions are changed by the command thread while streaming
+	std::vector<CommandReply> streamReplies;
+};
+
+#endif /* INC_COMMANDSUBSCRIPTIONS_H_ */
@@ -0,0 +1,52 @@
+/*
+ * ConfigProfiles.h
+ *
+ *  Created on: 19.10.2026
+ *      Author: Yannick
+ */
+
+#ifndef INC_CONFIGPROFILES_H_
+#define INC_CONFIGPROFILES_H_
+
+#include "CommandHandler.h"
+#include "PersistentStorage.h"
+#include "eeprom_addresses.h"
+
+#define PROFILE_VERSION 1
+
+/**
+ * Stores sets of tuning values (power, degrees, gains, filters, pids) and switches between them without writing the main config.
+ *
+ * A profile is a versioned list of sections. Each section starts with (length << 12 | key)
+ * followed by the values of the PersistentStorage instance with that profile key.
+ * Sections of instances that do not exist when loading are skipped.
+ */
+class ConfigProfiles : public CommandHandler, public PersistentStorage {
+	enum class ConfigProfiles_commands : uint32_t{
+		save,load,erase,list,active
+	};
+public:
+	ConfigProfiles();
+	virtual ~ConfigProfiles();
+
+	static ClassIdentifier info;
+	const ClassIdentifier getInfo();
+	const ClassType getClassType() {return ClassType::Internal;};
+
+	void registerCommands();
+	CommandStatus command(const ParsedCommand& cmd,std::vector<CommandReply>& replies);
+	std::string getHelpstring(){return "Stored tuning profiles. Applied in RAM. Use sys.save to keep the active values as the main config";};
+
+	void saveFlash() override;
+	void restoreFlash() override;
+
+	bool saveProfile(uint8_t profile);
+	bool loadProfile(uint8_t profile);
+	bool eraseProfile(uint8_t profile);
+	uint8_t getProfileLength(uint8_t profile);
+
+private:
+	uint8_t activeProfile = 0xff; // 0xff = none
+};
+
+#endif /* INC_CONFIGPROFILES_H_ */
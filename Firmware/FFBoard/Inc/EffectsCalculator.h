@@ -41,6 +41,9 @@ public:
 
 	void saveFlash();
 	void restoreFlash();
+	uint16_t getProfileKey() override;
+	uint8_t saveProfile(uint16_t* buf,uint8_t maxLen) override;
+	void loadProfile(const uint16_t* buf,uint8_t len) override;
 
 //	virtual bool processHidCommand(HID_Custom_Data_t* data);
 	bool isActive();
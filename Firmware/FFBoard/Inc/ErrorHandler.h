@@ -9,6 +9,7 @@
 #define SRC_ERRORHANDLER_H_
 #include <vector>
 #include <string>
+#include <string.h>
 #include "thread.hpp"
 #include "CommandHandler.h"
 
@@ -20,6 +21,7 @@ enum class ErrorCode : uint32_t{
 			none = 0,
 			shutdown = 1,
 			emergencyStop = 2,
+			flashWriteFailed = 3,
 			systemError = 5,
 
 			cmdNotFound = 5,
@@ -46,44 +48,79 @@ enum class ErrorType : uint8_t{
 	warning,critical,temporary
 };
 
+#define ERROR_INFO_LEN 48 // Including terminator. Longer info strings are truncated
+
+/*
+ * Info is stored inline so errors can be copied without allocating. Required for posting them from fault paths and ISRs
+ */
 class Error{
 public:
-	Error();
-	Error(ErrorCode code, ErrorType type, std::string info) : code(code), type(type), info(info){};
+	Error(){};
+	Error(ErrorCode code, ErrorType type, const char* info) : code(code), type(type){
+		setInfo(info);
+	};
 	ErrorCode code = ErrorCode::none;
 	ErrorType type = ErrorType::warning;
-	std::string info = "";
+	char info[ERROR_INFO_LEN] = "";
 
 	std::string toString();
+	void setInfo(const char* info){
+		strncpy(this->info, info, ERROR_INFO_LEN - 1);
+		this->info[ERROR_INFO_LEN - 1] = 0;
+	}
+	void appendInfo(const char* info){
+		strncat(this->info, info, ERROR_INFO_LEN - 1 - strlen(this->info));
+	}
 
 	/*
-	 * Errors are equivalent if their code and type match
+	 * Errors are equivalent if their code, type and info match
 	 */
-	bool operator ==(const Error &b){return (this->code == b.code && this->type == b.type && this->info == b.info);}
+	bool operator ==(const Error &b) const {return (this->code == b.code && this->type == b.type && strncmp(this->info, b.info, ERROR_INFO_LEN) == 0);}
 
 };
 
 
 
 
+enum class ErrorEventType : uint8_t{
+	add,clear,clearCode
+};
+
+struct ErrorEvent{
+	ErrorEventType type = ErrorEventType::add;
+	Error error;
+};
+
+/*
+ * Errors are posted into a fixed size lock-free ring and processed by the error dispatcher thread.
+ * Posting is safe from threads and ISRs and never blocks or allocates.
+ * Deduplication and the errorCallback fan-out happen in the dispatcher thread.
+ */
 class ErrorHandler {
 public:
 	static std::vector<ErrorHandler*> errorHandlers;
 
 	ErrorHandler();
 	virtual ~ErrorHandler();
-	virtual void errorCallback(Error &error, bool cleared); // Called when a new error happened. Warning: Could be called from ISR!
+	virtual void errorCallback(Error &error, bool cleared); // Called from the error dispatcher thread when an error is added or cleared
 
-	static void addError(Error error);
-	static void clearError(Error error);
+	static void addError(const Error &error);
+	static void clearError(const Error &error);
 	static void clearError(ErrorCode errorcode);
 	static void clearTemp();
 	static void clearAll();
 
-	static std::vector<Error>* getErrors(); // Returns a vector of active errors
+	static std::vector<Error> getErrors(); // Returns a copy of the active errors
+	static uint32_t getDroppedEvents(); // Events lost because the ring was full
 
 protected:
 	static std::vector<Error> errors;
+
+private:
+	friend class ErrorDispatcher;
+	static void processEvents();
+	static void processEvent(ErrorEvent &event);
+	static bool postEvent(ErrorEventType type,const Error &error);
 };
 
 /*
@@ -103,7 +140,6 @@ public:
 //	const ClassType getClassType(){return ClassType::Internal;};
 private:
 	bool enabled = true;
-	//std::vector<Error> errorsToPrint;
 };
 
 #endif /* SRC_ERRORHANDLER_H_ */
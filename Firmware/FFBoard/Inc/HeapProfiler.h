@@ -0,0 +1,63 @@
+/*
+ * HeapProfiler.h
+ *
+ *  Created on: 19.10.2026
+ *      Author: Yannick
+ */
+
+#ifndef INC_HEAPPROFILER_H_
+#define INC_HEAPPROFILER_H_
+
+#include "main.h"
+#include "target_constants.h"
+#include <string>
+
+#ifdef HEAPPROFILER
+#define HEAPPROFILER_SITES 32 // Tracked call sites. Further sites are counted as other
+#define HEAPPROFILER_CTRLTASKS 4 // Tasks that can be in the control path at the same time
+
+struct HeapProfilerSite {
+	uintptr_t caller = 0; // Return address of malloc or new. Resolve with addr2line
+	uint32_t count = 0;
+	uint32_t bytes = 0;
+	uint16_t controlPath = 0; // Allocations while the control path was running
+	uint16_t isr = 0; // Allocations in interrupts
+};
+
+/**
+ * Counts allocations per call site at the malloc/new override in cppmain.cpp.
+ * Allocations in interrupts and the marked control path are counted separately so they can be removed
+ */
+class HeapProfiler {
+public:
+	static void recordAlloc(size_t size,void* caller,bool success);
+	static void recordFree();
+	static void reset();
+
+	static void enterControlPath();
+	static void exitControlPath();
+
+	static std::string getSummaryString();
+	static uint8_t getSites(HeapProfilerSite* buf,uint8_t len);
+
+	static uint32_t allocs;
+	static uint32_t frees;
+	static uint32_t failed;
+	static uint32_t controlPathAllocs;
+	static uint32_t isrAllocs;
+	static uint32_t otherAllocs; // Allocations from untracked call sites
+
+private:
+	static void* controlPathTasks[HEAPPROFILER_CTRLTASKS]; // Tasks currently running the control path
+	static HeapProfilerSite sites[HEAPPROFILER_SITES];
+	static uint8_t siteCount;
+};
+#else
+class HeapProfiler {
+public:
+	static inline void enterControlPath(){};
+	static inline void exitControlPath(){};
+};
+#endif
+
+#endif /* INC_HEAPPROFILER_H_ */
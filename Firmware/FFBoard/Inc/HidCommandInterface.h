@@ -30,6 +30,41 @@ typedef struct
 
 } __attribute__((packed)) HID_CMD_Data_t;
 
+/*
+ * Batched command report. Carries multiple variable length entries:
+ * 0x00 uint8	flags: type (bits 0-3), data size (bits 4-5: 0 = none, 1 = 2B, 2 = 4B, 3 = 8B, sign extended), 8B address follows (bit 6)
+ * 0x01 uint8	sequence id (1-255). Replies carry the id of the request. 0 is reserved for single reports
+ * 0x02 uint16	class id
+ * 0x04 uint8	instance
+ * 0x05 uint32	cmd
+ * 0x09 data and address
+ */
+#define HIDCMD_BATCH_SIZE 62 // Fills a 64B report
+#define HIDCMD_ENTRY_HEADER 9
+#define HIDCMD_ENTRY_TYPEMASK 0x0F
+#define HIDCMD_ENTRY_SIZESHIFT 4
+#define HIDCMD_ENTRY_ADDR 0x40
+typedef struct
+{
+	uint8_t		reportId = HID_ID_HIDCMD_BATCH;
+	uint8_t		count = 0;						// Number of entries
+	uint8_t		entries[HIDCMD_BATCH_SIZE] = {0};	// Packed entries
+} __attribute__((packed)) HID_CMD_Batch_t;
+
+/*
+ * Unpacked command or reply of single or batched reports
+ */
+struct HID_CMD_Entry_t
+{
+	HidCmdType	type = HidCmdType::err;
+	uint8_t		seq = 0; // 0 for single reports
+	uint16_t	clsid = 0;
+	uint8_t		instance = 0;
+	uint32_t	cmd = 0;
+	uint64_t	data = 0;
+	uint64_t	addr = 0;
+};
+
 
 
 class HID_CommandInterface : public CommandInterface, public cpp_freertos::Thread{
@@ -44,15 +79,21 @@ public:
 	//bool hasNewCommands();
 	void sendReplies(std::vector<CommandResult>& results,CommandInterface* originalInterface); // All commands from batch done
 	void hidCmdCallback(HID_CMD_Data_t* data);
+	void hidCmdBatchCallback(HID_CMD_Batch_t* batch,uint16_t len);
 	bool sendHidCmd(HID_CMD_Data_t* data);
+	bool sendHidCmdBatch(HID_CMD_Batch_t* batch);
+	static uint8_t packEntry(uint8_t* buf,uint8_t space,const HID_CMD_Entry_t& entry);
+	static uint8_t unpackEntry(const uint8_t* buf,uint8_t space,HID_CMD_Entry_t& entry);
 	void queueReplyValues(CommandReply& reply,ParsedCommand& command);
 	void transferComplete(uint8_t itf, uint8_t const* report, uint8_t len);
 	bool readyToSend();
 	void Run();
 
 private:
+	bool parseHidCmd(HID_CMD_Entry_t& entry);
 	std::vector<ParsedCommand> commands;
-	std::vector<HID_CMD_Data_t> outBuffer;
+	std::vector<HID_CMD_Entry_t> outBuffer;
+	std::vector<HID_CMD_Entry_t> sendBuffer; // Replies currently sent by the thread
 	bool enableBroadcastFromOtherInterfaces = true; // TODO make configurable via command
 	static cpp_freertos::BinarySemaphore threadSem;
 	const uint32_t maxQueuedReplies = 50;
@@ -20,6 +20,11 @@ public:
 
 	virtual void saveFlash(); 		// Write to flash here
 	virtual void restoreFlash();	// Load from flash
+
+	// Config profiles. See ConfigProfiles.h
+	virtual uint16_t getProfileKey(){return 0;};	// Unique flash address of this instance (max 0xFFF). 0 if it has no profile values
+	virtual uint8_t saveProfile(uint16_t* buf,uint8_t maxLen){return 0;};	// Copy the current values. Returns the count
+	virtual void loadProfile(const uint16_t* buf,uint8_t len){};	// Apply values in RAM without writing to flash
 };
 
 #endif /* PERSISTENTSTORAGE_H_ */
@@ -9,6 +9,7 @@
 #define SPI_H_
 
 #include <vector>
+#include <array>
 #include "cppmain.h"
 
 #include "stm32f4xx_hal.h"
@@ -32,6 +33,24 @@ struct SPIConfig {
 		peripheral.TIMode = SPI_TIMODE_DISABLE;
 		peripheral.CRCCalculation = SPI_CRCCALCULATION_DISABLE;
 		peripheral.CRCPolynomial = 10;
+		updateRegisterImage();
+	}
+
+	/*
+	 * Precalculates the CR1 and CR2 register values for the peripheral settings.
+	 * Call after changing the peripheral config
+	 */
+	void updateRegisterImage(){
+		cr1 = (peripheral.Mode & (SPI_CR1_MSTR | SPI_CR1_SSI)) |
+			(peripheral.Direction & (SPI_CR1_RXONLY | SPI_CR1_BIDIMODE)) |
+			(peripheral.DataSize & SPI_CR1_DFF) |
+			(peripheral.CLKPolarity & SPI_CR1_CPOL) |
+			(peripheral.CLKPhase & SPI_CR1_CPHA) |
+			(peripheral.NSS & SPI_CR1_SSM) |
+			(peripheral.BaudRatePrescaler & SPI_CR1_BR_Msk) |
+			(peripheral.FirstBit & SPI_CR1_LSBFIRST) |
+			(peripheral.CRCCalculation & SPI_CR1_CRCEN);
+		cr2 = ((peripheral.NSS >> 16U) & SPI_CR2_SSOE) | (peripheral.TIMode & SPI_CR2_FRF);
 	}
 
 	OutputPin cs;
@@ -39,10 +58,39 @@ struct SPIConfig {
 	/// CSPOL=true === active low
 	bool cspol;
 	SPI_InitTypeDef peripheral;
+	uint32_t cr1 = 0; // Register image of peripheral
+	uint32_t cr2 = 0;
 };
 
 class SPIDevice;
 
+/*
+ * Critical transfers (motor driver, encoders) are served before background transfers (buttons, shifters)
+ */
+enum class SPIPriority : uint8_t {critical = 0, background = 1};
+enum class SPITransferType : uint8_t {tx, rx, txrx};
+
+/*
+ * A queued DMA request waiting for the bus
+ */
+struct SPITransaction {
+	SPIDevice* device = nullptr;
+	SPITransferType type = SPITransferType::rx;
+	const uint8_t* txbuf = nullptr;
+	uint8_t* rxbuf = nullptr;
+	uint16_t size = 0;
+	uint16_t queued = 0;	// micros() when queued
+	uint16_t deadline = 0;	// micros(). Earlier deadlines go first within a priority class
+};
+
+struct SPIDeviceStats {
+	uint32_t transfers = 0;
+	uint32_t busTime = 0;	// Total time the device occupied the bus in µs
+	uint16_t maxBusTime = 0;	// Longest single transfer in µs
+	uint16_t maxWait = 0;	// Longest time a queued request waited for the bus in µs
+	uint32_t dropped = 0;	// Requests rejected because the queue was full
+};
+
 class SPIPort: public SpiHandler {
 public:
 	SPIPort(SPI_HandleTypeDef &hspi,const std::vector<OutputPin>& csPins,bool allowReconfigure = true);
@@ -51,6 +99,7 @@ public:
 	void giveSemaphore(); // Call when finished using this port
 
 	void configurePort(SPI_InitTypeDef* config); // Reconfigures the spi port
+	void configurePort(SPIConfig* config); // Fast reconfiguration using the precalculated register image
 
 	std::vector<OutputPin>& getCsPins();
 	OutputPin* getCsPin(uint16_t idx);
@@ -59,6 +108,8 @@ public:
 	bool freeCsPin(OutputPin pin); // Signals that this cs pin is not used anymore. Call this in the destructor
 	bool isPinFree(OutputPin pin); // Returns if a pin is assigned to this port and not in use
 
+	// DMA transfers are queued and start as soon as the bus is free. Blocking transfers always go first
+	bool queueTransfer(SPIDevice* device,SPITransferType type,const uint8_t* txbuf,uint8_t* rxbuf,uint16_t size);
 	void transmit_DMA(const uint8_t* buf,uint16_t size,SPIDevice* device);
 	void transmitReceive_DMA(const uint8_t* txbuf,uint8_t* rxbuf,uint16_t size,SPIDevice* device);
 	void receive_DMA(uint8_t* buf,uint16_t size,SPIDevice* device);
@@ -73,17 +124,37 @@ public:
 
 	bool isTaken(); // Returns true if semaphore was taken by another task
 
+	void registerDevice(SPIDevice* device);
+	void unregisterDevice(SPIDevice* device);
+	std::vector<SPIDevice*>& getDevices();
+
+	static std::vector<SPIPort*>& getPorts() {
+		static std::vector<SPIPort*> spiPorts{};
+		return spiPorts;
+	}
+
 private:
 	void beginTransfer(SPIConfig* config);
 	void endTransfer(SPIConfig* config);
 
+	bool tryTakeSemaphore();
+	bool dispatchQueued(); // Starts the most urgent queued transfer if nobody is waiting for the bus
+	void startTransaction(SPITransaction& transaction); // Bus must be owned
+	void transferDone(SPIDevice* device);
+
+	std::array<SPITransaction,8> queue;
+	uint8_t queueCount = 0;
+	volatile uint8_t waitingTasks = 0; // Tasks blocked in takeSemaphore
+	uint16_t transferStart = 0;
+	std::vector<SPIDevice*> devices;
+
 	SPI_HandleTypeDef &hspi;
 	SPIDevice* current_device = nullptr;
 	std::vector<OutputPin> csPins; // cs pins and bool true if pin is reserved
 	std::vector<OutputPin> freePins;
 
 	cpp_freertos::BinarySemaphore semaphore = cpp_freertos::BinarySemaphore(true);
-	bool allowReconfigure = false; // Allow reconfiguration at runtime. Can reduce performance a lot
+	bool allowReconfigure = false; // Allow reconfiguration at runtime for devices with different modes on one port
 	bool isTakenFlag = false;
 };
 
@@ -104,15 +175,23 @@ public:
 	virtual void spiTxRxCompleted(SPIPort* port) { }
 	virtual void spiRequestError(SPIPort* port) { }
 
-	virtual void beginSpiTransfer(SPIPort* port);
+	virtual void beginSpiTransfer(SPIPort* port,bool busOwned = false);
 	virtual void endSpiTransfer(SPIPort* port);
 
 	virtual SPIConfig* getSpiConfig(){return &this->spiConfig;}
 
+	SPIPriority getSpiPriority(){return spiPriority;}
+	uint16_t getSpiDeadline(){return spiDeadline;}
+	SPIDeviceStats& getSpiStats(){return spiStats;}
+	SPIPort& getSpiPort(){return spiPort;}
+
 protected:
 	virtual void setSpiConfig(SPIConfig config){spiConfig = config;}
 	SPIPort& spiPort;
 	SPIConfig spiConfig;
+	SPIPriority spiPriority = SPIPriority::background;
+	uint16_t spiDeadline = 1000; // µs a queued request may wait before it becomes urgent
+	SPIDeviceStats spiStats;
 };
 
 #endif
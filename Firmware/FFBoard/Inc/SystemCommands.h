@@ -11,7 +11,7 @@
 #include "CommandHandler.h"
 
 enum class FFBoardMain_commands : uint32_t{
-	help=0,save=1,reboot=2,dfu=3,swver=4,hwtype=5,lsmain,main,lsactive,format,errors,errorsclr,flashdump,flashraw,vint,vext,mallinfo,heapfree,taskstats,debug,devid
+	help=0,save=1,reboot=2,dfu=3,swver=4,hwtype=5,lsmain,main,lsactive,format,errors,errorsclr,flashdump,flashraw,vint,vext,mallinfo,heapfree,taskstats,debug,devid,spistats,canstats,canids,cdcstats,timing,heapstats
 };
 
 class SystemCommands : public CommandHandler {
@@ -30,6 +30,10 @@ public:
 
 	static void replyFlashDump(std::vector<CommandReply>& replies);
 	static void replyErrors(std::vector<CommandReply>& replies);
+	static void replySpiStats(std::vector<CommandReply>& replies);
+	static CommandStatus replyCanStats(const ParsedCommand& cmd,std::vector<CommandReply>& replies);
+	static CommandStatus replyCanIds(const ParsedCommand& cmd,std::vector<CommandReply>& replies);
+	static void replyHeapStats(std::vector<CommandReply>& replies);
 
 	static bool allowDebugCommands; // Global flag that controls the debug mode
 
@@ -38,4 +42,33 @@ public:
 
 };
 
+/**
+ * Streams the interface help, the list of classes and the system commands
+ */
+class SystemHelpGenerator : public ReplyGenerator {
+public:
+	SystemHelpGenerator(const std::string& interfaceHelp,CommandHandler* system) : interfaceHelp(interfaceHelp),commandHelp(system,false){};
+	bool generate(ReplyWriter& out,uint32_t& pos) override;
+private:
+	static const uint32_t POS_COMMANDS = 0x40000000; // Remaining cursor belongs to commandHelp
+	std::string interfaceHelp;
+	CommandHelpGenerator commandHelp;
+};
+
+/**
+ * Streams all stored flash variables as val:adr lines
+ */
+class FlashDumpGenerator : public ReplyGenerator {
+public:
+	bool generate(ReplyWriter& out,uint32_t& pos) override;
+};
+
+/**
+ * Streams the active command handlers as name:clsname:inst:id:handlerid lines
+ */
+class LsActiveGenerator : public ReplyGenerator {
+public:
+	bool generate(ReplyWriter& out,uint32_t& pos) override;
+};
+
 #endif /* SRC_SYSTEMCOMMANDS_H_ */
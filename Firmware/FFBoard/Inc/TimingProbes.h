@@ -0,0 +1,80 @@
+/*
+ * TimingProbes.h
+ *
+ *  Created on: 19.10.2026
+ *      Author: Yannick
+ */
+
+#ifndef INC_TIMINGPROBES_H_
+#define INC_TIMINGPROBES_H_
+
+#include "main.h"
+#include <string>
+
+#define TIMING_HIST_BINS 12 // Bin 0: <2µs, bin n: 2^n to 2^(n+1)-1 µs, last bin: everything above
+
+enum class TimingProbeId : uint8_t {
+	mainloop,	// Period of the main loop
+	ctrltick,	// Period between control updates. Jitter of the usb SOF or emulated tick
+	ffbupdate,	// Duration of the control path
+	cmdexec,	// Duration of executing a batch of commands
+	usbsof,		// Period between usb SOF interrupts
+	hidout,		// Duration of the hid out report callback
+	COUNT
+};
+
+/**
+ * Measures durations or periods with the DWT cycle counter.
+ * Each probe must only be used from one context
+ */
+class TimingProbe {
+public:
+	TimingProbe(const char* name,uint32_t deadline) : name(name),deadline(deadline){};
+
+	// Duration between begin and end
+	inline void begin(){
+		startCycles = DWT->CYCCNT;
+	}
+	inline void end(){
+		record(DWT->CYCCNT - startCycles);
+	}
+	// Period between two calls
+	inline void tick(){
+		uint32_t now = DWT->CYCCNT;
+		if(started){
+			record(now - startCycles);
+		}
+		startCycles = now;
+		started = true;
+	}
+
+	void record(uint32_t cycles);
+	void reset();
+	std::string getStatsString();
+
+	const char* name;
+	const uint32_t deadline; // µs. Longer samples are counted as overruns. 0 to disable
+	volatile uint32_t count = 0;
+	volatile uint32_t overruns = 0;
+	volatile uint32_t min = 0xffffffff; // µs
+	volatile uint32_t max = 0; // µs
+	volatile uint64_t sum = 0; // µs
+	volatile uint32_t hist[TIMING_HIST_BINS] = {0};
+
+private:
+	uint32_t startCycles = 0;
+	bool started = false;
+};
+
+class TimingProbes {
+public:
+	static void init();
+	static void resetAll();
+	static inline TimingProbe& get(TimingProbeId id){
+		return probes[(uint8_t)id];
+	}
+	static TimingProbe probes[(uint8_t)TimingProbeId::COUNT];
+	static uint32_t cyclesPerUs;
+};
+
+#endif /* INC_TIMINGPROBES_H_ */
@@ -18,6 +18,7 @@ static const uint8_t SW_VERSION_INT[3] = {1,6,2}; // Version as array. 8 bit eac
 #ifndef CANBUS
 #undef ODRIVE
 #undef VESC
+#undef CANAXIS
 #endif
 
 #endif
@@ -116,6 +116,7 @@
 uint16_t EE_Init(void);
 uint16_t EE_ReadVariable(uint16_t VirtAddress, uint16_t* Data);
 uint16_t EE_WriteVariable(uint16_t VirtAddress, uint16_t Data);
+uint16_t EE_WriteVariables(const uint16_t* VirtAddress, const uint16_t* Data, uint16_t Count);
 HAL_StatusTypeDef EE_Format();
 
 #endif /* __EEPROM_H */
@@ -65,6 +65,7 @@
 #define HID_ID_CUSTOMCMD 0xAF   // Custom cmd (old. reserved)
 #define HID_ID_HIDCMD	 0xA1   // HID cmd
 #define HID_ID_STRCMD	 0xAC   // HID cmd as string. reserved
+#define HID_ID_HIDCMD_BATCH 0xA3   // Multiple HID cmds per report
 //#define HID_ID_CUSTOMCMD_IN 0xA2   // Custom cmd in. reserved
 //#define HID_ID_CUSTOMCMD_OUT 0xA1   // Custom cmd out. reserved
 
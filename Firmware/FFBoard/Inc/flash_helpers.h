@@ -27,6 +27,11 @@ bool Flash_Write(uint16_t adr,uint16_t dat); // Writes or updates only if change
 bool Flash_Read(uint16_t adr,uint16_t *buf); // returns true if found, false if error
 bool Flash_ReadWriteDefault(uint16_t adr,uint16_t *buf,uint16_t def); // returns and writes def if variable is missing
 void Flash_Dump(std::vector<std::tuple<uint16_t,uint16_t>> *result);
+void Flash_BeginBatch(); // Defers Flash_Write until Flash_CommitBatch
+void Flash_CommitBatch(); // Writes all deferred variables at once from a low priority thread
+bool Flash_BatchBusy(); // True while deferred variables are not written yet
+bool Flash_WaitCommit(uint32_t timeout = 2000); // Blocks until all deferred variables are written. Returns false on timeout
+HAL_StatusTypeDef Flash_Format(); // Erases all variables and drops deferred writes
 
 template<typename TVal>
 inline TVal Flash_Read(uint16_t adr, TVal def) {
@@ -143,6 +143,33 @@ void Axis::saveFlash(){
 	Flash_Write(flashAddrs.effects1, idlespringstrength | (damperIntensity << 8));
 }
 
+/**
+ * Tuning values that are switched with config profiles
+ */
+uint8_t Axis::saveProfile(uint16_t* buf,uint8_t maxLen){
+	if(maxLen < 4){
+		return 0;
+	}
+	buf[0] = fx_ratio_i | (endstop_gain << 8);
+	buf[1] = power;
+	buf[2] = (degreesOfRotation & 0x7fff) | (invertAxis << 15);
+	buf[3] = idlespringstrength | (damperIntensity << 8);
+	return 4;
+}
+
+void Axis::loadProfile(const uint16_t* buf,uint8_t len){
+	if(len < 4){
+		return;
+	}
+	fx_ratio_i = buf[0] & 0xff;
+	endstop_gain = (buf[0] >> 8) & 0xff;
+	setPower(buf[1]);
+	this->invertAxis = (buf[2] >> 15) & 0x1;
+	setDegrees(buf[2] & 0x7fff);
+	setIdleSpringStrength(buf[3] & 0xff);
+	setDamperStrength((buf[3] >> 8) & 0xff);
+}
+
 
 uint8_t Axis::getDrvType(){
 	return (uint8_t)this->conf.drvtype;
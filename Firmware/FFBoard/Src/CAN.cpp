@@ -8,13 +8,19 @@
 #include "target_constants.h"
 #ifdef CANBUS
 #include "CAN.h"
+#include "critical.hpp"
 
 
 CANPort::CANPort(CAN_HandleTypeDef &hcan) : hcan(&hcan) {
 	//HAL_CAN_Start(this->hcan);
+	getPorts().push_back(this);
 }
 
 CANPort::~CANPort() {
+	auto it = std::find(getPorts().begin(), getPorts().end(), this);
+	if(it != getPorts().end()){
+		getPorts().erase(it);
+	}
 	// removes all filters
 	for (uint8_t i = 0; i < canFilters.size(); i++){
 		canFilters[i].FilterActivation = false;
@@ -115,6 +121,10 @@ void CANPort::setSpeedPreset(uint8_t preset){
 	HAL_CAN_ResetError(hcan);
 
 	HAL_CAN_Start(this->hcan);
+	activateNotifications();
+	BaseType_t savedInterruptStatus = cpp_freertos::CriticalSection::EnterFromISR();
+	fillMailboxes(); // Aborted or queued frames
+	cpp_freertos::CriticalSection::ExitFromISR(savedInterruptStatus);
 	giveSemaphore();
 }
 
@@ -153,53 +163,307 @@ void CANPort::giveSemaphore(){
  * Transmits a CAN frame on this port
  * Wraps the internal transmit function
  */
-bool CANPort::sendMessage(CAN_tx_msg msg){
-	return this->sendMessage(&msg.header,msg.data,&this->txMailbox);
+bool CANPort::sendMessage(CAN_tx_msg msg,CANPriority priority){
+	return this->sendMessage(&msg.header,msg.data,&this->txMailbox,priority);
 }
 
 /**
- * Transmits a CAN frame with separate data and header settings
+ * Transmits a CAN frame with separate data and header settings.
+ * If all mailboxes are busy the frame is queued and sent from the tx complete interrupt.
+ * Returns false if the frame had to be dropped
  */
-bool CANPort::sendMessage(CAN_TxHeaderTypeDef *pHeader, uint8_t aData[],uint32_t *pTxMailbox){
+bool CANPort::sendMessage(CAN_TxHeaderTypeDef *pHeader, uint8_t aData[],uint32_t *pTxMailbox,CANPriority priority){
 	if(pTxMailbox == nullptr){
 		pTxMailbox = &this->txMailbox;
 	}
-	takeSemaphore();
-	this->isTakenFlag = true;
-	if (HAL_CAN_AddTxMessage(this->hcan, pHeader, aData, pTxMailbox) != HAL_OK)
-	{
-	  /* Transmission request Error */
-	  giveSemaphore();
-	  return false;
+	activateNotifications();
+
+	bool ok = true;
+	BaseType_t savedInterruptStatus = cpp_freertos::CriticalSection::EnterFromISR();
+	if(txQueueHigh.empty() && txQueueNormal.empty() && HAL_CAN_GetTxMailboxesFreeLevel(this->hcan) > 0){
+		ok = HAL_CAN_AddTxMessage(this->hcan, pHeader, aData, pTxMailbox) == HAL_OK;
+	}else{
+		CAN_tx_msg msg;
+		msg.header = *pHeader;
+		memcpy(msg.data, aData, std::min<uint32_t>(pHeader->DLC, 8));
+		if(priority == CANPriority::high){
+			CAN_tx_msg* queued = txQueueHigh.find(msg.header);
+			if(queued != nullptr){ // Replace older setpoint
+				*queued = msg;
+				txOverrun++;
+			}else{
+				ok = txQueueHigh.push(msg);
+			}
+		}else{
+			ok = txQueueNormal.push(msg);
+		}
+		if(!ok){
+			txDropped++;
+		}
 	}
-	giveSemaphore();
-	return true;
+	cpp_freertos::CriticalSection::ExitFromISR(savedInterruptStatus);
+	return ok;
+}
+
+/**
+ * Moves frames from the queues into free mailboxes. High priority frames first
+ */
+void CANPort::fillMailboxes(){
+	CAN_tx_msg msg;
+	uint32_t mailbox;
+	while(HAL_CAN_GetTxMailboxesFreeLevel(this->hcan) > 0){
+		if(!txQueueHigh.pop(msg) && !txQueueNormal.pop(msg)){
+			break;
+		}
+		if(HAL_CAN_AddTxMessage(this->hcan, &msg.header, msg.data, &mailbox) != HAL_OK){
+			txDropped++;
+			break;
+		}
+	}
+}
+
+/**
+ * Enables the tx empty and error interrupts.
+ * Can only be activated after the can peripheral is initialized
+ */
+void CANPort::activateNotifications(){
+	if(notificationsActive){
+		return;
+	}
+	uint32_t its = CAN_IT_TX_MAILBOX_EMPTY | CAN_IT_ERROR_WARNING | CAN_IT_ERROR_PASSIVE | CAN_IT_BUSOFF | CAN_IT_ERROR | CAN_IT_RX_FIFO0_OVERRUN | CAN_IT_RX_FIFO1_OVERRUN;
+	notificationsActive = HAL_CAN_ActivateNotification(this->hcan, its) == HAL_OK;
+}
+
+/**
+ * A frame was sent and its mailbox is free again. Refill it from the queue
+ */
+void CANPort::canTxCpltCallback(CAN_HandleTypeDef *hcan,uint32_t mailbox){
+	if(hcan != this->hcan){
+		return;
+	}
+	uint8_t mailboxIdx = mailbox == CAN_TX_MAILBOX0 ? 0 : (mailbox == CAN_TX_MAILBOX1 ? 1 : 2);
+	CAN_TxMailBox_TypeDef& txMailBox = hcan->Instance->sTxMailBox[mailboxIdx];
+	bool ext = txMailBox.TIR & CAN_TI0R_IDE;
+	uint32_t id = ext ? (txMailBox.TIR >> CAN_TI0R_EXID_Pos) : (txMailBox.TIR >> CAN_TI0R_STID_Pos);
+	countFrame(id, ext, txMailBox.TDTR & CAN_TDT0R_DLC, true);
+
+	BaseType_t savedInterruptStatus = cpp_freertos::CriticalSection::EnterFromISR();
+	fillMailboxes();
+	cpp_freertos::CriticalSection::ExitFromISR(savedInterruptStatus);
+}
+
+void CANPort::canTxAbortCallback(CAN_HandleTypeDef *hcan,uint32_t mailbox){
+	if(hcan != this->hcan){
+		return;
+	}
+	BaseType_t savedInterruptStatus = cpp_freertos::CriticalSection::EnterFromISR();
+	fillMailboxes();
+	cpp_freertos::CriticalSection::ExitFromISR(savedInterruptStatus);
+}
+
+/**
+ * Counts error events. The error code is reset afterwards so each event is only counted once
+ */
+void CANPort::canErrorCallback(CAN_HandleTypeDef *hcan){
+	if(hcan != this->hcan){
+		return;
+	}
+	uint32_t err = hcan->ErrorCode;
+	if(err & HAL_CAN_ERROR_BOF)
+		stats.busOff++;
+	if(err & HAL_CAN_ERROR_EPV)
+		stats.errorPassive++;
+	if(err & HAL_CAN_ERROR_EWG)
+		stats.errorWarning++;
+	if(err & (HAL_CAN_ERROR_RX_FOV0 | HAL_CAN_ERROR_RX_FOV1))
+		stats.rxOverrun++;
+	if(err & (HAL_CAN_ERROR_TX_ALST0 | HAL_CAN_ERROR_TX_TERR0 | HAL_CAN_ERROR_TX_ALST1 | HAL_CAN_ERROR_TX_TERR1 | HAL_CAN_ERROR_TX_ALST2 | HAL_CAN_ERROR_TX_TERR2))
+		stats.txErrors++;
+	HAL_CAN_ResetError(hcan);
+}
+
+/**
+ * Worst case length of a frame in bits including stuff bits and interframe space
+ */
+uint8_t CANPort::frameBits(bool ext,uint8_t dlc){
+	uint8_t stuffed = (ext ? 54 : 34) + 8 * std::min<uint8_t>(dlc, 8); // Bits subject to stuffing
+	return stuffed + 13 + (stuffed - 1) / 4;
+}
+
+/**
+ * Counts a received or sent frame for the rate and load statistics
+ */
+void CANPort::countFrame(uint32_t id,bool ext,uint8_t dlc,bool tx){
+	BaseType_t savedInterruptStatus = cpp_freertos::CriticalSection::EnterFromISR();
+	updateStatsWindow();
+	windowBits += frameBits(ext, dlc);
+	if(tx){
+		stats.txFrames++;
+		windowTx++;
+	}else{
+		stats.rxFrames++;
+		windowRx++;
+	}
+	CANIdStats* entry = nullptr;
+	for(uint8_t i = 0; i < idStatsCount; i++){
+		if(idStats[i].id == id && idStats[i].ext == ext && idStats[i].tx == tx){
+			entry = &idStats[i];
+			break;
+		}
+	}
+	if(entry == nullptr && idStatsCount < idStats.size()){
+		entry = &idStats[idStatsCount++];
+		*entry = CANIdStats();
+		entry->id = id;
+		entry->ext = ext;
+		entry->tx = tx;
+	}
+	if(entry != nullptr){
+		entry->frames++;
+		entry->windowFrames++;
+	}else{
+		stats.untracked++;
+	}
+	cpp_freertos::CriticalSection::ExitFromISR(savedInterruptStatus);
+}
+
+/**
+ * Computes rates and load once the current window is over
+ */
+void CANPort::updateStatsWindow(){
+	uint32_t period = HAL_GetTick() - statsWindowStart;
+	if(period < statsWindow){
+		return;
+	}
+	stats.rxRate = windowRx * 1000 / period;
+	stats.txRate = windowTx * 1000 / period;
+	uint32_t speed = getSpeed();
+	stats.load = speed == 0 ? 0 : ((uint64_t)windowBits * 1000000) / ((uint64_t)speed * period);
+	for(uint8_t i = 0; i < idStatsCount; i++){
+		idStats[i].rate = idStats[i].windowFrames * 1000 / period;
+		idStats[i].windowFrames = 0;
+	}
+	windowRx = 0;
+	windowTx = 0;
+	windowBits = 0;
+	statsWindowStart = HAL_GetTick();
 }
 
+/**
+ * Returns a copy of the bus statistics with the current error counters
+ */
+CANPortStats CANPort::getStats(){
+	BaseType_t savedInterruptStatus = cpp_freertos::CriticalSection::EnterFromISR();
+	updateStatsWindow();
+	CANPortStats s = stats;
+	cpp_freertos::CriticalSection::ExitFromISR(savedInterruptStatus);
+	uint32_t esr = hcan->Instance->ESR;
+	s.tec = (esr & CAN_ESR_TEC) >> CAN_ESR_TEC_Pos;
+	s.rec = (esr & CAN_ESR_REC) >> CAN_ESR_REC_Pos;
+	return s;
+}
 
+/**
+ * Returns a single statistics value. Used for HID requests
+ */
+uint32_t CANPort::getStat(CANStatField field){
+	CANPortStats s = getStats();
+	switch(field){
+	case CANStatField::rxRate:		return s.rxRate;
+	case CANStatField::txRate:		return s.txRate;
+	case CANStatField::load:		return s.load;
+	case CANStatField::tec:			return s.tec;
+	case CANStatField::rec:			return s.rec;
+	case CANStatField::busOff:		return s.busOff;
+	case CANStatField::errorPassive:return s.errorPassive;
+	case CANStatField::errorWarning:return s.errorWarning;
+	case CANStatField::rxOverrun:	return s.rxOverrun;
+	case CANStatField::txErrors:	return s.txErrors;
+	case CANStatField::txQueued:	return getTxQueued();
+	case CANStatField::txDropped:	return txDropped;
+	case CANStatField::txOverrun:	return txOverrun;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * Returns a copy of the per id frame rates
+ */
+std::vector<CANIdStats> CANPort::getIdStats(){
+	BaseType_t savedInterruptStatus = cpp_freertos::CriticalSection::EnterFromISR();
+	updateStatsWindow();
+	std::vector<CANIdStats> ids(idStats.begin(), idStats.begin() + idStatsCount);
+	cpp_freertos::CriticalSection::ExitFromISR(savedInterruptStatus);
+	return ids;
+}
+
+void CANPort::resetStats(){
+	BaseType_t savedInterruptStatus = cpp_freertos::CriticalSection::EnterFromISR();
+	stats = CANPortStats();
+	idStatsCount = 0;
+	windowRx = 0;
+	windowTx = 0;
+	windowBits = 0;
+	statsWindowStart = HAL_GetTick();
+	txDropped = 0;
+	txOverrun = 0;
+	cpp_freertos::CriticalSection::ExitFromISR(savedInterruptStatus);
+}
+
+
+
+/**
+ * Range of filter banks usable by this port.
+ * The first can uses the banks below slaveFilterStart, the second can the rest
+ */
+uint8_t CANPort::firstFilterBank(){
+#ifdef CAN2
+	if(this->hcan->Instance == CAN2)
+		return slaveFilterStart;
+#endif
+	return 0;
+}
+
+uint8_t CANPort::lastFilterBank(){
+#ifdef CAN2
+	if(this->hcan->Instance == CAN2)
+		return 28;
+#endif
+	return slaveFilterStart;
+}
 
 /**
  * Adds a filter to the can handle
  * Returns a free bank id if successfull and -1 if all banks are full
  * Use the returned id to disable the filter again
+ * Frames matching this filter are only passed to the handler if one is given
  */
-int32_t CANPort::addCanFilter(CAN_FilterTypeDef sFilterConfig){
+int32_t CANPort::addCanFilter(CAN_FilterTypeDef sFilterConfig,CanHandler* handler){
 	takeSemaphore();
-	int32_t lowestId = sFilterConfig.FilterFIFOAssignment == CAN_RX_FIFO0 ? 0 : slaveFilterStart;
-	int32_t highestId = sFilterConfig.FilterFIFOAssignment == CAN_RX_FIFO0 ? slaveFilterStart : 29;
 	int32_t foundId = -1;
-	for(uint8_t id = lowestId; id < highestId ; id++ ){
-		for(CAN_FilterTypeDef filter : canFilters){
-			if(filter.FilterFIFOAssignment == sFilterConfig.FilterFIFOAssignment && id == filter.FilterBank){
+	for(uint8_t id = firstFilterBank(); id < lastFilterBank() && foundId < 0; id++ ){
+		bool used = false;
+		for(CAN_FilterTypeDef& filter : canFilters){
+			if(id == filter.FilterBank){
+				used = true;
 				break;
 			}
 		}
-		foundId = id;
-		break;
+		if(!used){
+			foundId = id;
+		}
 	}
-	if(foundId < highestId){
+	activateNotifications(); // Error interrupts are also needed by receive only users
+	if(foundId >= 0){
+		sFilterConfig.FilterBank = foundId;
+		sFilterConfig.SlaveStartFilterBank = slaveFilterStart;
 		if (HAL_CAN_ConfigFilter(this->hcan, &sFilterConfig) == HAL_OK){
 			canFilters.push_back(sFilterConfig);
+			filterHandlers[foundId] = handler;
+			updateFilterIndex();
+		}else{
+			foundId = -1;
 		}
 	}
 	giveSemaphore();
@@ -217,9 +481,104 @@ void CANPort::removeCanFilter(uint8_t filterId){
 			canFilters[i].FilterActivation = false;
 			HAL_CAN_ConfigFilter(this->hcan, &canFilters[i]);
 			canFilters.erase(canFilters.begin()+i);
+			filterHandlers[filterId] = nullptr;
+			updateFilterIndex();
 			break;
 		}
 	}
 	semaphore.Give();
 }
+
+/**
+ * Mask filter for standard ids. Bits set in mask must match id
+ */
+CAN_FilterTypeDef CANPort::stdIdFilter(uint32_t id,uint32_t mask,uint32_t fifo){
+	CAN_FilterTypeDef sFilterConfig;
+	uint32_t filterId = (id & 0x7FF) << 21;
+	uint32_t filterMask = ((mask & 0x7FF) << 21) | CAN_ID_EXT; // Reject extended frames
+	sFilterConfig.FilterBank = 0;
+	sFilterConfig.FilterMode = CAN_FILTERMODE_IDMASK;
+	sFilterConfig.FilterScale = CAN_FILTERSCALE_32BIT;
+	sFilterConfig.FilterIdHigh = filterId >> 16;
+	sFilterConfig.FilterIdLow = filterId & 0xffff;
+	sFilterConfig.FilterMaskIdHigh = filterMask >> 16;
+	sFilterConfig.FilterMaskIdLow = filterMask & 0xffff;
+	sFilterConfig.FilterFIFOAssignment = fifo;
+	sFilterConfig.FilterActivation = ENABLE;
+	sFilterConfig.SlaveStartFilterBank = slaveFilterStart;
+	return sFilterConfig;
+}
+
+/**
+ * Mask filter for extended ids. Bits set in mask must match id
+ */
+CAN_FilterTypeDef CANPort::extIdFilter(uint32_t id,uint32_t mask,uint32_t fifo){
+	CAN_FilterTypeDef sFilterConfig = stdIdFilter(0, 0, fifo);
+	uint32_t filterId = ((id & 0x1FFFFFFF) << 3) | CAN_ID_EXT;
+	uint32_t filterMask = ((mask & 0x1FFFFFFF) << 3) | CAN_ID_EXT; // Reject standard frames
+	sFilterConfig.FilterIdHigh = filterId >> 16;
+	sFilterConfig.FilterIdLow = filterId & 0xffff;
+	sFilterConfig.FilterMaskIdHigh = filterMask >> 16;
+	sFilterConfig.FilterMaskIdLow = filterMask & 0xffff;
+	return sFilterConfig;
+}
+
+/**
+ * Rebuilds the table translating the filter match index of received frames to filter banks.
+ * The hardware numbers the filters of all banks assigned to a fifo in order,
+ * active or not. 32 bit banks hold one filter, 16 bit banks two, list mode doubles it.
+ */
+void CANPort::updateFilterIndex(){
+	CAN_TypeDef* can = CAN1; // Filter registers are only in the master can
+	uint8_t idx[2] = {0,0};
+	BaseType_t savedInterruptStatus = cpp_freertos::CriticalSection::EnterFromISR();
+	for(auto& fifoBanks : filterMatchBank){
+		fifoBanks.fill(0xff);
+	}
+	for(uint8_t bank = firstFilterBank(); bank < lastFilterBank(); bank++){
+		uint32_t bit = 1 << bank;
+		uint8_t fifo = (can->FFA1R & bit) ? 1 : 0;
+		uint8_t count = (can->FS1R & bit) ? 1 : 2;
+		if(can->FM1R & bit){
+			count *= 2;
+		}
+		for(uint8_t i = 0; i < count && idx[fifo] < filterMatchBank[fifo].size(); i++){
+			filterMatchBank[fifo][idx[fifo]++] = bank;
+		}
+	}
+	cpp_freertos::CriticalSection::ExitFromISR(savedInterruptStatus);
+}
+
+/**
+ * Sets a handler that gets every received frame of this port.
+ * The hardware reports only the first matching filter so a catch all filter does not see frames owned by other filters
+ */
+void CANPort::setRxMonitor(CanHandler* handler){
+	rxMonitor = handler;
+}
+
+/**
+ * Counts a received frame and passes it directly to the handler owning the matched filter and the monitor.
+ * Returns false if no handler owns the filter and the frame must be passed to all handlers
+ */
+bool CANPort::dispatchRxMessage(CAN_HandleTypeDef *hcan,uint8_t* rxBuf,CAN_RxHeaderTypeDef* rxHeader,uint32_t fifo){
+	if(hcan != this->hcan){
+		return false;
+	}
+	countFrame(rxHeader->IDE == CAN_ID_EXT ? rxHeader->ExtId : rxHeader->StdId, rxHeader->IDE == CAN_ID_EXT, rxHeader->DLC, false);
+	if(fifo > CAN_RX_FIFO1 || rxHeader->FilterMatchIndex >= filterMatchBank[fifo].size()){
+		return false;
+	}
+	uint8_t bank = filterMatchBank[fifo][rxHeader->FilterMatchIndex];
+	if(bank >= filterHandlers.size() || filterHandlers[bank] == nullptr){
+		return false;
+	}
+	CanHandler* owner = filterHandlers[bank];
+	owner->canRxPendCallback(hcan,rxBuf,rxHeader,fifo);
+	CanHandler* monitor = rxMonitor;
+	if(monitor != nullptr && monitor != owner){
+		monitor->canRxPendCallback(hcan,rxBuf,rxHeader,fifo);
+	}
+	return true;
+}
 #endif
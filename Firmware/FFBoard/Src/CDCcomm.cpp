@@ -10,11 +10,13 @@
 #include "CDCcomm.h"
 #include "tusb.h"
 
-// Flag to trigger another send call
-bool CDCcomm::usb_busy_retry = false;
-std::string CDCcomm::remainingStrs[CFG_TUD_CDC] = {""};
-std::string CDCcomm::tString;
+uint8_t CDCcomm::txBuf[CFG_TUD_CDC][CDC_TX_BUFFER_SIZE];
+volatile uint32_t CDCcomm::txHead[CFG_TUD_CDC] = {0};
+volatile uint32_t CDCcomm::txTail[CFG_TUD_CDC] = {0};
+CDCTxStats CDCcomm::txStats[CFG_TUD_CDC];
 cpp_freertos::BinarySemaphore CDCcomm::cdcSems[CFG_TUD_CDC] = {cpp_freertos::BinarySemaphore(true)};
+cpp_freertos::BinarySemaphore CDCcomm::drainSems[CFG_TUD_CDC] = {cpp_freertos::BinarySemaphore(true)};
+cpp_freertos::BinarySemaphore CDCcomm::spaceSems[CFG_TUD_CDC];
 
 CDCcomm::CDCcomm() {
 
@@ -26,45 +28,138 @@ CDCcomm::~CDCcomm() {
 
 
 /**
- * Global callback if cdc transfer is finished. Used to retry a failed transfer
+ * Global callback if cdc transfer is finished. Refills the usb fifo from the ring buffer
  */
 void CDCcomm::cdcFinished(uint8_t itf){
-	cdcSems[itf].Give();
-	if(CDCcomm::usb_busy_retry && CDCcomm::remainingStrs[itf].length() > 0){
-		cdcSend(&CDCcomm::remainingStrs[itf], itf); // Retry with remaining string
-	}
-	if(CDCcomm::remainingStrs[itf].capacity() > 512){
-		CDCcomm::remainingStrs[itf].shrink_to_fit(); // Prevent permanent increase of size if a long command was buffered
+	if(drain(itf)){
+		spaceSems[itf].Give(); // Wake a producer waiting for space
 	}
 }
 
+/**
+ * Bytes waiting in the ring buffer
+ */
 uint32_t CDCcomm::remainingData(uint8_t itf){
-	return CDCcomm::remainingStrs[itf].size();
+	return txHead[itf] - txTail[itf];
+}
+
+uint32_t CDCcomm::freeSpace(uint8_t itf){
+	return CDC_TX_BUFFER_SIZE - remainingData(itf);
+}
+
+/**
+ * Backpressure signal. False while the buffer is more than half full
+ */
+bool CDCcomm::readyToSend(uint8_t itf){
+	return remainingData(itf) < CDC_TX_BUFFER_SIZE / 2;
+}
+
+/**
+ * Moves as much data as possible from the ring buffer into the usb fifo.
+ * Returns true if space was freed
+ */
+bool CDCcomm::drain(uint8_t itf){
+	drainSems[itf].Take();
+	uint32_t startTail = txTail[itf];
+	while(tud_ready()){
+		uint32_t tail = txTail[itf];
+		uint32_t offset = tail & (CDC_TX_BUFFER_SIZE-1);
+		uint32_t len = std::min<uint32_t>(txHead[itf] - tail, CDC_TX_BUFFER_SIZE - offset); // Contiguous part
+		len = std::min<uint32_t>(len, tud_cdc_n_write_available(itf));
+		if(len == 0){
+			break;
+		}
+		uint32_t written = tud_cdc_n_write(itf, txBuf[itf] + offset, len);
+		txTail[itf] = tail + written;
+		txStats[itf].sent += written;
+		if(written < len){
+			break;
+		}
+	}
+	tud_cdc_n_write_flush(itf);
+	bool advanced = txTail[itf] != startTail;
+	drainSems[itf].Give();
+	return advanced;
 }
 
 /**
  * Sends a string via CDC
- * If not everything can be sent it will be buffered for later in a new string
  */
-uint16_t CDCcomm::cdcSend(std::string* reply,uint8_t itf){
-	if(!tud_ready() || reply->empty()){
+uint32_t CDCcomm::cdcSend(std::string* reply,uint8_t itf,uint32_t timeout){
+	return cdcSend(reply->c_str(), reply->length(), itf, timeout);
+}
+
+/**
+ * Appends data to the transmit buffer without allocating.
+ * Blocks up to timeout ms until the usb transfer frees space if the buffer is full and drops the remainder after that.
+ * Returns the number of bytes queued
+ */
+uint32_t CDCcomm::cdcSend(const char* buf,uint32_t len,uint8_t itf,uint32_t timeout){
+	if(!tud_ready() || len == 0 || inIsr()){
 		return 0;
 	}
 	cdcSems[itf].Take();
-	uint32_t bufferRemaining = tud_cdc_n_write_available(itf);
-	uint32_t cdc_sent = tud_cdc_n_write(itf,reply->c_str(), std::min<uint16_t>(reply->length(),bufferRemaining));
-	if(!usb_busy_retry) // We did not retransmit so flush now. otherwise TUD will flush if we were in the callback before
-		tud_cdc_n_write_flush(itf);
-
-	// If we can't write the whole reply copy remainder to send later
-	if(cdc_sent < reply->length()){
-		remainingStrs[itf] = reply->substr(cdc_sent);
-		usb_busy_retry = true;
-		remainingStrs[itf].shrink_to_fit();
-	}else{
-		usb_busy_retry = false;
-		remainingStrs[itf].clear();
+	uint32_t queued = 0;
+	bool stalled = false;
+	uint32_t stallStart = 0;
+	while(queued < len){
+		uint32_t head = txHead[itf];
+		uint32_t space = CDC_TX_BUFFER_SIZE - (head - txTail[itf]);
+		if(space == 0){
+			if(!stalled){
+				stalled = true;
+				stallStart = HAL_GetTick();
+				txStats[itf].stalls++;
+			}
+			uint32_t waited = HAL_GetTick() - stallStart;
+			if(waited >= timeout || !tud_ready()){
+				txStats[itf].dropped += len - queued;
+				break;
+			}
+			spaceSems[itf].Take(timeout - waited); // Given by the transfer complete callback
+			continue;
+		}
+		uint32_t offset = head & (CDC_TX_BUFFER_SIZE-1);
+		uint32_t chunk = std::min<uint32_t>(std::min<uint32_t>(len - queued, space), CDC_TX_BUFFER_SIZE - offset);
+		memcpy(txBuf[itf] + offset, buf + queued, chunk);
+		__DMB(); // Data must be written before the drain can see it
+		txHead[itf] = head + chunk;
+		queued += chunk;
+		txStats[itf].peakUsed = std::max<uint32_t>(txStats[itf].peakUsed, remainingData(itf));
+	}
+	if(stalled){
+		txStats[itf].stallTime += HAL_GetTick() - stallStart;
+	}
+	cdcSems[itf].Give();
+	drain(itf);
+	return queued;
+}
+
+CDCTxStats CDCcomm::getStats(uint8_t itf){
+	return txStats[itf];
+}
+
+uint32_t CDCcomm::getStat(CDCTxStatField field,uint8_t itf){
+	switch(field){
+	case CDCTxStatField::stalls:
+		return txStats[itf].stalls;
+	case CDCTxStatField::stallTime:
+		return txStats[itf].stallTime;
+	case CDCTxStatField::dropped:
+		return txStats[itf].dropped;
+	case CDCTxStatField::peakUsed:
+		return txStats[itf].peakUsed;
+	case CDCTxStatField::sent:
+		return txStats[itf].sent;
+	case CDCTxStatField::used:
+		return remainingData(itf);
+	case CDCTxStatField::size:
+		return CDC_TX_BUFFER_SIZE;
+	default:
+		return 0;
 	}
+}
 
-	return cdc_sent;
+void CDCcomm::resetStats(uint8_t itf){
+	txStats[itf] = CDCTxStats();
 }
@@ -227,7 +227,8 @@ bool CmdParser::parse(std::vector<ParsedCommand>& commands){
 		}
 		if(!found){
 			Error error = FFBoardMainCommandThread::cmdNotFoundError;
-			error.info += ":"+cmdstring;
+			error.appendInfo(":");
+			error.appendInfo(cmdstring.c_str());
 			ErrorHandler::addError(error);
 		}
 	}
@@ -6,6 +6,7 @@
  */
 
 #include "CommandHandler.h"
+#include "CommandInterface.h"
 #include "global_callbacks.h"
 #include "FFBoardMain.h"
 #include "cdc_device.h"
@@ -16,6 +17,7 @@
 std::vector<CommandHandler*> CommandHandler::cmdHandlers;
 std::set<uint16_t> CommandHandler::cmdHandlerIDs;
 cpp_freertos::MutexStandard CommandHandler::cmdHandlerListMutex;
+cpp_freertos::MutexRecursive CommandHandler::commandMutex;
 bool CommandHandler::logEnabled = true; // If logs are sent by default
 
 /**
@@ -33,91 +35,122 @@ CommandHandler::~CommandHandler() {
 
 /**
  * Generates a readable list of all commands with help information
- * Warning: Large string returned
+ * Warning: Large string returned. Prefer streaming with CommandHelpGenerator
  */
 std::string CommandHandler::getCommandsHelpstring(){
-	std::string helpstring = "\n";
-	ClassIdentifier info = this->getInfo();
-	if(info.name == nullptr || cmdHandlerInfo.clsname == nullptr){
-		return "";
-	}
-	helpstring.append(info.name);
-	helpstring +=  "(";
-	helpstring.append(cmdHandlerInfo.clsname);
-	helpstring += "." + std::to_string(cmdHandlerInfo.instance) + "):\n";
-
-	std::string handlerHelp = getHelpstring();
-
-	if(!handlerHelp.empty()){
-		helpstring += handlerHelp + "\n";
-	}
-
-	if(registeredCommands.empty()){
-		helpstring += "No commands.";
-	}else{
-		helpstring += "Commands with help:\n";
-		for(CmdHandlerCommanddef& cmd : registeredCommands){
-			if(cmd.helpstring != nullptr && cmd.cmd != nullptr){
-				helpstring += std::string(cmd.cmd) + ":\t" + std::string(cmd.helpstring);
-				if(cmd.flags & CMDFLAG_DEBUG){
-					helpstring+= " (DEBUG MODE ONLY)";
-				}
-				helpstring += "\n";
-			}
-
-		}
-	}
-
+	std::string helpstring;
+	StringReplyWriter out(helpstring);
+	CommandHelpGenerator generator(this, false);
+	uint32_t pos = 0;
+	while(generator.generate(out, pos));
 	return helpstring;
 }
 
 /**
  * Generates a csv list of all commands with help information
- * Warning: Large string returned
+ * Warning: Large string returned. Prefer streaming with CommandHelpGenerator
  */
 std::string CommandHandler::getCsvHelpstring(){
-	std::string helpstring = "\nPrefix,Class ID, Class description\n";
-	ClassIdentifier info = this->getInfo();
-	if(info.name == nullptr || cmdHandlerInfo.clsname == nullptr){
-		return "";
-	}
-
-	helpstring.append(cmdHandlerInfo.clsname);
-	helpstring += "." + std::to_string(cmdHandlerInfo.instance) + ",";
-	char clshex[7];
-	std::snprintf(clshex,7,"0x%X",cmdHandlerInfo.clsTypeid);
-	helpstring += std::string(clshex) + ",";
-
-	helpstring.append(info.name);
-
-	std::string handlerHelp = getHelpstring();
+	std::string helpstring;
+	StringReplyWriter out(helpstring);
+	CommandHelpGenerator generator(this, true);
+	uint32_t pos = 0;
+	while(generator.generate(out, pos));
+	return helpstring;
+}
 
-	if(!handlerHelp.empty()){
-		helpstring += ": " + handlerHelp + "\n";
-	}else{
-		helpstring += "\n";
+/**
+ * Writes the separator before every item except the first.
+ * Returns the item index stored in the cursor
+ */
+uint32_t ReplyGenerator::writeSeparator(ReplyWriter& out,uint32_t& pos,const char* separator){
+	if(pos & POS_STARTED){
+		out.write(separator);
 	}
+	pos |= POS_STARTED;
+	return pos & ~POS_STARTED;
+}
 
-	if(registeredCommands.empty()){
-		helpstring += "No commands.";
-	}else{
-		helpstring += "Command name,CMD ID, Description\n";
-		for(CmdHandlerCommanddef& cmd : registeredCommands){
-			if(cmd.helpstring != nullptr && cmd.cmd != nullptr){
-				char cmdhex[11];
-				std::snprintf(cmdhex,11,"0x%lX",cmd.cmdId);
-				helpstring.append(cmd.cmd);
-				helpstring += "," + std::string(cmdhex) + ",";
-				helpstring.append(cmd.helpstring);
-				if(cmd.flags & CMDFLAG_DEBUG){
-					helpstring+= " (DEBUG MODE ONLY)";
-				}
-				helpstring += "\n";
+/**
+ * Writes the class header first and then one command per call
+ */
+bool CommandHelpGenerator::generate(ReplyWriter& out,uint32_t& pos){
+	if(!CommandHandler::isInHandlerList(handler)){
+		return false; // Deleted before the reply was sent
+	}
+	ClassIdentifier info = handler->getInfo();
+	CmdHandlerInfo* cmdHandlerInfo = handler->getCommandHandlerInfo();
+	if(info.name == nullptr || cmdHandlerInfo->clsname == nullptr){
+		return false;
+	}
+	const std::vector<CmdHandlerCommanddef>& registeredCommands = handler->getRegisteredCommands();
+
+	if(pos == 0){
+		std::string handlerHelp = handler->getHelpstring();
+		if(csv){
+			out.write("\nPrefix,Class ID, Class description\n");
+			out.write(cmdHandlerInfo->clsname);
+			out.write('.');
+			out.writeInt(cmdHandlerInfo->instance);
+			out.write(',');
+			char clshex[7];
+			std::snprintf(clshex,7,"0x%X",cmdHandlerInfo->clsTypeid);
+			out.write(clshex);
+			out.write(',');
+			out.write(info.name);
+			if(!handlerHelp.empty()){
+				out.write(": ");
+				out.write(handlerHelp);
 			}
+			out.write('\n');
+		}else{
+			out.write('\n');
+			out.write(info.name);
+			out.write('(');
+			out.write(cmdHandlerInfo->clsname);
+			out.write('.');
+			out.writeInt(cmdHandlerInfo->instance);
+			out.write("):\n");
+			if(!handlerHelp.empty()){
+				out.write(handlerHelp);
+				out.write('\n');
+			}
+		}
+
+		if(registeredCommands.empty()){
+			out.write("No commands.");
+			return false;
 		}
+		out.write(csv ? "Command name,CMD ID, Description\n" : "Commands with help:\n");
+		pos = 1;
+		return true;
 	}
 
-	return helpstring;
+	// One command per call
+	while(pos - 1 < registeredCommands.size()){
+		const CmdHandlerCommanddef& cmd = registeredCommands[pos - 1];
+		pos++;
+		if(cmd.helpstring == nullptr || cmd.cmd == nullptr){
+			continue;
+		}
+		out.write(cmd.cmd);
+		if(csv){
+			char cmdhex[11];
+			std::snprintf(cmdhex,11,"0x%lX",cmd.cmdId);
+			out.write(',');
+			out.write(cmdhex);
+			out.write(',');
+		}else{
+			out.write(":\t");
+		}
+		out.write(cmd.helpstring);
+		if(cmd.flags & CMDFLAG_DEBUG){
+			out.write(" (DEBUG MODE ONLY)");
+		}
+		out.write('\n');
+		break;
+	}
+	return pos - 1 < registeredCommands.size();
 }
 
 /**
@@ -182,11 +215,7 @@ CommandStatus CommandHandler::internalCommand(const ParsedCommand& cmd,std::vect
 		break;
 
 		case CommandHandlerCommands::help:
-			if(cmd.type == CMDtype::info){
-				replies.push_back(CommandReply(this->getCsvHelpstring()));
-			}else{
-				replies.push_back(CommandReply(this->getCommandsHelpstring()));
-			}
+			replies.push_back(CommandReply(std::make_shared<CommandHelpGenerator>(this, cmd.type == CMDtype::info)));
 		break;
 
 		case CommandHandlerCommands::cmdhandleruid:
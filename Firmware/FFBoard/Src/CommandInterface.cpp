@@ -10,6 +10,7 @@
 #include "global_callbacks.h"
 #include "CommandHandler.h"
 #include <stdlib.h>
+#include <charconv>
 #include "critical.hpp"
 
 std::vector<CommandInterface*> CommandInterface::cmdInterfaces;
@@ -31,14 +32,16 @@ void CommandInterface::sendReplies(std::vector<CommandResult>& results,CommandIn
 }
 
 /**
- * Broadcasts an unrequested reply to all command interfaces
+ * Broadcasts an unrequested reply to all command interfaces.
+ * A sequence id lets the hid interface send the replies batched
  */
-void CommandInterface::broadcastCommandReplyAsync(std::vector<CommandReply>& reply,CommandHandler* handler, uint32_t cmdId,CMDtype type){
+void CommandInterface::broadcastCommandReplyAsync(std::vector<CommandReply>& reply,CommandHandler* handler, uint32_t cmdId,CMDtype type,uint8_t seq){
 	ParsedCommand fakeCmd;
 	fakeCmd.target = handler;
 	fakeCmd.cmdId = cmdId;
 	fakeCmd.instance = handler->getCommandHandlerInfo()->instance;
 	fakeCmd.type = type;
+	fakeCmd.seq = seq;
 
 
 	CommandResult fakeResult;
@@ -101,109 +104,149 @@ uint32_t StringCommandInterface::bufferCapacity(){
 }
 
 void StringCommandInterface::formatReply(std::string& reply,const std::vector<CommandResult>& results,const bool formatWriteAsRead){
+	StringReplyWriter out(reply);
+	formatReply(out, results, formatWriteAsRead);
+}
+
+/**
+ * Formats replies directly into the output of the interface
+ */
+void StringCommandInterface::formatReply(ReplyWriter& out,const std::vector<CommandResult>& results,const bool formatWriteAsRead){
 	//uint16_t lastId = 0xFFFF;
 	for(const CommandResult& result : results){ // All commands processed this batch
 		if(formatWriteAsRead && !(result.originalCommand.type == CMDtype::set || result.originalCommand.type == CMDtype::setat)){
 			return; // Ignore commands that should be formatted as read if they are not set commands
 		}
 
-		reply += "["; // Start marker
-		reply += StringCommandInterface::formatOriginalCommandFromResult(result.originalCommand,result.commandHandler, formatWriteAsRead);
-		reply += "|"; // Separator
+		out.write('['); // Start marker
+		StringCommandInterface::formatOriginalCommandFromResult(out,result.originalCommand,result.commandHandler, formatWriteAsRead);
+		out.write('|'); // Separator
 
 		if(formatWriteAsRead){
-			std::string tstr;
-			StringCommandInterface::generateReplyFromCmd(tstr,result.originalCommand);
-			reply += tstr;
+			StringCommandInterface::generateReplyFromCmd(out,result.originalCommand);
 		}else{
 			if(result.type == CommandStatus::NOT_FOUND){
-				reply += "NOT_FOUND";
+				out.write("NOT_FOUND");
 				//ErrorHandler::addError(CommandInterface::cmdNotFoundError);
 			}else if(result.type == CommandStatus::OK || result.type == CommandStatus::BROADCAST){
 				if(result.reply.empty()){
-					reply += "OK";
+					out.write("OK");
 				}else{
 					uint16_t repliesRemaining = result.reply.size();
 					for(const CommandReply& cmdReply : result.reply){ // For all entries of this command. Normally just one
-						std::string tstr;
-						//TODO Long replies fail HERE while copying reply strings
-						StringCommandInterface::generateReplyValueString(tstr,cmdReply);
-						reply += tstr;
+						StringCommandInterface::generateReplyValueString(out,cmdReply);
 						if(--repliesRemaining > 0){
-							reply += "\n"; // Separate replies with newlines
+							out.write('\n'); // Separate replies with newlines
 						}
 					}
 				}
 			}else if(result.type == CommandStatus::ERR){
-				reply += "ERR";
+				out.write("ERR");
 			}else{
-				reply += "None";
+				out.write("None");
 			}
 		}
 
-		reply += "]\n"; // end marker
+		out.write("]\n"); // end marker
 	}
 }
 
 /**
  * Formats a command string from a reply result
  */
-std::string StringCommandInterface::formatOriginalCommandFromResult(const ParsedCommand& originalCommand,CommandHandler* commandHandler,const bool formatWriteAsRead){
-
-//	ClassIdentifier info = commandHandler->getInfo();
-	std::string cmdstring = commandHandler->getCommandHandlerInfo()->clsname;
-	if(originalCommand.instance != 0xFF){
-		cmdstring += "." + std::to_string(originalCommand.instance);
-	}
-	cmdstring += ".";
-
+void StringCommandInterface::formatOriginalCommandFromResult(ReplyWriter& out,const ParsedCommand& originalCommand,CommandHandler* commandHandler,const bool formatWriteAsRead){
 
 	CmdHandlerCommanddef* cmdDef = commandHandler->getCommandFromId(originalCommand.cmdId); // CMD name
 	if(!cmdDef){
-		return ""; // can not find cmd. should never happen
+		return; // can not find cmd. should never happen
+	}
+	out.write(commandHandler->getCommandHandlerInfo()->clsname);
+	if(originalCommand.instance != 0xFF){
+		out.write('.');
+		out.writeInt(originalCommand.instance);
 	}
-	cmdstring += std::string(cmdDef->cmd);
+	out.write('.');
+	out.write(cmdDef->cmd);
+
 	if(originalCommand.type == CMDtype::get || (formatWriteAsRead && originalCommand.type == CMDtype::set)){
-		cmdstring += "?";
+		out.write('?');
 
 	}else if(originalCommand.type == CMDtype::getat || (formatWriteAsRead && originalCommand.type == CMDtype::setat)){ // cls.inst.cmd?
-		cmdstring += "?" + std::to_string(originalCommand.adr);
+		out.write('?');
+		out.writeInt(originalCommand.adr);
 
 	}else if(originalCommand.type == CMDtype::set){ // cls.inst.cmd?
-		cmdstring += "=" + std::to_string(originalCommand.val);
+		out.write('=');
+		out.writeInt(originalCommand.val);
 
 	}else if(originalCommand.type == CMDtype::setat){ // cls.inst.cmd?x=y
-		cmdstring += "=" + std::to_string(originalCommand.val) + "?" + std::to_string(originalCommand.adr);
+		out.write('=');
+		out.writeInt(originalCommand.val);
+		out.write('?');
+		out.writeInt(originalCommand.adr);
 
 	}else if(originalCommand.type == CMDtype::info){
-		cmdstring += "!";
+		out.write('!');
 	}
-
-	return cmdstring;
-
 }
 
 /**
  * Creates the value part of the reply string
  */
-void StringCommandInterface::generateReplyValueString(std::string& replyPart,const CommandReply& reply){
-	//std::string replyPart;
+void StringCommandInterface::generateReplyValueString(ReplyWriter& out,const CommandReply& reply){
 	if(reply.type == CommandReplyType::STRING || reply.type == CommandReplyType::STRING_OR_INT || reply.type == CommandReplyType::STRING_OR_DOUBLEINT){
-		replyPart.assign(reply.reply);
+		out.write(reply.reply);
 	}else if(reply.type == CommandReplyType::INT){
-		replyPart = std::to_string(reply.val);
+		out.writeInt(reply.val);
 	}else if(reply.type == CommandReplyType::DOUBLEINTS){
-		replyPart = std::to_string(reply.val) + ":" + std::to_string(reply.adr);
+		out.writeInt(reply.val);
+		out.write(':');
+		out.writeInt(reply.adr);
 	}else if(reply.type == CommandReplyType::ACK){
-		replyPart = "OK";
+		out.write("OK");
+	}else if(reply.type == CommandReplyType::STREAM && reply.generator){
+		uint32_t pos = 0;
+		while(reply.generator->generate(out, pos)); // Written piece by piece without building the full string
 	}
 }
 
-void StringCommandInterface::generateReplyFromCmd(std::string& replyPart,const ParsedCommand& originalCommand){
+void StringCommandInterface::generateReplyFromCmd(ReplyWriter& out,const ParsedCommand& originalCommand){
 	if(originalCommand.type == CMDtype::set){
-		replyPart = std::to_string(originalCommand.val);
+		out.writeInt(originalCommand.val);
 	}else if(originalCommand.type == CMDtype::setat){
-		replyPart = std::to_string(originalCommand.val) + ":" + std::to_string(originalCommand.adr);
+		out.writeInt(originalCommand.val);
+		out.write(':');
+		out.writeInt(originalCommand.adr);
+	}
+}
+
+
+/*
+ * Reply writers
+ */
+void ReplyWriter::writeInt(int64_t val){
+	char buf[21];
+	std::to_chars_result res = std::to_chars(buf, buf + sizeof(buf), val);
+	write(buf, res.ptr - buf);
+}
+
+void CDCReplyWriter::write(const char* buf,uint32_t len){
+	while(len > 0){
+		uint32_t chunk = std::min<uint32_t>(len, bufferSize - used);
+		memcpy(buffer + used, buf, chunk);
+		used += chunk;
+		buf += chunk;
+		len -= chunk;
+		if(used == bufferSize){
+			flush();
+		}
+	}
+}
+
+void CDCReplyWriter::flush(){
+	if(used){
+		CDCcomm::cdcSend(buffer, used, itf, waitForSpace ? CDCcomm::txTimeout : 0);
+		used = 0;
 	}
 }
 
@@ -229,19 +272,25 @@ void CDC_CommandInterface::sendReplies(std::vector<CommandResult>& results,Comma
 	if( (!enableBroadcastFromOtherInterfaces && originalInterface != this) ){
 		return;
 	}
+	if(originalInterface == nullptr && !results.empty() && results[0].originalCommand.seq != 0){
+		return; // Batched hid stream
+	}
 
-	std::string replystr;
-	replystr.reserve(100);
-	StringCommandInterface::formatReply(replystr,results, originalInterface != this && originalInterface != nullptr);
-	if(!replystr.empty())
-		CDCcomm::cdcSend(&replystr, 0);
+	replyMutex.Lock();
+	{
+		// Only replies to commands from this interface wait for the host. Broadcasts are dropped if the buffer is full
+		CDCReplyWriter out(0, originalInterface == this);
+		StringCommandInterface::formatReply(out,results, originalInterface != this && originalInterface != nullptr);
+		out.flush();
+	}
+	replyMutex.Unlock();
 }
 
 /**
- * Ready to send if there is no data in the backup buffer of the cdc port
+ * Ready to send while the transmit buffer of the cdc port has enough space
  */
 bool CDC_CommandInterface::readyToSend(){
-	return CDCcomm::remainingData(0) == 0;
+	return CDCcomm::readyToSend(0);
 }
 
 
@@ -0,0 +1,230 @@
+/*
+ * CommandSubscriptions.cpp
+ *
+ *  Created on: 19.10.2026
+ *      Author: Yannick
+ */
+
+#include "CommandSubscriptions.h"
+#include "CommandInterface.h"
+#include <algorithm>
+
+ClassIdentifier CommandSubscriptions::info = {
+		 .name = "Command streaming" ,
+		 .id = CLSID_SUBSCRIPTIONS,
+		 .hidden = true
+ };
+
+const ClassIdentifier CommandSubscriptions::getInfo(){
+	return info;
+}
+
+CommandSubscriptions::CommandSubscriptions() : CommandHandler("stream", CLSID_SUBSCRIPTIONS), Thread("stream",1024,20){ // Above the default task. Same stack as cmdparser as it runs get commands
+	registerCommands();
+	this->Start();
+}
+
+CommandSubscriptions::~CommandSubscriptions() {
+
+}
+
+void CommandSubscriptions::registerCommands(){
+	CommandHandler::registerCommands();
+	registerCommand("add", CommandSubscriptions_commands::add, "Subscribe to a get command: cmdid?(clsid<<8|instance)",CMDFLAG_SETADR);
+	registerCommand("remove", CommandSubscriptions_commands::remove, "Remove subscription by index",CMDFLAG_SET);
+	registerCommand("clear", CommandSubscriptions_commands::clear, "Remove all subscriptions",CMDFLAG_SET);
+	registerCommand("list", CommandSubscriptions_commands::list, "Subscribed commands. Adr: index (cmdid:clsid<<8|instance)",CMDFLAG_GET | CMDFLAG_GETADR);
+	registerCommand("rate", CommandSubscriptions_commands::rate, "Stream period in ms. Min 10. 0 to stop",CMDFLAG_GET | CMDFLAG_SET);
+	registerCommand("data", CommandSubscriptions_commands::data, "Values of all subscriptions (value:index)",CMDFLAG_GET);
+}
+
+/**
+ * Adds a get command to the stream. Only commands with a plain get are accepted
+ */
+bool CommandSubscriptions::addSubscription(uint16_t clsid,uint8_t instance,uint32_t cmdId,uint8_t seq){
+	CommandHandler* handler = CommandHandler::getHandlerFromId(clsid, instance);
+	if(handler == nullptr || !handler->isValidCommandId(cmdId, 0, CMDFLAG_GET)){
+		return false;
+	}
+	subsMutex.Lock();
+	if(subCount >= SUBSCRIPTIONS_MAX){
+		subsMutex.Unlock();
+		return false;
+	}
+	CommandSubscription sub;
+	sub.clsid = clsid;
+	sub.instance = instance;
+	sub.cmdId = cmdId;
+	sub.seq = seq;
+	subs[subCount++] = sub;
+	subsMutex.Unlock();
+	wake();
+	return true;
+}
+
+bool CommandSubscriptions::removeSubscription(uint8_t idx){
+	subsMutex.Lock();
+	if(idx >= subCount){
+		subsMutex.Unlock();
+		return false;
+	}
+	for(uint8_t i = idx; i < subCount - 1; i++){
+		subs[i] = subs[i+1];
+	}
+	subCount--;
+	subsMutex.Unlock();
+	return true;
+}
+
+void CommandSubscriptions::clearSubscriptions(){
+	subsMutex.Lock();
+	subCount = 0;
+	subsMutex.Unlock();
+}
+
+/**
+ * Sets the stream period in ms. 0 stops streaming.
+ * Periods below SUBSCRIPTIONS_MINPERIOD are rejected
+ */
+bool CommandSubscriptions::setRate(uint32_t period){
+	if(period != 0 && period < SUBSCRIPTIONS_MINPERIOD){
+		return false;
+	}
+	this->period = period;
+	wake();
+	return true;
+}
+
+void CommandSubscriptions::wake(){
+	xTaskNotify(this->GetHandle(), 0, eNoAction);
+}
+
+/**
+ * Executes all subscribed get commands. Each value is returned with its subscription index.
+ * Handlers are resolved every time so removed classes are skipped.
+ * seq selects only subscriptions from one interface. -1 samples all
+ */
+void CommandSubscriptions::sample(std::vector<CommandReply>& replies,int16_t seq){
+	std::vector<CommandReply> cmdReplies;
+	commandMutex.Lock(); // Serialized with the command thread
+	cmdHandlerListMutex.Lock(); // Handlers can not be deleted while sampling
+	subsMutex.Lock();
+	for(uint8_t i = 0; i < subCount; i++){
+		CommandSubscription& sub = subs[i];
+		if(seq >= 0 && sub.seq != seq){
+			continue;
+		}
+		CommandHandler* handler = CommandHandler::getHandlerFromId(sub.clsid, sub.instance);
+		if(handler == nullptr){
+			continue;
+		}
+		ParsedCommand cmd;
+		cmd.cmdId = sub.cmdId;
+		cmd.instance = sub.instance;
+		cmd.target = handler;
+		cmd.type = CMDtype::get;
+		cmdReplies.clear();
+		if(handler->command(cmd, cmdReplies) != CommandStatus::OK){
+			continue;
+		}
+		for(CommandReply& reply : cmdReplies){
+			if(reply.type == CommandReplyType::INT || reply.type == CommandReplyType::STRING_OR_INT || reply.type == CommandReplyType::DOUBLEINTS || reply.type == CommandReplyType::STRING_OR_DOUBLEINT){
+				replies.push_back(CommandReply(reply.val, i));
+			}
+		}
+	}
+	subsMutex.Unlock();
+	cmdHandlerListMutex.Unlock();
+	commandMutex.Unlock();
+}
+
+void CommandSubscriptions::Run(){
+	while(true){
+		if(period == 0 || subCount == 0){
+			xTaskNotifyWait(0, 0, nullptr, portMAX_DELAY); // Wait until started
+			ResetDelayUntil();
+			continue;
+		}
+		DelayUntil(period); // Keeps the sample interval constant
+
+		// Values are sent once per subscribing interface
+		uint8_t seqs[SUBSCRIPTIONS_MAX];
+		uint8_t seqCount = 0;
+		subsMutex.Lock();
+		for(uint8_t i = 0; i < subCount; i++){
+			if(std::find(seqs, seqs + seqCount, subs[i].seq) == seqs + seqCount){
+				seqs[seqCount++] = subs[i].seq;
+			}
+		}
+		subsMutex.Unlock();
+
+		for(uint8_t i = 0; i < seqCount; i++){
+			streamReplies.clear();
+			sample(streamReplies, seqs[i]);
+			if(!streamReplies.empty()){
+				CommandInterface::broadcastCommandReplyAsync(streamReplies, this, (uint32_t)CommandSubscriptions_commands::data, CMDtype::get, seqs[i]);
+			}
+		}
+	}
+}
+
+CommandStatus CommandSubscriptions::command(const ParsedCommand& cmd,std::vector<CommandReply>& replies){
+	switch(static_cast<CommandSubscriptions_commands>(cmd.cmdId)){
+	case CommandSubscriptions_commands::add:
+		if(cmd.type == CMDtype::setat){
+			if(!addSubscription((cmd.adr >> 8) & 0xffff, cmd.adr & 0xff, cmd.val, cmd.seq)){
+				return CommandStatus::ERR;
+			}
+		}else{
+			return CommandStatus::ERR;
+		}
+		break;
+	case CommandSubscriptions_commands::remove:
+		if(cmd.type != CMDtype::set || !removeSubscription(cmd.val)){
+			return CommandStatus::ERR;
+		}
+		break;
+	case CommandSubscriptions_commands::clear:
+		clearSubscriptions();
+		break;
+	case CommandSubscriptions_commands::list:
+	{
+		subsMutex.Lock();
+		bool valid = true;
+		if(cmd.type == CMDtype::getat){
+			if(cmd.adr >= subCount || cmd.adr < 0){
+				valid = false;
+			}else{
+				CommandSubscription& sub = subs[cmd.adr];
+				replies.push_back(CommandReply(sub.cmdId, (sub.clsid << 8) | sub.instance));
+			}
+		}else if(cmd.type == CMDtype::get){
+			for(uint8_t i = 0; i < subCount; i++){
+				replies.push_back(CommandReply(subs[i].cmdId, (subs[i].clsid << 8) | subs[i].instance));
+			}
+		}
+		subsMutex.Unlock();
+		if(!valid){
+			return CommandStatus::ERR;
+		}
+		break;
+	}
+	case CommandSubscriptions_commands::rate:
+		if(cmd.type == CMDtype::set){
+			if(cmd.val < 0 || cmd.val > UINT32_MAX || !setRate(cmd.val)){
+				return CommandStatus::ERR;
+			}
+		}else if(cmd.type == CMDtype::get){
+			replies.push_back(CommandReply(period));
+		}else{
+			return CommandStatus::ERR;
+		}
+		break;
+	case CommandSubscriptions_commands::data:
+		sample(replies);
+		break;
+	default:
+		return CommandStatus::NOT_FOUND;
+	}
+	return CommandStatus::OK;
+}
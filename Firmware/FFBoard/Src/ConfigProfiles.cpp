@@ -0,0 +1,180 @@
+/*
+ * ConfigProfiles.cpp
+ *
+ *  Created on: 19.10.2026
+ *      Author: Yannick
+ */
+
+#include "ConfigProfiles.h"
+
+ClassIdentifier ConfigProfiles::info = {
+		 .name = "Config profiles" ,
+		 .id = CLSID_PROFILES,
+		 .hidden = true
+ };
+
+const ClassIdentifier ConfigProfiles::getInfo(){
+	return info;
+}
+
+ConfigProfiles::ConfigProfiles() : CommandHandler("prof", CLSID_PROFILES) {
+	restoreFlash();
+	registerCommands();
+}
+
+ConfigProfiles::~ConfigProfiles() {
+
+}
+
+void ConfigProfiles::registerCommands(){
+	CommandHandler::registerCommands();
+	registerCommand("save", ConfigProfiles_commands::save, "Store current tuning in profile",CMDFLAG_SET);
+	registerCommand("load", ConfigProfiles_commands::load, "Apply profile without writing the config",CMDFLAG_SET);
+	registerCommand("erase", ConfigProfiles_commands::erase, "Delete profile",CMDFLAG_SET);
+	registerCommand("list", ConfigProfiles_commands::list, "Stored words per profile. 0 if empty (words:profile). Adr: profile",CMDFLAG_GET | CMDFLAG_GETADR);
+	registerCommand("active", ConfigProfiles_commands::active, "Last loaded profile. 255 if none",CMDFLAG_GET);
+}
+
+void ConfigProfiles::saveFlash(){
+	Flash_Write(ADR_PROFILE_ACTIVE, activeProfile);
+}
+
+void ConfigProfiles::restoreFlash(){
+	uint16_t active;
+	if(Flash_Read(ADR_PROFILE_ACTIVE, &active)){
+		activeProfile = active & 0xff;
+	}
+}
+
+/**
+ * Returns the stored data length or 0 if the profile is empty or has a different version
+ */
+uint8_t ConfigProfiles::getProfileLength(uint8_t profile){
+	uint16_t header;
+	if(profile >= PROFILE_COUNT || !Flash_Read(ADR_PROFILE(profile, 0), &header) || (header >> 8) != PROFILE_VERSION){
+		return 0;
+	}
+	uint8_t len = header & 0xff;
+	return len < PROFILE_SIZE ? len : 0;
+}
+
+/**
+ * Collects the values of all instances with a profile key and stores them in one batch
+ */
+bool ConfigProfiles::saveProfile(uint8_t profile){
+	if(profile >= PROFILE_COUNT){
+		return false;
+	}
+	uint16_t data[PROFILE_SIZE - 1];
+	uint8_t len = 0;
+	for(PersistentStorage* handler : PersistentStorage::flashHandlers){
+		uint16_t key = handler->getProfileKey();
+		if(key == 0 || len + 2 > PROFILE_SIZE - 1){
+			continue;
+		}
+		uint8_t maxLen = std::min<uint8_t>(PROFILE_SIZE - 2 - len, 0xf);
+		uint8_t count = handler->saveProfile(data + len + 1, maxLen);
+		if(count == 0){
+			continue;
+		}
+		data[len] = (count << 12) | (key & 0xfff);
+		len += count + 1;
+	}
+
+	Flash_BeginBatch();
+	Flash_Write(ADR_PROFILE(profile, 0), (PROFILE_VERSION << 8) | len);
+	for(uint8_t i = 0; i < len; i++){
+		Flash_Write(ADR_PROFILE(profile, i + 1), data[i]);
+	}
+	Flash_CommitBatch();
+	return true;
+}
+
+/**
+ * Reads and validates the whole profile first, then applies all sections.
+ * Runs in the command thread which has a higher priority than the effect loop
+ */
+bool ConfigProfiles::loadProfile(uint8_t profile){
+	uint8_t len = getProfileLength(profile);
+	if(len == 0){
+		return false;
+	}
+	uint16_t data[PROFILE_SIZE - 1];
+	for(uint8_t i = 0; i < len; i++){
+		if(!Flash_Read(ADR_PROFILE(profile, i + 1), data + i)){
+			return false;
+		}
+	}
+	for(uint8_t pos = 0; pos < len; pos += (data[pos] >> 12) + 1){
+		if(pos + 1 + (data[pos] >> 12) > len){
+			return false; // Corrupt
+		}
+	}
+
+	for(uint8_t pos = 0; pos < len; pos += (data[pos] >> 12) + 1){
+		uint16_t key = data[pos] & 0xfff;
+		for(PersistentStorage* handler : PersistentStorage::flashHandlers){
+			if(handler->getProfileKey() == key){
+				handler->loadProfile(data + pos + 1, data[pos] >> 12);
+				break;
+			}
+		}
+	}
+	activeProfile = profile;
+	return true;
+}
+
+bool ConfigProfiles::eraseProfile(uint8_t profile){
+	if(profile >= PROFILE_COUNT){
+		return false;
+	}
+	Flash_Write(ADR_PROFILE(profile, 0), 0);
+	if(activeProfile == profile){
+		activeProfile = 0xff;
+	}
+	return true;
+}
+
+CommandStatus ConfigProfiles::command(const ParsedCommand& cmd,std::vector<CommandReply>& replies){
+	switch(static_cast<ConfigProfiles_commands>(cmd.cmdId)){
+	case ConfigProfiles_commands::save:
+		if(cmd.type != CMDtype::set || !saveProfile(cmd.val)){
+			return CommandStatus::ERR;
+		}
+		break;
+	case ConfigProfiles_commands::load:
+		if(cmd.type != CMDtype::set || !loadProfile(cmd.val)){
+			return CommandStatus::ERR;
+		}
+		break;
+	case ConfigProfiles_commands::erase:
+		if(cmd.type != CMDtype::set || !eraseProfile(cmd.val)){
+			return CommandStatus::ERR;
+		}
+		break;
+	case ConfigProfiles_commands::list:
+		if(cmd.type == CMDtype::get){
+			for(uint8_t i = 0; i < PROFILE_COUNT; i++){
+				replies.push_back(CommandReply(getProfileLength(i), i));
+			}
+		}else if(cmd.type == CMDtype::getat){
+			if(cmd.adr >= PROFILE_COUNT){
+				return CommandStatus::ERR;
+			}
+			replies.push_back(CommandReply(getProfileLength(cmd.adr)));
+		}else{
+			return CommandStatus::ERR;
+		}
+		break;
+	case ConfigProfiles_commands::active:
+		if(cmd.type == CMDtype::get){
+			replies.push_back(CommandReply(activeProfile));
+		}else{
+			return CommandStatus::ERR;
+		}
+		break;
+	default:
+		return CommandStatus::NOT_FOUND;
+	}
+	return CommandStatus::OK;
+}
@@ -580,6 +580,34 @@ void EffectsCalculator::saveFlash()
 
 }
 
+uint16_t EffectsCalculator::getProfileKey(){
+	return ADR_CF_FILTER;
+}
+
+/**
+ * Filter and effect gains for config profiles
+ */
+uint8_t EffectsCalculator::saveProfile(uint16_t* buf,uint8_t maxLen){
+	if(maxLen < 3){
+		return 0;
+	}
+	buf[0] = (cfFilter_f & 0x1FF) | ((cfFilter_q & 0x7F) << 9);
+	buf[1] = gain.inertia | (gain.friction << 8);
+	buf[2] = gain.spring | (gain.damper << 8);
+	return 3;
+}
+
+void EffectsCalculator::loadProfile(const uint16_t* buf,uint8_t len){
+	if(len < 3){
+		return;
+	}
+	setCfFilter(buf[0] & 0x1FF, (buf[0] >> 9) & 0x7F);
+	gain.friction = (buf[1] >> 8) & 0xff;
+	gain.inertia = (buf[1] & 0xff);
+	gain.damper = (buf[2] >> 8) & 0xff;
+	gain.spring = (buf[2] & 0xff);
+}
+
 void EffectsCalculator::setCfFilter(uint32_t freq,uint8_t q)
 {
 	this->cfFilter_q = clip<uint8_t, uint8_t>(q,0,127);
@@ -10,10 +10,56 @@
 #include "FFBoardMain.h"
 #include "cppmain.h"
 #include "critical.hpp"
+#include "semaphore.hpp"
+#include "mutex.hpp"
+#include <atomic>
+#include <algorithm>
 
 std::vector<ErrorHandler*> ErrorHandler::errorHandlers;
 std::vector<Error> ErrorHandler::errors;
 
+/*
+ * Bounded multi producer ring. Every slot carries a sequence number so a producer interrupted while writing its slot
+ * does not block other producers. The slot only becomes visible to the dispatcher once its sequence is published.
+ */
+#define ERROR_RING_SIZE 16 // Power of 2
+struct ErrorRingSlot{
+	std::atomic<uint32_t> seq;
+	ErrorEvent event;
+};
+static ErrorRingSlot errorRing[ERROR_RING_SIZE];
+static bool errorRingInit = [](){ // Slot i is free for the i-th event
+	for(uint32_t i = 0; i < ERROR_RING_SIZE; i++){
+		errorRing[i].seq.store(i, std::memory_order_relaxed);
+	}
+	return true;
+}();
+static std::atomic<uint32_t> errorRingHead(0);
+static uint32_t errorRingTail = 0; // Only used by the dispatcher
+static std::atomic<uint32_t> errorRingDropped(0);
+static uint32_t errorRingDroppedReported = 0;
+
+static cpp_freertos::BinarySemaphore errorEventSem;
+static cpp_freertos::MutexStandard errorsMutex; // Protects the error list between dispatcher and readers
+
+/*
+ * Processes posted error events in a thread.
+ * Higher priority than the main loop so critical errors stop the motors before the next update
+ */
+class ErrorDispatcher : public cpp_freertos::Thread {
+public:
+	ErrorDispatcher() : Thread("errors",256,19){
+		this->Start();
+	}
+	void Run(){
+		while(true){
+			errorEventSem.Take();
+			ErrorHandler::processEvents();
+		}
+	}
+};
+static ErrorDispatcher* errorDispatcher = nullptr;
+
 
 std::string Error::toString(){
 	std::string r = std::to_string((uint32_t)code) + ":";
@@ -31,12 +77,16 @@ std::string Error::toString(){
 		default:
 			r += "err";
 	}
-	r += ":" + (info == "" ? "no info" : info);
+	r += ":" + (info[0] == 0 ? std::string("no info") : std::string(info));
 	return r;
 }
 
 
 ErrorHandler::ErrorHandler(){
+	if(errorDispatcher == nullptr){
+		errorDispatcher = new ErrorDispatcher();
+		errorEventSem.Give(); // Process events posted before the dispatcher was started
+	}
 	addCallbackHandler(errorHandlers,this);
 }
 
@@ -45,70 +95,160 @@ ErrorHandler::~ErrorHandler() {
 }
 
 /*
- * Clears ALL error conditions
+ * Copies the event into the next free slot and wakes the dispatcher.
+ * Returns false and counts the event as dropped if the ring is full
  */
-void ErrorHandler::clearAll(){
-	errors.clear();
+bool ErrorHandler::postEvent(ErrorEventType type,const Error &error){
+	uint32_t pos = errorRingHead.load(std::memory_order_relaxed);
+	ErrorRingSlot* slot;
+	while(true){
+		slot = &errorRing[pos & (ERROR_RING_SIZE-1)];
+		int32_t diff = (int32_t)slot->seq.load(std::memory_order_acquire) - (int32_t)pos;
+		if(diff == 0){
+			if(errorRingHead.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)){
+				break;
+			}
+		}else if(diff < 0){ // Not yet processed by the dispatcher
+			errorRingDropped.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}else{
+			pos = errorRingHead.load(std::memory_order_relaxed);
+		}
+	}
+	slot->event.type = type;
+	slot->event.error = error;
+	slot->seq.store(pos+1, std::memory_order_release);
+
+	if(inIsr()){
+		BaseType_t taskWoken = 0;
+		errorEventSem.GiveFromISR(&taskWoken);
+		portYIELD_FROM_ISR(taskWoken);
+	}else{
+		errorEventSem.Give();
+	}
+	return true;
 }
 
 /*
- * Clears errors marked as temporary
+ * Drains the ring. Only called by the dispatcher thread
  */
-void ErrorHandler::clearTemp(){
-	for (uint8_t i = 0; i < errors.size(); i++){
-		if((errors)[i].type == ErrorType::temporary){
-			errors.erase(errors.begin()+i);
-			break;
+void ErrorHandler::processEvents(){
+	while(true){
+		ErrorRingSlot* slot = &errorRing[errorRingTail & (ERROR_RING_SIZE-1)];
+		if(slot->seq.load(std::memory_order_acquire) != errorRingTail+1){
+			break; // Empty or the producer has not finished writing
 		}
+		ErrorEvent event = slot->event;
+		slot->seq.store(errorRingTail + ERROR_RING_SIZE, std::memory_order_release);
+		errorRingTail++;
+		processEvent(event);
+	}
+
+	uint32_t dropped = errorRingDropped.load(std::memory_order_relaxed);
+	if(dropped != errorRingDroppedReported){
+		errorRingDroppedReported = dropped;
+		ErrorEvent event;
+		event.error = Error(ErrorCode::systemError, ErrorType::temporary, "Error events dropped");
+		processEvent(event);
 	}
 }
 
-void ErrorHandler::addError(Error error){
-	for(Error e : errors){
-		if(error == e){
+void ErrorHandler::processEvent(ErrorEvent &event){
+	switch(event.type){
+	case ErrorEventType::add:
+	{
+		errorsMutex.Lock();
+		bool exists = std::find(errors.begin(), errors.end(), event.error) != errors.end();
+		if(!exists){
+			errors.push_back(event.error);
+		}
+		errorsMutex.Unlock();
+		if(exists){
 			return;
 		}
+		// Call all error handler with this error
+		for(ErrorHandler* e : errorHandlers){
+			e->errorCallback(event.error, false);
+		}
+		break;
+	}
+	case ErrorEventType::clear:
+		errorsMutex.Lock();
+		errors.erase(std::remove(errors.begin(), errors.end(), event.error), errors.end());
+		errorsMutex.Unlock();
+		// Call all error handler with this error and set clear flag
+		for(ErrorHandler* e : errorHandlers){
+			e->errorCallback(event.error, true);
+		}
+		break;
+	case ErrorEventType::clearCode:
+	{
+		std::vector<Error> cleared;
+		errorsMutex.Lock();
+		for (auto it = errors.begin(); it != errors.end();){
+			if(it->code == event.error.code){
+				cleared.push_back(*it);
+				it = errors.erase(it);
+			}else{
+				it++;
+			}
+		}
+		errorsMutex.Unlock();
+		for(Error &error : cleared){
+			for(ErrorHandler* e : errorHandlers){
+				e->errorCallback(error, true);
+			}
+		}
+		break;
 	}
-	errors.push_back(error);
-
-	// Call all error handler with this error
-	//cpp_freertos::CriticalSection::SuspendScheduler();
-	for(ErrorHandler* e : errorHandlers){
-		e->errorCallback(error, false);
 	}
-	//cpp_freertos::CriticalSection::ResumeScheduler();
 }
 
-void ErrorHandler::clearError(Error error){
-	for (uint8_t i = 0; i < errors.size(); i++){
-		if(errors[i] == error){
-			errors.erase(errors.begin()+i);
-			break;
-		}
-	}
+/*
+ * Clears ALL error conditions
+ */
+void ErrorHandler::clearAll(){
+	errorsMutex.Lock();
+	errors.clear();
+	errorsMutex.Unlock();
+}
 
-	// Call all error handler with this error and set clear flag
-	for(ErrorHandler* e : errorHandlers){
-		e->errorCallback(error, true);
-	}
+/*
+ * Clears errors marked as temporary
+ */
+void ErrorHandler::clearTemp(){
+	errorsMutex.Lock();
+	errors.erase(std::remove_if(errors.begin(), errors.end(), [](const Error &e){return e.type == ErrorType::temporary;}), errors.end());
+	errorsMutex.Unlock();
+}
+
+/*
+ * Posts an error. Can be called from ISRs
+ */
+void ErrorHandler::addError(const Error &error){
+	postEvent(ErrorEventType::add, error);
+}
+
+void ErrorHandler::clearError(const Error &error){
+	postEvent(ErrorEventType::clear, error);
 }
 
 /*
  * Clears all errors with a specific errorcode
  */
 void ErrorHandler::clearError(ErrorCode errorcode){
-	for (uint8_t i = 0; i < errors.size(); i++){
-		if(errors[i].code == errorcode){
-			errors.erase(errors.begin()+i);
-			for(ErrorHandler* e : errorHandlers){
-				e->errorCallback(errors[i], true);
-			}
-		}
-	}
+	postEvent(ErrorEventType::clearCode, Error(errorcode, ErrorType::warning, ""));
 }
 
-std::vector<Error>* ErrorHandler::getErrors(){
-	return &errors;
+std::vector<Error> ErrorHandler::getErrors(){
+	errorsMutex.Lock();
+	std::vector<Error> copy = errors;
+	errorsMutex.Unlock();
+	return copy;
+}
+
+uint32_t ErrorHandler::getDroppedEvents(){
+	return errorRingDropped.load(std::memory_order_relaxed);
 }
 
 void ErrorHandler::errorCallback(Error &error, bool cleared){
@@ -143,15 +283,9 @@ void ErrorPrinter::Run(){
 }
 
 
-// TODO prints in thread when called from isr
 void ErrorPrinter::errorCallback(Error &error, bool cleared){
 	if(!cleared){
-//		this->errorsToPrint.push_back(error); // Errors are stored in errorhandler
-		if(inIsr()){
-			this->ResumeFromISR();
-		}else{
-			this->Resume();
-		}
+		this->Resume(); // Errors are stored in errorhandler
 	}
 }
 
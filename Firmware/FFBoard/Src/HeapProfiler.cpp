@@ -0,0 +1,144 @@
+/*
+ * HeapProfiler.cpp
+ *
+ *  Created on: 19.10.2026
+ *      Author: Yannick
+ */
+
+#include "HeapProfiler.h"
+#ifdef HEAPPROFILER
+#include "cppmain.h"
+#include "critical.hpp"
+#include "FreeRTOS.h"
+#include "task.h"
+#include <string>
+
+uint32_t HeapProfiler::allocs = 0;
+uint32_t HeapProfiler::frees = 0;
+uint32_t HeapProfiler::failed = 0;
+uint32_t HeapProfiler::controlPathAllocs = 0;
+uint32_t HeapProfiler::isrAllocs = 0;
+uint32_t HeapProfiler::otherAllocs = 0;
+void* HeapProfiler::controlPathTasks[HEAPPROFILER_CTRLTASKS] = {nullptr};
+HeapProfilerSite HeapProfiler::sites[HEAPPROFILER_SITES];
+uint8_t HeapProfiler::siteCount = 0;
+
+/**
+ * Marks the calling task as running the control path.
+ * Only allocations of this task are counted so preempting tasks are not attributed to it
+ */
+void HeapProfiler::enterControlPath(){
+	void* task = xTaskGetCurrentTaskHandle();
+	cpp_freertos::CriticalSection::Enter();
+	for(void*& t : controlPathTasks){
+		if(t == nullptr){
+			t = task;
+			break;
+		}
+	}
+	cpp_freertos::CriticalSection::Exit();
+}
+
+void HeapProfiler::exitControlPath(){
+	void* task = xTaskGetCurrentTaskHandle();
+	cpp_freertos::CriticalSection::Enter();
+	for(void*& t : controlPathTasks){
+		if(t == task){
+			t = nullptr;
+			break;
+		}
+	}
+	cpp_freertos::CriticalSection::Exit();
+}
+
+/**
+ * Called for every allocation. Must not allocate itself
+ */
+void HeapProfiler::recordAlloc(size_t size,void* caller,bool success){
+	bool isr = inIsr();
+	void* task = isr ? nullptr : xTaskGetCurrentTaskHandle();
+	BaseType_t savedInterruptStatus = cpp_freertos::CriticalSection::EnterFromISR();
+	bool ctrl = false;
+	for(void* t : controlPathTasks){
+		if(task != nullptr && t == task){
+			ctrl = true;
+		}
+	}
+	allocs++;
+	if(!success)
+		failed++;
+	if(isr)
+		isrAllocs++;
+	if(ctrl)
+		controlPathAllocs++;
+
+	HeapProfilerSite* site = nullptr;
+	for(uint8_t i = 0; i < siteCount; i++){
+		if(sites[i].caller == (uintptr_t)caller){
+			site = &sites[i];
+			break;
+		}
+	}
+	if(site == nullptr && siteCount < HEAPPROFILER_SITES){
+		site = &sites[siteCount++];
+		site->caller = (uintptr_t)caller;
+	}
+	if(site){
+		site->count++;
+		site->bytes += size;
+		if(ctrl && site->controlPath < 0xffff)
+			site->controlPath++;
+		if(isr && site->isr < 0xffff)
+			site->isr++;
+	}else{
+		otherAllocs++;
+	}
+	cpp_freertos::CriticalSection::ExitFromISR(savedInterruptStatus);
+}
+
+void HeapProfiler::recordFree(){
+	frees++; // Not exact if called in an interrupt. Only used as a hint for leaks
+}
+
+void HeapProfiler::reset(){
+	BaseType_t savedInterruptStatus = cpp_freertos::CriticalSection::EnterFromISR();
+	allocs = 0;
+	frees = 0;
+	failed = 0;
+	controlPathAllocs = 0;
+	isrAllocs = 0;
+	otherAllocs = 0;
+	siteCount = 0;
+	for(HeapProfilerSite& site : sites){
+		site = HeapProfilerSite();
+	}
+	cpp_freertos::CriticalSection::ExitFromISR(savedInterruptStatus);
+}
+
+/**
+ * Copies the tracked sites. Returns the count
+ */
+uint8_t HeapProfiler::getSites(HeapProfilerSite* buf,uint8_t len){
+	BaseType_t savedInterruptStatus = cpp_freertos::CriticalSection::EnterFromISR();
+	uint8_t count = std::min(len, siteCount);
+	for(uint8_t i = 0; i < count; i++){
+		buf[i] = sites[i];
+	}
+	cpp_freertos::CriticalSection::ExitFromISR(savedInterruptStatus);
+	return count;
+}
+
+/**
+ * allocs:frees:failed:ctrl:isr:other:used:peak:largest free block:free blocks
+ */
+std::string HeapProfiler::getSummaryString(){
+	HeapStats_t stats;
+	vPortGetHeapStats(&stats);
+	size_t used = configTOTAL_HEAP_SIZE - stats.xAvailableHeapSpaceInBytes;
+	size_t peak = configTOTAL_HEAP_SIZE - stats.xMinimumEverFreeBytesRemaining;
+	return std::to_string(allocs) + ":" + std::to_string(frees) + ":" + std::to_string(failed) + ":" + std::to_string(controlPathAllocs)
+			+ ":" + std::to_string(isrAllocs) + ":" + std::to_string(otherAllocs) + ":" + std::to_string(used) + ":" + std::to_string(peak)
+			+ ":" + std::to_string(stats.xSizeOfLargestFreeBlockInBytes) + ":" + std::to_string(stats.xNumberOfFreeBlocks);
+}
+
+#endif
@@ -29,25 +29,55 @@ HID_CommandInterface::~HID_CommandInterface(){
 }
 
 bool HID_CommandInterface::getNewCommands(std::vector<ParsedCommand>& commands){
-	commands = std::move(this->commands);
+	commands.swap(this->commands); // Both keep their capacity
 	this->commands.clear();
 	parserReady = false;
 	return !commands.empty();
 }
 
-// TODO maybe simplify and get rid of thread again if reliable
+/**
+ * Sends queued replies. Consecutive replies to batched commands are packed into as few reports as possible
+ */
 void HID_CommandInterface::Run(){
 	while(true){
 		threadSem.Take();
-		for(HID_CMD_Data_t& rep : outBuffer){
+		cpp_freertos::CriticalSection::SuspendScheduler();
+		sendBuffer.swap(outBuffer);
+		cpp_freertos::CriticalSection::ResumeScheduler();
+
+		size_t idx = 0;
+		while(idx < sendBuffer.size()){
 			while(!tud_hid_n_ready(0)){
 				Delay(1);
 			}
-			this->sendHidCmd(&rep);
+			HID_CMD_Entry_t& entry = sendBuffer[idx];
+			if(entry.seq == 0){
+				HID_CMD_Data_t rep;
+				rep.type = entry.type;
+				rep.clsid = entry.clsid;
+				rep.instance = entry.instance;
+				rep.cmd = entry.cmd;
+				rep.data = entry.data;
+				rep.addr = entry.addr;
+				this->sendHidCmd(&rep);
+				idx++;
+			}else{
+				HID_CMD_Batch_t batch;
+				uint8_t pos = 0;
+				while(idx < sendBuffer.size() && sendBuffer[idx].seq != 0){
+					uint8_t len = packEntry(batch.entries + pos, HIDCMD_BATCH_SIZE - pos, sendBuffer[idx]);
+					if(len == 0)
+						break; // Full
+					pos += len;
+					batch.count++;
+					idx++;
+				}
+				this->sendHidCmdBatch(&batch);
+			}
 		}
-		outBuffer.clear();
-		if(outBuffer.capacity() > 20){
-			outBuffer.shrink_to_fit();
+		sendBuffer.clear();
+		if(sendBuffer.capacity() > 20){
+			sendBuffer.shrink_to_fit();
 		}
 	}
 }
@@ -63,7 +93,11 @@ void HID_CommandInterface::sendReplies(std::vector<CommandResult>& results,Comma
 		if(result.type == CommandStatus::NO_REPLY) // Normally not possible at this point.
 			continue;
 
-		if( (originalInterface != this && enableBroadcastFromOtherInterfaces) || ( result.type == CommandStatus::OK && replies.empty() ) ){ // Request was sent by a different interface
+		if(result.type == CommandStatus::BROADCAST && result.originalCommand.seq != 0){ // Streamed values requested via hid
+			if(this->outBuffer.size() > maxQueuedRepliesBroadcast){
+				continue;
+			}
+		}else if( (originalInterface != this && enableBroadcastFromOtherInterfaces) || ( result.type == CommandStatus::OK && replies.empty() ) ){ // Request was sent by a different interface
 			if(this->outBuffer.size() > maxQueuedRepliesBroadcast){
 				continue; // for now we just throw away broadcasts if the buffer contains too many pending replies.
 			}
@@ -85,8 +119,8 @@ void HID_CommandInterface::sendReplies(std::vector<CommandResult>& results,Comma
 		}
 
 
-		for(CommandReply reply : replies){
-			if(reply.type == CommandReplyType::STRING){
+		for(CommandReply& reply : replies){
+			if(reply.type == CommandReplyType::STRING || reply.type == CommandReplyType::STREAM){
 				continue; // Ignore string only replies
 			}
 
@@ -98,13 +132,14 @@ void HID_CommandInterface::sendReplies(std::vector<CommandResult>& results,Comma
 
 
 void HID_CommandInterface::queueReplyValues(CommandReply& reply,ParsedCommand& command){
-	HID_CMD_Data_t hidReply;
+	HID_CMD_Entry_t hidReply;
 	CmdHandlerInfo* info = command.target->getCommandHandlerInfo();
 	hidReply.addr = reply.adr;
 	hidReply.clsid = info->clsTypeid;
 	hidReply.cmd = command.cmdId;
 	hidReply.data = reply.val;
 	hidReply.instance = info->instance;
+	hidReply.seq = command.seq;
 
 	switch(reply.type){
 	case CommandReplyType::ACK:
@@ -136,58 +171,176 @@ void HID_CommandInterface::transferComplete(uint8_t itf, uint8_t const* report,
 
 
 void HID_CommandInterface::hidCmdCallback(HID_CMD_Data_t* data){
+	HID_CMD_Entry_t entry;
+	entry.type = data->type;
+	entry.clsid = data->clsid;
+	entry.instance = data->instance;
+	entry.cmd = data->cmd;
+	entry.data = data->data;
+	entry.addr = data->addr;
+
+	if(!parseHidCmd(entry)){
+		threadSem.Give(); // Send back error
+		return;
+	}
+
+	if(!commands.empty()){
+		parserReady = true; // Signals that we should execute commands in the thread
+		FFBoardMainCommandThread::wakeUp();
+	}
+}
+
+/**
+ * Receives multiple commands in one report.
+ * All commands are executed together and replies are coalesced by the thread
+ */
+void HID_CommandInterface::hidCmdBatchCallback(HID_CMD_Batch_t* batch,uint16_t len){
+	if(len < offsetof(HID_CMD_Batch_t, entries))
+		return; // Header incomplete
+	uint8_t space = std::min<uint16_t>(len, sizeof(HID_CMD_Batch_t)) - offsetof(HID_CMD_Batch_t, entries);
+	uint8_t pos = 0;
+	bool error = false;
+	for(uint8_t i = 0; i < batch->count; i++){
+		HID_CMD_Entry_t entry;
+		uint8_t entryLen = unpackEntry(batch->entries + pos, space - pos, entry);
+		if(entryLen == 0)
+			break; // Truncated
+		pos += entryLen;
+		if(entry.seq == 0)
+			entry.seq = 1; // Reserved for single reports
+		error |= !parseHidCmd(entry);
+	}
+
+	if(error){
+		threadSem.Give(); // Send back errors
+	}
+	if(!commands.empty()){
+		parserReady = true;
+		FFBoardMainCommandThread::wakeUp();
+	}
+}
+
+/**
+ * Translates a received command and queues it for execution.
+ * Queues a notFound reply and returns false if there is no target
+ */
+bool HID_CommandInterface::parseHidCmd(HID_CMD_Entry_t& entry){
 	ParsedCommand cmd;
-	cmd.cmdId = data->cmd;
-	cmd.instance = data->instance;
-	cmd.val = data->data;
-	cmd.adr = data->addr;
+	cmd.cmdId = entry.cmd;
+	cmd.instance = entry.instance;
+	cmd.val = entry.data;
+	cmd.adr = entry.addr;
+	cmd.seq = entry.seq;
 
 	// Translate type
-	if(data->type == HidCmdType::write){
+	if(entry.type == HidCmdType::write){
 		cmd.type = CMDtype::set;
-	}else if(data->type == HidCmdType::request){
+	}else if(entry.type == HidCmdType::request){
 		cmd.type = CMDtype::get;
-	}else if(data->type == HidCmdType::info){
+	}else if(entry.type == HidCmdType::info){
 		cmd.type = CMDtype::info;
-	}else if(data->type == HidCmdType::writeAddr){
+	}else if(entry.type == HidCmdType::writeAddr){
 		cmd.type = CMDtype::setat;
-	}else if(data->type == HidCmdType::requestAddr){
+	}else if(entry.type == HidCmdType::requestAddr){
 		cmd.type = CMDtype::getat;
 	}
 
-
-
-	if(data->instance != 0xff){
-		cmd.target = CommandHandler::getHandlerFromId(data->clsid,data->instance);
+	if(entry.instance != 0xff){
+		cmd.target = CommandHandler::getHandlerFromId(entry.clsid,entry.instance);
 		if(cmd.target == nullptr || !(cmd.target->isValidCommandId(cmd.cmdId, CMDFLAG_STR_ONLY))){
-			data->type = HidCmdType::notFound;
-			//sendHidCmd(data); // Send back error
-			this->outBuffer.push_back(*data);
-			threadSem.Give();
-			return;
+			entry.type = HidCmdType::notFound;
+			this->outBuffer.push_back(entry);
+			return false;
 		}
-		if(cmd.target->isValidCommandId(cmd.cmdId, CMDFLAG_STR_ONLY))
-			commands.push_back(cmd);
+		commands.push_back(cmd);
 	}else{
-		std::vector<CommandHandler*> handlers = CommandHandler::getHandlersFromId(data->clsid);
+		std::vector<CommandHandler*> handlers = CommandHandler::getHandlersFromId(entry.clsid);
 		for(CommandHandler* handler : handlers){
 			ParsedCommand newCmd = cmd;
 			newCmd.target = handler;
-			if(newCmd.target == nullptr || !(cmd.target->isValidCommandId(cmd.cmdId, CMDFLAG_STR_ONLY))){
-				data->type = HidCmdType::notFound;
-				//sendHidCmd(data); // Send back error
-				this->outBuffer.push_back(*data);
-				threadSem.Give();
-				return;
+			if(newCmd.target == nullptr || !(newCmd.target->isValidCommandId(cmd.cmdId, CMDFLAG_STR_ONLY))){
+				entry.type = HidCmdType::notFound;
+				this->outBuffer.push_back(entry);
+				return false;
 			}
 			commands.push_back(newCmd);
 		}
 	}
+	return true;
+}
 
-	if(!commands.empty()){
-		parserReady = true; // Signals that we should execute commands in the thread
-		FFBoardMainCommandThread::wakeUp();
+/**
+ * Packs an entry of a batched report. Data is truncated to the smallest size that keeps its value.
+ * Returns the number of bytes used or 0 if it does not fit
+ */
+uint8_t HID_CommandInterface::packEntry(uint8_t* buf,uint8_t space,const HID_CMD_Entry_t& entry){
+	int64_t val = entry.data;
+	uint8_t sizeCode = 3;
+	if(val == 0){
+		sizeCode = 0;
+	}else if(val == (int16_t)val){
+		sizeCode = 1;
+	}else if(val == (int32_t)val){
+		sizeCode = 2;
 	}
+	uint8_t dataLen = sizeCode == 0 ? 0 : 1 << sizeCode;
+	bool hasAddr = entry.addr != 0;
+	uint8_t len = HIDCMD_ENTRY_HEADER + dataLen + (hasAddr ? sizeof(entry.addr) : 0);
+	if(len > space){
+		return 0;
+	}
+	buf[0] = ((uint8_t)entry.type & HIDCMD_ENTRY_TYPEMASK) | (sizeCode << HIDCMD_ENTRY_SIZESHIFT) | (hasAddr ? HIDCMD_ENTRY_ADDR : 0);
+	buf[1] = entry.seq;
+	memcpy(buf+2, &entry.clsid, sizeof(entry.clsid));
+	buf[4] = entry.instance;
+	memcpy(buf+5, &entry.cmd, sizeof(entry.cmd));
+	memcpy(buf+HIDCMD_ENTRY_HEADER, &val, dataLen); // Little endian. Lower bytes
+	if(hasAddr){
+		memcpy(buf+HIDCMD_ENTRY_HEADER+dataLen, &entry.addr, sizeof(entry.addr));
+	}
+	return len;
+}
+
+/**
+ * Reads an entry of a batched report.
+ * Returns the number of bytes used or 0 if the entry is truncated
+ */
+uint8_t HID_CommandInterface::unpackEntry(const uint8_t* buf,uint8_t space,HID_CMD_Entry_t& entry){
+	if(space < HIDCMD_ENTRY_HEADER){
+		return 0;
+	}
+	uint8_t sizeCode = (buf[0] >> HIDCMD_ENTRY_SIZESHIFT) & 0x3;
+	uint8_t dataLen = sizeCode == 0 ? 0 : 1 << sizeCode;
+	bool hasAddr = buf[0] & HIDCMD_ENTRY_ADDR;
+	uint8_t len = HIDCMD_ENTRY_HEADER + dataLen + (hasAddr ? sizeof(entry.addr) : 0);
+	if(len > space){
+		return 0;
+	}
+	entry.type = (HidCmdType)(buf[0] & HIDCMD_ENTRY_TYPEMASK);
+	entry.seq = buf[1];
+	memcpy(&entry.clsid, buf+2, sizeof(entry.clsid));
+	entry.instance = buf[4];
+	memcpy(&entry.cmd, buf+5, sizeof(entry.cmd));
+
+	const uint8_t* data = buf+HIDCMD_ENTRY_HEADER;
+	if(sizeCode == 1){
+		int16_t v;
+		memcpy(&v, data, sizeof(v));
+		entry.data = (int64_t)v;
+	}else if(sizeCode == 2){
+		int32_t v;
+		memcpy(&v, data, sizeof(v));
+		entry.data = (int64_t)v;
+	}else if(sizeCode == 3){
+		memcpy(&entry.data, data, sizeof(entry.data));
+	}else{
+		entry.data = 0;
+	}
+	entry.addr = 0;
+	if(hasAddr){
+		memcpy(&entry.addr, data+dataLen, sizeof(entry.addr));
+	}
+	return len;
 }
 
 /*
@@ -200,3 +353,10 @@ bool HID_CommandInterface::sendHidCmd(HID_CMD_Data_t* data){
 
 	return res; // fail
 }
+
+/*
+ * Send multiple replies with the batched vendor defined IN report
+ */
+bool HID_CommandInterface::sendHidCmdBatch(HID_CMD_Batch_t* batch){
+	return tud_hid_n_report(0,0, reinterpret_cast<uint8_t*>(batch), sizeof(HID_CMD_Batch_t));
+}
@@ -12,6 +12,7 @@
 #include "TMC4671.h"
 #include "MotorPWM.h"
 #include "VescCAN.h"
+#include "CanAxis.h"
 
 
 ClassIdentifier MotorDriver::info ={.name = "None" , .id=CLSID_MOT_NONE, .hidden = false};
@@ -42,6 +43,10 @@ const std::vector<class_entry<MotorDriver>> MotorDriver::all_drivers =
 	add_class<VESC_1,MotorDriver>(7),
 	//add_class<VESC_2,MotorDriver>(8)
 #endif
+#ifdef CANAXIS
+	add_class<CanAxis1,MotorDriver>(9),
+	add_class<CanAxis2,MotorDriver>(10),
+#endif
 };
 
 /**
@@ -2,6 +2,7 @@
 
 #include "SPI.h"
 #include "semaphore.hpp"
+#include "critical.hpp"
 #include "cppmain.h"
 
 static bool operator==(const SPI_InitTypeDef& lhs, const SPI_InitTypeDef& rhs) {
@@ -25,6 +26,7 @@ SPIPort::SPIPort(SPI_HandleTypeDef &hspi,const std::vector<OutputPin>& csPins,bo
 	this->allowReconfigure = allowReconfigure;
 	this->csPins = csPins;
 	this->freePins = csPins;
+	getPorts().push_back(this);
 }
 
 // ----------------------------------
@@ -84,62 +86,181 @@ void SPIPort::configurePort(SPI_InitTypeDef* config){
 	HAL_SPI_Init(&hspi);
 }
 
+/*
+ * Switches the port to the config of a device by writing only CR1 and CR2.
+ * Only allowed while no transfer is running
+ */
+void SPIPort::configurePort(SPIConfig* config){
+	if(config == nullptr){
+		return;
+	}
+	if(hspi.State == HAL_SPI_STATE_RESET){
+		configurePort(&config->peripheral); // Not initialized yet
+		return;
+	}
+	SPI_TypeDef* spi = hspi.Instance;
+	if((spi->CR1 & ~SPI_CR1_SPE) == config->cr1 && (spi->CR2 & (SPI_CR2_SSOE | SPI_CR2_FRF)) == config->cr2){
+		return; // No need to reconfigure
+	}
+	hspi.Init = config->peripheral; // HAL transfer functions read the init struct
+	spi->CR1 = config->cr1; // Disables the port. Reenabled by the next transfer
+	spi->CR2 = config->cr2;
+	if(config->peripheral.CRCCalculation == SPI_CRCCALCULATION_ENABLE){
+		spi->CRCPR = config->peripheral.CRCPolynomial & SPI_CRCPR_CRCPOLY_Msk;
+	}
+}
+
 // ----------------------------------
 
-void SPIPort::transmit_DMA(const uint8_t* buf,uint16_t size,SPIDevice* device){
-	device->beginSpiTransfer(this);
-	current_device = device; // Will call back this device
-	if(this->allowReconfigure){
-		this->configurePort(&device->getSpiConfig()->peripheral);
+/*
+ * Adds a DMA request to the queue. Starts it directly if the bus is idle.
+ * Only one request per device can be pending. Repeated requests are merged.
+ * Returns false if the queue is full
+ */
+bool SPIPort::queueTransfer(SPIDevice* device,SPITransferType type,const uint8_t* txbuf,uint8_t* rxbuf,uint16_t size){
+	uint16_t now = micros();
+	SPITransaction transaction = {device, type, txbuf, rxbuf, size, now, (uint16_t)(now + device->getSpiDeadline())};
+
+	// Bus idle and nobody waiting. Start right away
+	if(queueCount == 0 && waitingTasks == 0 && tryTakeSemaphore()){
+		startTransaction(transaction);
+		return true;
+	}
+
+	bool queued = false;
+	BaseType_t savedInterruptStatus = cpp_freertos::CriticalSection::EnterFromISR();
+	for(uint8_t i = 0; i < queueCount; i++){
+		if(queue[i].device == device){ // Already pending
+			queued = true;
+			break;
+		}
 	}
-	HAL_SPI_Transmit_DMA(&this->hspi,const_cast<uint8_t*>(buf),size);
-	// Request completes in tx complete callback
+	if(!queued && queueCount < queue.size()){
+		queue[queueCount++] = transaction;
+		queued = true;
+	}
+	cpp_freertos::CriticalSection::ExitFromISR(savedInterruptStatus);
+
+	if(!queued){
+		device->getSpiStats().dropped++;
+		return false;
+	}
+	// Bus may have been released in the meantime. Releasing starts the next queued transfer
+	if(tryTakeSemaphore()){
+		giveSemaphore();
+	}
+	return true;
 }
 
-void SPIPort::transmitReceive_DMA(const uint8_t* txbuf,uint8_t* rxbuf,uint16_t size,SPIDevice* device){
-	device->beginSpiTransfer(this);
+/*
+ * Picks the queued transfer with the highest priority and earliest deadline and starts it.
+ * Tasks waiting in takeSemaphore are served first because their transfers are short and blocking.
+ */
+bool SPIPort::dispatchQueued(){
+	if(waitingTasks > 0 || queueCount == 0){
+		return false;
+	}
+	BaseType_t savedInterruptStatus = cpp_freertos::CriticalSection::EnterFromISR();
+	if(queueCount == 0){
+		cpp_freertos::CriticalSection::ExitFromISR(savedInterruptStatus);
+		return false;
+	}
+	uint8_t best = 0;
+	for(uint8_t i = 1; i < queueCount; i++){
+		if(queue[i].device->getSpiPriority() < queue[best].device->getSpiPriority() ||
+				(queue[i].device->getSpiPriority() == queue[best].device->getSpiPriority() && (int16_t)(queue[i].deadline - queue[best].deadline) < 0)){
+			best = i;
+		}
+	}
+	SPITransaction transaction = queue[best];
+	queue[best] = queue[--queueCount]; // Order is restored by the search above
+	cpp_freertos::CriticalSection::ExitFromISR(savedInterruptStatus);
+
+	startTransaction(transaction);
+	return true;
+}
+
+/*
+ * Starts a DMA transfer. The semaphore must already be taken
+ */
+void SPIPort::startTransaction(SPITransaction& transaction){
+	SPIDevice* device = transaction.device;
+	device->beginSpiTransfer(this, true); // Ownership is passed from the previous transfer
 	if(this->allowReconfigure){
-		this->configurePort(&device->getSpiConfig()->peripheral);
+		this->configurePort(device->getSpiConfig());
 	}
 	current_device = device; // Will call back this device
-	HAL_SPI_TransmitReceive_DMA(&this->hspi,const_cast<uint8_t*>(txbuf),rxbuf,size);
-	// Request completes in rxtx complete callback
+	transferStart = micros();
+	SPIDeviceStats& stats = device->getSpiStats();
+	stats.maxWait = std::max<uint16_t>(stats.maxWait, transferStart - transaction.queued);
+
+	switch(transaction.type){
+	case SPITransferType::tx:
+		HAL_SPI_Transmit_DMA(&this->hspi,const_cast<uint8_t*>(transaction.txbuf),transaction.size);
+	break;
+	case SPITransferType::rx:
+		HAL_SPI_Receive_DMA(&this->hspi,transaction.rxbuf,transaction.size);
+	break;
+	case SPITransferType::txrx:
+		HAL_SPI_TransmitReceive_DMA(&this->hspi,const_cast<uint8_t*>(transaction.txbuf),transaction.rxbuf,transaction.size);
+	break;
+	}
+	// Request completes in complete callback
+}
+
+/*
+ * Updates bus time statistics of a device after a transfer
+ */
+void SPIPort::transferDone(SPIDevice* device){
+	uint16_t busTime = (uint16_t)micros() - transferStart;
+	SPIDeviceStats& stats = device->getSpiStats();
+	stats.transfers++;
+	stats.busTime += busTime;
+	stats.maxBusTime = std::max<uint16_t>(stats.maxBusTime, busTime);
+}
+
+void SPIPort::transmit_DMA(const uint8_t* buf,uint16_t size,SPIDevice* device){
+	queueTransfer(device, SPITransferType::tx, buf, nullptr, size);
+}
+
+void SPIPort::transmitReceive_DMA(const uint8_t* txbuf,uint8_t* rxbuf,uint16_t size,SPIDevice* device){
+	queueTransfer(device, SPITransferType::txrx, txbuf, rxbuf, size);
 }
 
 void SPIPort::receive_DMA(uint8_t* buf,uint16_t size,SPIDevice* device){
-	device->beginSpiTransfer(this);
-	if(this->allowReconfigure){
-		this->configurePort(&device->getSpiConfig()->peripheral);
-	}
-	current_device = device;
-	HAL_SPI_Receive_DMA(&this->hspi,buf,size);
-	// Request completes in rx complete callback
+	queueTransfer(device, SPITransferType::rx, nullptr, buf, size);
 }
 
 void SPIPort::transmit(const uint8_t* buf,uint16_t size,SPIDevice* device,uint16_t timeout){
 	device->beginSpiTransfer(this);
 	if(this->allowReconfigure){
-		this->configurePort(&device->getSpiConfig()->peripheral);
+		this->configurePort(device->getSpiConfig());
 	}
+	transferStart = micros();
 	HAL_SPI_Transmit(&this->hspi,const_cast<uint8_t*>(buf),size,timeout);
+	transferDone(device);
 	device->endSpiTransfer(this);
 }
 
 void SPIPort::receive(uint8_t* buf,uint16_t size,SPIDevice* device,int16_t timeout){
 	device->beginSpiTransfer(this);
 	if(this->allowReconfigure){
-		this->configurePort(&device->getSpiConfig()->peripheral);
+		this->configurePort(device->getSpiConfig());
 	}
+	transferStart = micros();
 	HAL_SPI_Receive(&this->hspi,buf,size,timeout);
+	transferDone(device);
 	device->endSpiTransfer(this);
 }
 
 void SPIPort::transmitReceive(const uint8_t* txbuf,uint8_t* rxbuf,uint16_t size,SPIDevice* device,uint16_t timeout){
 	device->beginSpiTransfer(this);
 	if(this->allowReconfigure){
-		this->configurePort(&device->getSpiConfig()->peripheral);
+		this->configurePort(device->getSpiConfig());
 	}
+	transferStart = micros();
 	HAL_SPI_TransmitReceive(&this->hspi,const_cast<uint8_t*>(txbuf),rxbuf,size,timeout);
+	transferDone(device);
 	device->endSpiTransfer(this);
 }
 // --------------------------------
@@ -147,15 +268,28 @@ void SPIPort::transmitReceive(const uint8_t* txbuf,uint8_t* rxbuf,uint16_t size,
 void SPIPort::takeSemaphore(){
 	bool isIsr = inIsr();
 	BaseType_t taskWoken = 0;
-	if(isIsr)
+	if(isIsr){
 		this->semaphore.TakeFromISR(&taskWoken);
-	else
+	}else{
+		cpp_freertos::CriticalSection::Enter();
+		waitingTasks++;
+		cpp_freertos::CriticalSection::Exit();
 		this->semaphore.Take();
+		cpp_freertos::CriticalSection::Enter();
+		waitingTasks--;
+		cpp_freertos::CriticalSection::Exit();
+	}
 	isTakenFlag = true;
 	portYIELD_FROM_ISR(taskWoken);
 }
 
+/*
+ * Releases the bus. If transfers are queued and no task waits the next one is started instead
+ */
 void SPIPort::giveSemaphore(){
+	if(dispatchQueued()){
+		return; // Ownership passed to the next queued transfer
+	}
 	bool isIsr = inIsr();
 	BaseType_t taskWoken = 0;
 	if(isIsr)
@@ -166,10 +300,54 @@ void SPIPort::giveSemaphore(){
 	portYIELD_FROM_ISR(taskWoken);
 }
 
+/*
+ * Takes the semaphore only if it is free
+ */
+bool SPIPort::tryTakeSemaphore(){
+	bool taken;
+	if(inIsr()){
+		BaseType_t taskWoken = 0;
+		taken = this->semaphore.TakeFromISR(&taskWoken);
+	}else{
+		taken = this->semaphore.Take(0);
+	}
+	if(taken){
+		isTakenFlag = true;
+	}
+	return taken;
+}
+
 bool SPIPort::isTaken(){
 	return isTakenFlag;
 }
 
+void SPIPort::registerDevice(SPIDevice* device){
+	devices.push_back(device);
+}
+
+/*
+ * Removes a device and all its pending requests
+ */
+void SPIPort::unregisterDevice(SPIDevice* device){
+	BaseType_t savedInterruptStatus = cpp_freertos::CriticalSection::EnterFromISR();
+	for(uint8_t i = 0; i < queueCount;){
+		if(queue[i].device == device){
+			queue[i] = queue[--queueCount];
+		}else{
+			i++;
+		}
+	}
+	cpp_freertos::CriticalSection::ExitFromISR(savedInterruptStatus);
+	auto it = std::find(devices.begin(), devices.end(), device);
+	if(it != devices.end()){
+		devices.erase(it);
+	}
+}
+
+std::vector<SPIDevice*>& SPIPort::getDevices(){
+	return devices;
+}
+
 
 void SPIPort::SpiTxCplt(SPI_HandleTypeDef *hspi) {
 	if (current_device == nullptr) {
@@ -179,9 +357,11 @@ void SPIPort::SpiTxCplt(SPI_HandleTypeDef *hspi) {
 	if (hspi->Instance != this->hspi.Instance) {
 		return;
 	}
-	current_device->spiTxCompleted(this);
-	current_device->endSpiTransfer(this);
-	current_device = nullptr;
+	SPIDevice* device = current_device;
+	current_device = nullptr; // Releasing may already start the next transfer
+	transferDone(device);
+	device->spiTxCompleted(this);
+	device->endSpiTransfer(this);
 
 }
 void SPIPort::SpiRxCplt(SPI_HandleTypeDef *hspi) {
@@ -192,9 +372,11 @@ void SPIPort::SpiRxCplt(SPI_HandleTypeDef *hspi) {
 	if (hspi->Instance != this->hspi.Instance) {
 		return;
 	}
-	current_device->spiRxCompleted(this);
-	current_device->endSpiTransfer(this);
-	current_device = nullptr;
+	SPIDevice* device = current_device;
+	current_device = nullptr; // Releasing may already start the next transfer
+	transferDone(device);
+	device->spiRxCompleted(this);
+	device->endSpiTransfer(this);
 }
 void SPIPort::SpiTxRxCplt(SPI_HandleTypeDef *hspi) {
 	if (current_device == nullptr) {
@@ -204,9 +386,11 @@ void SPIPort::SpiTxRxCplt(SPI_HandleTypeDef *hspi) {
 	if (hspi->Instance != this->hspi.Instance) {
 		return;
 	}
-	current_device->spiTxRxCompleted(this);
-	current_device->endSpiTransfer(this);
-	current_device = nullptr;
+	SPIDevice* device = current_device;
+	current_device = nullptr; // Releasing may already start the next transfer
+	transferDone(device);
+	device->spiTxRxCompleted(this);
+	device->endSpiTransfer(this);
 }
 
 void SPIPort::SpiError(SPI_HandleTypeDef *hspi) {
@@ -218,19 +402,23 @@ void SPIPort::SpiError(SPI_HandleTypeDef *hspi) {
 		return;
 	}
 
-	current_device->spiRequestError(this);
-	current_device->endSpiTransfer(this);
+	SPIDevice* device = current_device;
 	current_device = nullptr;
+	device->spiRequestError(this);
+	device->endSpiTransfer(this);
 }
 
 SPIDevice::SPIDevice(SPIPort& port,SPIConfig& spiConfig) : spiPort{port},spiConfig{spiConfig}{
 	spiPort.reserveCsPin(spiConfig.cs);
+	spiPort.registerDevice(this);
 }
 SPIDevice::SPIDevice(SPIPort& port,OutputPin csPin) : spiPort{port},spiConfig{csPin}{
 	this->spiConfig.cs = csPin;
 	spiPort.reserveCsPin(spiConfig.cs);
+	spiPort.registerDevice(this);
 }
 SPIDevice::~SPIDevice() {
+	spiPort.unregisterDevice(this);
 	spiPort.freeCsPin(spiConfig.cs);
 }
 
@@ -251,10 +439,13 @@ bool SPIDevice::updateCSPin(OutputPin& csPin){
 
 /*
  * Called before the spi transfer starts.
- * Can be used to take the semaphore and set CS pins by default
+ * Can be used to take the semaphore and set CS pins by default.
+ * busOwned is true if the port already holds the semaphore for a queued transfer
  */
-void SPIDevice::beginSpiTransfer(SPIPort* port){
-	port->takeSemaphore();
+void SPIDevice::beginSpiTransfer(SPIPort* port,bool busOwned){
+	if(!busOwned){
+		port->takeSemaphore();
+	}
 	assertChipSelect();
 }
 
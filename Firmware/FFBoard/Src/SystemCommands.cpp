@@ -13,6 +13,13 @@
 #include "constants.h"
 #include "task.h"
 #include "FreeRTOSConfig.h"
+#include "SPI.h"
+#include "CAN.h"
+#include "CDCcomm.h"
+#include "TimingProbes.h"
+#include "HeapProfiler.h"
+#include "CommandInterface.h"
+#include "eeprom_addresses.h"
 extern ClassChooser<FFBoardMain> mainchooser;
 extern FFBoardMain* mainclass;
 //extern static const uint8_t SW_VERSION_INT[3];
@@ -66,6 +73,16 @@ void SystemCommands::registerCommands(){
 	CommandHandler::registerCommand("format", FFBoardMain_commands::format, "set format=1 to erase all stored values",CMDFLAG_SET);
 	CommandHandler::registerCommand("debug", FFBoardMain_commands::debug, "Enable or disable debug commands",CMDFLAG_SET | CMDFLAG_GET);
 	CommandHandler::registerCommand("devid", FFBoardMain_commands::devid, "Get chip dev id and rev id",CMDFLAG_GET);
+	CommandHandler::registerCommand("spistats", FFBoardMain_commands::spistats, "SPI bus usage per device (port:cs:prio:transfers:bustime:maxbus:maxwait:dropped) in us",CMDFLAG_GET);
+	CommandHandler::registerCommand("cdcstats", FFBoardMain_commands::cdcstats, "CDC transmit buffer (stalls:stalltime ms:dropped:peak:sent:used:size). Adr: field. Set 0 to reset",CMDFLAG_GET | CMDFLAG_GETADR | CMDFLAG_SET);
+	CommandHandler::registerCommand("timing", FFBoardMain_commands::timing, "Timing probes in us (name:count:min:avg:max:deadline:overruns:histogram 2^n us). Adr: probe (max:overruns). Set 0 to reset",CMDFLAG_GET | CMDFLAG_GETADR | CMDFLAG_SET);
+#ifdef HEAPPROFILER
+	CommandHandler::registerCommand("heapstats", FFBoardMain_commands::heapstats, "Allocations (allocs:frees:failed:ctrl:isr:other:used:peak:largestfree:freeblocks) and call sites (caller:count:bytes:ctrl:isr). Set 0 to reset",CMDFLAG_GET | CMDFLAG_SET);
+#endif
+#ifdef CANBUS
+	CommandHandler::registerCommand("canstats", FFBoardMain_commands::canstats, "CAN bus stats per port (port:rxfps:txfps:load0.1%:tec:rec:busoff:errpassive:errwarn:rxovr:txerr:txqueued:txdrop:txovr). Adr: field of port 0. Set 0 to reset",CMDFLAG_GET | CMDFLAG_GETADR | CMDFLAG_SET);
+	CommandHandler::registerCommand("canids", FFBoardMain_commands::canids, "CAN frame rate per id (port:id:ext:tx:frames:fps). Adr: index in port 0 (fps:id)",CMDFLAG_GET | CMDFLAG_GETADR);
+#endif
 }
 
 CommandStatus SystemCommands::internalCommand(const ParsedCommand& cmd,std::vector<CommandReply>& replies,CommandInterface* interface){
@@ -76,32 +93,29 @@ CommandStatus SystemCommands::internalCommand(const ParsedCommand& cmd,std::vect
 		case FFBoardMain_commands::help:
 		{// help
 			if(cmd.type == CMDtype::info){
-				replies.push_back(CommandReply(this->getCsvHelpstring()));
+				replies.push_back(CommandReply(std::make_shared<CommandHelpGenerator>(this, true)));
 			}else{
-				std::string reply =	interface->getHelpstring() + "\nAvailable classes (use cls.0.help for more info):\n";
-				//std::string reply = "";
-				for(CommandHandler* handler : CommandHandler::cmdHandlers){
-					CmdHandlerInfo* info = handler->getCommandHandlerInfo();
-					reply += std::string(info->clsname) + "." + std::to_string(info->instance)+"\n";
-				}
-				reply +=  "\n"+this->getCommandsHelpstring();
-				replies.push_back(CommandReply(reply));
+				replies.push_back(CommandReply(std::make_shared<SystemHelpGenerator>(interface->getHelpstring(), this)));
 			}
 
 			break;
 		}
 
 		case FFBoardMain_commands::save:
+			Flash_BeginBatch(); // Written together in the background
 			for(PersistentStorage* handler : PersistentStorage::flashHandlers){
 				handler->saveFlash();
 			}
+			Flash_CommitBatch();
 			break;
 
 		case FFBoardMain_commands::reboot:
+			Flash_WaitCommit();
 			NVIC_SystemReset();
 			break;
 
 		case FFBoardMain_commands::dfu:
+			Flash_WaitCommit();
 			RebootDFU();
 			break;
 		case FFBoardMain_commands::lsmain:
@@ -133,6 +147,7 @@ CommandStatus SystemCommands::internalCommand(const ParsedCommand& cmd,std::vect
 				if(mainchooser.isValidClassId(cmd.val)){
 					Flash_Write(ADR_CURRENT_CONFIG, (uint16_t)cmd.val);
 					if(cmd.val != mainclass->getInfo().id){
+						Flash_WaitCommit();
 						NVIC_SystemReset(); // Reboot
 					}
 				}
@@ -145,7 +160,11 @@ CommandStatus SystemCommands::internalCommand(const ParsedCommand& cmd,std::vect
 			break;
 		}
 		case FFBoardMain_commands::flashdump:
-			replyFlashDump(replies);
+			if(interface && interface->streamsReplies()){
+				replies.push_back(CommandReply(std::make_shared<FlashDumpGenerator>()));
+			}else{
+				replyFlashDump(replies);
+			}
 			break;
 
 		case FFBoardMain_commands::flashraw:
@@ -215,6 +234,73 @@ CommandStatus SystemCommands::internalCommand(const ParsedCommand& cmd,std::vect
 			replies.push_back(CommandReply(xPortGetFreeHeapSize(),xPortGetMinimumEverFreeHeapSize()));
 			break;
 		}
+		case FFBoardMain_commands::spistats:
+			replySpiStats(replies);
+		break;
+		case FFBoardMain_commands::cdcstats:
+			if(cmd.type == CMDtype::set && cmd.val == 0){
+				CDCcomm::resetStats();
+			}else if(cmd.type == CMDtype::getat){
+				replies.push_back(CommandReply(CDCcomm::getStat((CDCTxStatField)cmd.adr)));
+			}else if(cmd.type == CMDtype::get){
+				std::string reply;
+				for(uint8_t field = 0; field <= (uint8_t)CDCTxStatField::size; field++){
+					if(field)
+						reply += ":";
+					reply += std::to_string(CDCcomm::getStat((CDCTxStatField)field));
+				}
+				replies.push_back(CommandReply(reply));
+			}else{
+				flag = CommandStatus::ERR;
+			}
+		break;
+		case FFBoardMain_commands::timing:
+			if(cmd.type == CMDtype::set && cmd.val == 0){
+				TimingProbes::resetAll();
+			}else if(cmd.type == CMDtype::getat){
+				if(cmd.adr >= (uint8_t)TimingProbeId::COUNT){
+					flag = CommandStatus::ERR;
+					break;
+				}
+				TimingProbe& probe = TimingProbes::get((TimingProbeId)cmd.adr);
+				replies.push_back(CommandReply(probe.max, probe.overruns));
+			}else if(cmd.type == CMDtype::get){
+				for(uint8_t i = 0; i < (uint8_t)TimingProbeId::COUNT; i++){
+					TimingProbe& probe = TimingProbes::get((TimingProbeId)i);
+					replies.push_back(CommandReply(probe.getStatsString(), probe.max, probe.overruns));
+				}
+			}else{
+				flag = CommandStatus::ERR;
+			}
+		break;
+#ifdef HEAPPROFILER
+		case FFBoardMain_commands::heapstats:
+			if(cmd.type == CMDtype::set && cmd.val == 0){
+				HeapProfiler::reset();
+			}else if(cmd.type == CMDtype::get){
+				replyHeapStats(replies);
+			}else{
+				flag = CommandStatus::ERR;
+			}
+		break;
+#endif
+#ifdef CANBUS
+		case FFBoardMain_commands::canstats:
+			if(cmd.type == CMDtype::set && cmd.val == 0){
+				for(CANPort* port : CANPort::getPorts()){
+					port->resetStats();
+				}
+			}else if(cmd.type == CMDtype::set){
+				flag = CommandStatus::ERR;
+			}else{
+				flag = replyCanStats(cmd, replies);
+			}
+		break;
+		case FFBoardMain_commands::canids:
+			flag = replyCanIds(cmd, replies);
+		break;
+#endif
+
 #if configUSE_STATS_FORMATTING_FUNCTIONS>0
 		case FFBoardMain_commands::taskstats:
 		{
@@ -226,6 +312,10 @@ CommandStatus SystemCommands::internalCommand(const ParsedCommand& cmd,std::vect
 #endif
 		case FFBoardMain_commands::lsactive:
 		{
+			if(interface && interface->streamsReplies()){
+				replies.push_back(CommandReply(std::make_shared<LsActiveGenerator>()));
+				break;
+			}
 			for(CommandHandler* handler : CommandHandler::cmdHandlers){
 				if(handler->hasCommands()){
 					ClassIdentifier i = handler->getInfo();
@@ -242,9 +332,9 @@ CommandStatus SystemCommands::internalCommand(const ParsedCommand& cmd,std::vect
 		}
 		case FFBoardMain_commands::format:
 			if(cmd.type == CMDtype::set && cmd.val==1){
-				HAL_FLASH_Unlock();
-				EE_Format();
-				HAL_FLASH_Lock();
+				if(Flash_Format() != HAL_OK){
+					flag = CommandStatus::ERR;
+				}
 			}
 		break;
 
@@ -275,12 +365,133 @@ void SystemCommands::replyFlashDump(std::vector<CommandReply>& replies){
 	}
 }
 
+/**
+ * Writes the interface help and one class per call. Then continues with the system command help
+ */
+bool SystemHelpGenerator::generate(ReplyWriter& out,uint32_t& pos){
+	if(pos & POS_COMMANDS){
+		uint32_t cmdPos = pos & ~POS_COMMANDS;
+		bool more = commandHelp.generate(out, cmdPos);
+		pos = cmdPos | POS_COMMANDS;
+		return more;
+	}
+	if(pos == 0){
+		out.write(interfaceHelp);
+		out.write("\nAvailable classes (use cls.0.help for more info):\n");
+	}
+
+	// Copy the name while locked. Writing may block until the interface has space
+	CommandHandler::cmdHandlerListMutex.Lock();
+	bool found = pos < CommandHandler::cmdHandlers.size();
+	const char* clsname = nullptr;
+	uint8_t instance = 0;
+	if(found){
+		CmdHandlerInfo* info = CommandHandler::cmdHandlers[pos]->getCommandHandlerInfo();
+		clsname = info->clsname;
+		instance = info->instance;
+	}
+	CommandHandler::cmdHandlerListMutex.Unlock();
+
+	if(found){
+		out.write(clsname);
+		out.write('.');
+		out.writeInt(instance);
+		out.write('\n');
+		pos++;
+	}else{
+		out.write('\n');
+		pos = POS_COMMANDS;
+	}
+	return true;
+}
+
+/**
+ * Writes one stored variable per call
+ */
+bool FlashDumpGenerator::generate(ReplyWriter& out,uint32_t& pos){
+	extern uint16_t VirtAddVarTab[NB_OF_VAR];
+	uint32_t i = pos & ~POS_STARTED;
+	while(i < NB_OF_VAR){
+		uint16_t adr = VirtAddVarTab[i++];
+		uint16_t val;
+		if(Flash_Read(adr,&val)){
+			writeSeparator(out, pos, "\n");
+			out.writeInt(val);
+			out.write(':');
+			out.writeInt(adr);
+			break;
+		}
+	}
+	pos = i | (pos & POS_STARTED);
+	return i < NB_OF_VAR;
+}
+
+/**
+ * Writes one active handler per call
+ */
+bool LsActiveGenerator::generate(ReplyWriter& out,uint32_t& pos){
+	uint32_t i = pos & ~POS_STARTED;
+	ClassIdentifier clsInfo;
+	const char* clsname = nullptr;
+	uint8_t instance = 0;
+	uint16_t handlerId = 0;
+	bool found = false;
+
+	CommandHandler::cmdHandlerListMutex.Lock();
+	while(i < CommandHandler::cmdHandlers.size() && !found){
+		CommandHandler* handler = CommandHandler::cmdHandlers[i++];
+		if(handler->hasCommands()){
+			clsInfo = handler->getInfo();
+			CmdHandlerInfo* info = handler->getCommandHandlerInfo();
+			clsname = info->clsname;
+			instance = info->instance;
+			handlerId = info->commandHandlerID;
+			found = true;
+		}
+	}
+	bool more = i < CommandHandler::cmdHandlers.size();
+	CommandHandler::cmdHandlerListMutex.Unlock();
+
+	if(found){
+		writeSeparator(out, pos, "\n");
+		out.write(clsInfo.name);
+		out.write(':');
+		out.write(clsname);
+		out.write(':');
+		out.writeInt(instance);
+		out.write(':');
+		out.writeInt(clsInfo.id);
+		out.write(':');
+		out.writeInt(handlerId);
+	}
+	pos = i | (pos & POS_STARTED);
+	return more;
+}
+
+#ifdef HEAPPROFILER
+/*
+ * Summary and one line per allocating call site. Sites are copied first because replying allocates
+ */
+void SystemCommands::replyHeapStats(std::vector<CommandReply>& replies){
+	HeapProfilerSite sites[HEAPPROFILER_SITES];
+	uint8_t count = HeapProfiler::getSites(sites, HEAPPROFILER_SITES);
+	replies.push_back(CommandReply(HeapProfiler::getSummaryString(), HeapProfiler::allocs, HeapProfiler::controlPathAllocs + HeapProfiler::isrAllocs));
+	for(uint8_t i = 0; i < count; i++){
+		char caller[11];
+		std::snprintf(caller, sizeof(caller), "0x%08lX", (uint32_t)sites[i].caller);
+		std::string reply = std::string(caller) + ":" + std::to_string(sites[i].count) + ":" + std::to_string(sites[i].bytes)
+				+ ":" + std::to_string(sites[i].controlPath) + ":" + std::to_string(sites[i].isr);
+		replies.push_back(CommandReply(reply, sites[i].count, sites[i].caller));
+	}
+}
+#endif
+
 /*
  * Prints a formatted list of error conditions
  */
 void SystemCommands::replyErrors(std::vector<CommandReply>& replies){
-	std::vector<Error>* errors = ErrorHandler::getErrors();
-	if(errors->size() == 0){
+	std::vector<Error> errors = ErrorHandler::getErrors();
+	if(errors.size() == 0){
 		CommandReply reply;
 		reply.reply += "None";
 		reply.type = CommandReplyType::STRING_OR_INT;
@@ -288,7 +499,7 @@ void SystemCommands::replyErrors(std::vector<CommandReply>& replies){
 		return;
 	}
 
-	for(Error error : *errors){
+	for(Error& error : errors){
 		CommandReply reply;
 		reply.reply += error.toString() + "\n";
 		reply.val = (uint32_t)error.code;
@@ -298,3 +509,79 @@ void SystemCommands::replyErrors(std::vector<CommandReply>& replies){
 
 	ErrorHandler::clearTemp();
 }
+
+/*
+ * Prints bus statistics of every spi device
+ */
+void SystemCommands::replySpiStats(std::vector<CommandReply>& replies){
+	std::vector<SPIPort*>& ports = SPIPort::getPorts();
+	for(uint8_t p = 0; p < ports.size(); p++){
+		std::vector<OutputPin>& csPins = ports[p]->getCsPins();
+		for(SPIDevice* device : ports[p]->getDevices()){
+			auto cs = std::find(csPins.begin(), csPins.end(), device->getSpiConfig()->cs);
+			SPIDeviceStats& stats = device->getSpiStats();
+			CommandReply reply(CommandReplyType::STRING);
+			reply.reply += std::to_string(p) + ":" + std::to_string(std::distance(csPins.begin(), cs)+1) + ":" + std::to_string((uint8_t)device->getSpiPriority());
+			reply.reply += ":" + std::to_string(stats.transfers) + ":" + std::to_string(stats.busTime) + ":" + std::to_string(stats.maxBusTime);
+			reply.reply += ":" + std::to_string(stats.maxWait) + ":" + std::to_string(stats.dropped) + "\n";
+			replies.push_back(reply);
+		}
+	}
+	if(replies.empty()){
+		replies.push_back(CommandReply("None"));
+	}
+}
+
+#ifdef CANBUS
+CommandStatus SystemCommands::replyCanStats(const ParsedCommand& cmd,std::vector<CommandReply>& replies){
+	std::vector<CANPort*>& ports = CANPort::getPorts();
+	if(cmd.type == CMDtype::getat){
+		if(ports.empty() || cmd.adr < 0 || cmd.adr > (int64_t)CANStatField::txOverrun){
+			return CommandStatus::ERR;
+		}
+		replies.push_back(CommandReply(ports[0]->getStat((CANStatField)cmd.adr)));
+		return CommandStatus::OK;
+	}
+	for(uint8_t p = 0; p < ports.size(); p++){
+		CANPortStats stats = ports[p]->getStats();
+		CommandReply reply(CommandReplyType::STRING);
+		reply.reply += std::to_string(p) + ":" + std::to_string(stats.rxRate) + ":" + std::to_string(stats.txRate) + ":" + std::to_string(stats.load);
+		reply.reply += ":" + std::to_string(stats.tec) + ":" + std::to_string(stats.rec) + ":" + std::to_string(stats.busOff) + ":" + std::to_string(stats.errorPassive);
+		reply.reply += ":" + std::to_string(stats.errorWarning) + ":" + std::to_string(stats.rxOverrun) + ":" + std::to_string(stats.txErrors);
+		reply.reply += ":" + std::to_string(ports[p]->getTxQueued()) + ":" + std::to_string(ports[p]->getTxDropped()) + ":" + std::to_string(ports[p]->getTxOverrun());
+		replies.push_back(reply);
+	}
+	if(replies.empty()){
+		replies.push_back(CommandReply("None"));
+	}
+	return CommandStatus::OK;
+}
+
+CommandStatus SystemCommands::replyCanIds(const ParsedCommand& cmd,std::vector<CommandReply>& replies){
+	std::vector<CANPort*>& ports = CANPort::getPorts();
+	if(cmd.type == CMDtype::getat){
+		if(ports.empty()){
+			return CommandStatus::ERR;
+		}
+		std::vector<CANIdStats> ids = ports[0]->getIdStats();
+		if(cmd.adr < 0 || cmd.adr >= (int64_t)ids.size()){
+			return CommandStatus::ERR;
+		}
+		replies.push_back(CommandReply(ids[cmd.adr].rate, ids[cmd.adr].id));
+		return CommandStatus::OK;
+	}
+	for(uint8_t p = 0; p < ports.size(); p++){
+		for(CANIdStats& id : ports[p]->getIdStats()){
+			CommandReply reply(CommandReplyType::STRING);
+			reply.reply += std::to_string(p) + ":" + std::to_string(id.id) + ":" + std::to_string(id.ext ? 1 : 0) + ":" + std::to_string(id.tx ? 1 : 0);
+			reply.reply += ":" + std::to_string(id.frames) + ":" + std::to_string(id.rate);
+			replies.push_back(reply);
+		}
+	}
+	if(replies.empty()){
+		replies.push_back(CommandReply("None"));
+	}
+	return CommandStatus::OK;
+}
+#endif
+
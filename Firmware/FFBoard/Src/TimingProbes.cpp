@@ -0,0 +1,82 @@
+/*
+ * TimingProbes.cpp
+ *
+ *  Created on: 19.10.2026
+ *      Author: Yannick
+ */
+
+#include "TimingProbes.h"
+
+uint32_t TimingProbes::cyclesPerUs = 168;
+
+// Same order as TimingProbeId
+TimingProbe TimingProbes::probes[(uint8_t)TimingProbeId::COUNT] = {
+		TimingProbe("mainloop",1000),
+		TimingProbe("ctrltick",1500), // More than half a frame late is a missed tick
+		TimingProbe("ffbupdate",1000),
+		TimingProbe("cmdexec",0),
+		TimingProbe("usbsof",1100),
+		TimingProbe("hidout",200)
+};
+
+/**
+ * Starts the cycle counter
+ */
+void TimingProbes::init(){
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	cyclesPerUs = SystemCoreClock / 1000000;
+	resetAll();
+}
+
+void TimingProbes::resetAll(){
+	for(TimingProbe& probe : probes){
+		probe.reset();
+	}
+}
+
+
+void TimingProbe::record(uint32_t cycles){
+	uint32_t us = cycles / TimingProbes::cyclesPerUs;
+	count++;
+	sum += us;
+	if(us > max)
+		max = us;
+	if(us < min)
+		min = us;
+	if(deadline && us > deadline)
+		overruns++;
+	uint32_t bin = us < 2 ? 0 : 31 - __CLZ(us);
+	hist[bin < TIMING_HIST_BINS ? bin : TIMING_HIST_BINS - 1]++;
+}
+
+/**
+ * Clears the statistics. The next tick starts a new period
+ */
+void TimingProbe::reset(){
+	count = 0;
+	overruns = 0;
+	min = 0xffffffff;
+	max = 0;
+	sum = 0;
+	for(uint8_t i = 0; i < TIMING_HIST_BINS; i++){
+		hist[i] = 0;
+	}
+	started = false;
+}
+
+/**
+ * name:count:min:avg:max:deadline:overruns:histogram bins separated by commas
+ */
+std::string TimingProbe::getStatsString(){
+	uint32_t n = count;
+	std::string reply = std::string(name) + ":" + std::to_string(n) + ":" + std::to_string(n ? min : 0) + ":" + std::to_string(n ? (uint32_t)(sum / n) : 0)
+			+ ":" + std::to_string(max) + ":" + std::to_string(deadline) + ":" + std::to_string(overruns) + ":";
+	for(uint8_t i = 0; i < TIMING_HIST_BINS; i++){
+		if(i != 0)
+			reply += ",";
+		reply += std::to_string(hist[i]);
+	}
+	return reply;
+}
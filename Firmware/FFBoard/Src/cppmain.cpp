@@ -9,6 +9,8 @@
 #include "RessourceManager.h"
 
 #include "tusb.h"
+#include "TimingProbes.h"
+#include "HeapProfiler.h"
 
 uint32_t clkmhz = HAL_RCC_GetHCLKFreq() / 100000;
 extern TIM_HandleTypeDef TIM_MICROS;
@@ -88,7 +90,9 @@ void cppmain() {
 
 	mainclass->usbInit(); // Let mainclass initialize usb
 
+	TimingProbes::init();
 	while(running){
+		TimingProbes::get(TimingProbeId::mainloop).tick();
 		mainclass->update();
 		updateLeds();
 		//external_spi.process();
@@ -111,6 +115,7 @@ uint32_t micros(){
 }
 
 
+#ifndef HEAPPROFILER
 void* malloc(size_t size)
 {
     return pvPortMalloc(size);
@@ -120,6 +125,65 @@ void free(void *p)
 {
     vPortFree(p);
 }
+#else
+/*
+ * Allocations are counted per caller. new is overridden too so the caller is the code using new instead of the standard library
+ */
+static inline void* profiledMalloc(size_t size,void* caller)
+{
+	void* p = pvPortMalloc(size);
+	HeapProfiler::recordAlloc(size, caller, p != nullptr);
+	return p;
+}
+
+static inline void profiledFree(void *p)
+{
+	if(p != nullptr){
+		HeapProfiler::recordFree();
+	}
+	vPortFree(p);
+}
+
+void* malloc(size_t size)
+{
+    return profiledMalloc(size, __builtin_return_address(0));
+}
+
+void free(void *p)
+{
+	profiledFree(p);
+}
+
+void* operator new(size_t size)
+{
+	return profiledMalloc(size, __builtin_return_address(0));
+}
+
+void* operator new[](size_t size)
+{
+	return profiledMalloc(size, __builtin_return_address(0));
+}
+
+void operator delete(void* p) noexcept
+{
+	profiledFree(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+	profiledFree(p);
+}
+
+void operator delete(void* p, size_t size) noexcept
+{
+	profiledFree(p);
+}
+
+void operator delete[](void* p, size_t size) noexcept
+{
+	profiledFree(p);
+}
+#endif
 
 unsigned long getRunTimeCounterValue(void){
 	return micros();
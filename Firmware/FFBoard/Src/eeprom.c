@@ -60,22 +60,52 @@ uint16_t DataVar = 0;
 /* Virtual address defined by the user: 0xFFFF value is prohibited */
 //extern uint16_t VirtAddVarTab[NB_OF_VAR];
 
+/* RAM copy of the last value of each variable in VirtAddVarTab.
+ * Built once after the pages are restored and updated on every write */
+static uint16_t EE_IndexData[NB_OF_VAR];
+static uint8_t EE_IndexValid[(NB_OF_VAR + 7) / 8];
+static uint16_t EE_IndexSorted[NB_OF_VAR]; /* VirtAddVarTab indices sorted by address */
+static uint8_t EE_IndexReady = 0;
+
 /* Private function prototypes -----------------------------------------------*/
 /* Private functions ---------------------------------------------------------*/
 //static HAL_StatusTypeDef EE_Format(void);
 static uint16_t EE_FindValidPage(uint8_t Operation);
 static uint16_t EE_VerifyPageFullWriteVariable(uint16_t VirtAddress, uint16_t Data);
-static uint16_t EE_PageTransfer(uint16_t VirtAddress, uint16_t Data);
+static uint16_t EE_PageTransfer(const uint16_t* VirtAddress, const uint16_t* Data, uint16_t Count);
+static uint16_t EE_FreeSlots(void);
 static uint16_t EE_VerifyPageFullyErased(uint32_t Address);
+static uint16_t EE_InitPages(void);
+static void EE_BuildIndex(void);
+static int32_t EE_IndexFind(uint16_t VirtAddress);
+static void EE_IndexUpdate(uint16_t VirtAddress, uint16_t Data);
+static void EE_IndexClear(void);
 
 /**
   * @brief  Restore the pages to a known good state in case of page's status
-  *   corruption after a power loss.
+  *   corruption after a power loss and build the RAM index of all variables.
   * @param  None.
   * @retval - Flash error code: on write Flash error
   *         - FLASH_COMPLETE: on success
   */
 uint16_t EE_Init(void)
+{
+  uint16_t Status;
+
+  EE_IndexReady = 0; /* Page repair reads directly from flash */
+  Status = EE_InitPages();
+  EE_BuildIndex();
+  return Status;
+}
+
+/**
+  * @brief  Restore the pages to a known good state in case of page's status
+  *   corruption after a power loss.
+  * @param  None.
+  * @retval - Flash error code: on write Flash error
+  *         - FLASH_COMPLETE: on success
+  */
+static uint16_t EE_InitPages(void)
 {
   uint16_t PageStatus0 = 6, PageStatus1 = 6;
   uint16_t VarIdx = 0;
@@ -361,6 +391,8 @@ uint16_t EE_VerifyPageFullyErased(uint32_t Address)
   *   the passed virtual address
   * @param  VirtAddress: Variable virtual address
   * @param  Data: Global variable contains the read variable value
+  *   Variables listed in VirtAddVarTab are returned from the RAM index.
+  *   Others are searched in the active page.
   * @retval Success or error status:
   *           - 0: if variable was found
   *           - 1: if the variable was not found
@@ -371,6 +403,18 @@ uint16_t EE_ReadVariable(uint16_t VirtAddress, uint16_t* Data)
   uint16_t ValidPage = PAGE0;
   uint16_t AddressValue = 0x5555, ReadStatus = 1;
   uint32_t Address = EEPROM_START_ADDRESS, PageStartAddress = EEPROM_START_ADDRESS;
+  int32_t Idx;
+
+  /* Variables from VirtAddVarTab are read from the RAM index */
+  if (EE_IndexReady && (Idx = EE_IndexFind(VirtAddress)) >= 0)
+  {
+    if (!(EE_IndexValid[Idx >> 3] & (1 << (Idx & 7))))
+    {
+      return 1;
+    }
+    *Data = EE_IndexData[Idx];
+    return 0;
+  }
 
   /* Get active Page for read operation */
   ValidPage = EE_FindValidPage(READ_FROM_VALID_PAGE);
@@ -436,13 +480,46 @@ uint16_t EE_WriteVariable(uint16_t VirtAddress, uint16_t Data)
   if (Status == PAGE_FULL)
   {
     /* Perform Page transfer */
-    Status = EE_PageTransfer(VirtAddress, Data);
+    Status = EE_PageTransfer(&VirtAddress, &Data, 1);
   }
 
   /* Return last operation status */
   return Status;
 }
 
+/**
+  * @brief  Writes/updates multiple variables in EEPROM.
+  *   If they do not fit into the active page all of them are written first
+  *   into the new page during a single page transfer.
+  * @param  VirtAddress: Variable virtual addresses
+  * @param  Data: 16 bit data to be written for each address
+  * @param  Count: Number of variables
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success
+  *           - PAGE_FULL: if valid page is full
+  *           - NO_VALID_PAGE: if no valid page was found
+  *           - Flash error code: on write Flash error
+  */
+uint16_t EE_WriteVariables(const uint16_t* VirtAddress, const uint16_t* Data, uint16_t Count)
+{
+  uint16_t Status = HAL_OK, VarIdx;
+
+  if (Count > EE_FreeSlots())
+  {
+    return EE_PageTransfer(VirtAddress, Data, Count);
+  }
+
+  for (VarIdx = 0; VarIdx < Count; VarIdx++)
+  {
+    Status = EE_VerifyPageFullWriteVariable(VirtAddress[VarIdx], Data[VarIdx]);
+    if (Status != HAL_OK)
+    {
+      return Status;
+    }
+  }
+  return Status;
+}
+
 /**
   * @brief  Erases PAGE and PAGE1 and writes VALID_PAGE header to PAGE
   * @param  None
@@ -455,6 +532,8 @@ HAL_StatusTypeDef EE_Format(void)
   uint32_t SectorError = 0;
   FLASH_EraseInitTypeDef pEraseInit;
 
+  EE_IndexClear();
+
   pEraseInit.TypeErase = FLASH_TYPEERASE_SECTORS;  
   pEraseInit.Sector = PAGE0_ID;
   pEraseInit.NbSectors = 1;
@@ -609,6 +688,11 @@ static uint16_t EE_VerifyPageFullWriteVariable(uint16_t VirtAddress, uint16_t Da
       }
       /* Set variable virtual address */
       FlashStatus = HAL_FLASH_Program(TYPEPROGRAM_HALFWORD, Address + 2, VirtAddress);       
+      /* Keep the RAM index in sync */
+      if (FlashStatus == HAL_OK)
+      {
+        EE_IndexUpdate(VirtAddress, Data);
+      }
       /* Return program operation status */
       return FlashStatus;
     }
@@ -623,23 +707,54 @@ static uint16_t EE_VerifyPageFullWriteVariable(uint16_t VirtAddress, uint16_t Da
   return PAGE_FULL;
 }
 
+/**
+  * @brief  Counts the unused variable slots in the active page.
+  * @param  None
+  * @retval Number of variables that can be written without page transfer
+  */
+static uint16_t EE_FreeSlots(void)
+{
+  uint16_t ValidPage;
+  uint32_t Address, PageEndAddress;
+
+  ValidPage = EE_FindValidPage(WRITE_IN_VALID_PAGE);
+  if (ValidPage == NO_VALID_PAGE)
+  {
+    return 0;
+  }
+  Address = (uint32_t)(EEPROM_START_ADDRESS + (uint32_t)(ValidPage * PAGE_SIZE));
+  PageEndAddress = (uint32_t)((EEPROM_START_ADDRESS - 1) + (uint32_t)((ValidPage + 1) * PAGE_SIZE));
+
+  /* Variables are appended so the first empty slot marks the free area */
+  while (Address < PageEndAddress)
+  {
+    if ((*(__IO uint32_t*)Address) == 0xFFFFFFFF)
+    {
+      return (PageEndAddress + 1 - Address) / 4;
+    }
+    Address = Address + 4;
+  }
+  return 0;
+}
+
 /**
   * @brief  Transfers last updated variables data from the full Page to
   *   an empty one.
-  * @param  VirtAddress: 16 bit virtual address of the variable
-  * @param  Data: 16 bit data to be written as variable value
+  * @param  VirtAddress: 16 bit virtual addresses of the new variables
+  * @param  Data: 16 bit data to be written as variable values
+  * @param  Count: Number of new variables. Written before all others are copied
   * @retval Success or error status:
   *           - FLASH_COMPLETE: on success
   *           - PAGE_FULL: if valid page is full
   *           - NO_VALID_PAGE: if no valid page was found
   *           - Flash error code: on write Flash error
   */
-static uint16_t EE_PageTransfer(uint16_t VirtAddress, uint16_t Data)
+static uint16_t EE_PageTransfer(const uint16_t* VirtAddress, const uint16_t* Data, uint16_t Count)
 {
   HAL_StatusTypeDef FlashStatus = HAL_OK;
   uint32_t NewPageAddress = EEPROM_START_ADDRESS;
   uint16_t OldPageId=0;
-  uint16_t ValidPage = PAGE0, VarIdx = 0;
+  uint16_t ValidPage = PAGE0, VarIdx = 0, NewIdx = 0;
   uint16_t EepromStatus = 0, ReadStatus = 0;
   uint32_t SectorError = 0;
   FLASH_EraseInitTypeDef pEraseInit;
@@ -676,18 +791,23 @@ static uint16_t EE_PageTransfer(uint16_t VirtAddress, uint16_t Data)
     return FlashStatus;
   }
   
-  /* Write the variable passed as parameter in the new active page */
-  EepromStatus = EE_VerifyPageFullWriteVariable(VirtAddress, Data);
-  /* If program operation was failed, a Flash error code is returned */
-  if (EepromStatus != HAL_OK)
+  /* Write the variables passed as parameter in the new active page */
+  for (NewIdx = 0; NewIdx < Count; NewIdx++)
   {
-    return EepromStatus;
+    EepromStatus = EE_VerifyPageFullWriteVariable(VirtAddress[NewIdx], Data[NewIdx]);
+    /* If program operation was failed, a Flash error code is returned */
+    if (EepromStatus != HAL_OK)
+    {
+      return EepromStatus;
+    }
   }
 
   /* Transfer process: transfer variables from old to the new active page */
   for (VarIdx = 0; VarIdx < NB_OF_VAR; VarIdx++)
   {
-    if (VirtAddVarTab[VarIdx] != VirtAddress)  /* Check each variable except the one passed as parameter */
+    /* Check each variable except the ones passed as parameter */
+    for (NewIdx = 0; NewIdx < Count && VirtAddVarTab[VarIdx] != VirtAddress[NewIdx]; NewIdx++);
+    if (NewIdx == Count)
     {
       /* Read the other last variable updates */
       ReadStatus = EE_ReadVariable(VirtAddVarTab[VarIdx], &DataVar);
@@ -730,6 +850,116 @@ static uint16_t EE_PageTransfer(uint16_t VirtAddress, uint16_t Data)
   return FlashStatus;
 }
 
+/**
+  * @brief  Finds the position of a virtual address in VirtAddVarTab
+  * @param  VirtAddress: Variable virtual address
+  * @retval Index in VirtAddVarTab or -1 if the address is not listed
+  */
+static int32_t EE_IndexFind(uint16_t VirtAddress)
+{
+  int32_t Low = 0, High = NB_OF_VAR - 1;
+
+  /* Binary search in the sorted index */
+  while (Low <= High)
+  {
+    int32_t Mid = (Low + High) / 2;
+    uint16_t MidAddress = VirtAddVarTab[EE_IndexSorted[Mid]];
+    if (MidAddress == VirtAddress)
+    {
+      return EE_IndexSorted[Mid];
+    }
+    else if (MidAddress < VirtAddress)
+    {
+      Low = Mid + 1;
+    }
+    else
+    {
+      High = Mid - 1;
+    }
+  }
+  return -1;
+}
+
+/**
+  * @brief  Stores a written value in the RAM index
+  * @param  VirtAddress: Variable virtual address
+  * @param  Data: Written value
+  * @retval None
+  */
+static void EE_IndexUpdate(uint16_t VirtAddress, uint16_t Data)
+{
+  int32_t Idx;
+
+  if (!EE_IndexReady || (Idx = EE_IndexFind(VirtAddress)) < 0)
+  {
+    return;
+  }
+  EE_IndexData[Idx] = Data;
+  EE_IndexValid[Idx >> 3] |= 1 << (Idx & 7);
+}
+
+/**
+  * @brief  Marks all variables as not stored
+  * @param  None
+  * @retval None
+  */
+static void EE_IndexClear(void)
+{
+  uint16_t i;
+
+  for (i = 0; i < sizeof(EE_IndexValid); i++)
+  {
+    EE_IndexValid[i] = 0;
+  }
+}
+
+/**
+  * @brief  Sorts the virtual addresses and reads the last value of every
+  *   variable with a single forward scan of the active page.
+  *   The index stays disabled if no valid page exists.
+  * @param  None
+  * @retval None
+  */
+static void EE_BuildIndex(void)
+{
+  uint16_t ValidPage, i, j;
+  uint32_t Address, PageEndAddress;
+
+  EE_IndexReady = 0;
+  EE_IndexClear();
+
+  /* Insertion sort of the table indices by address. Runs once at boot */
+  for (i = 0; i < NB_OF_VAR; i++)
+  {
+    uint16_t Idx = i;
+    for (j = i; j > 0 && VirtAddVarTab[EE_IndexSorted[j - 1]] > VirtAddVarTab[Idx]; j--)
+    {
+      EE_IndexSorted[j] = EE_IndexSorted[j - 1];
+    }
+    EE_IndexSorted[j] = Idx;
+  }
+
+  ValidPage = EE_FindValidPage(READ_FROM_VALID_PAGE);
+  if (ValidPage == NO_VALID_PAGE)
+  {
+    return;
+  }
+  EE_IndexReady = 1;
+
+  /* Variables are appended in order so later entries are newer */
+  Address = (uint32_t)(EEPROM_START_ADDRESS + (uint32_t)(ValidPage * PAGE_SIZE)) + 4;
+  PageEndAddress = (uint32_t)((EEPROM_START_ADDRESS - 1) + (uint32_t)((ValidPage + 1) * PAGE_SIZE));
+  while (Address < PageEndAddress)
+  {
+    if ((*(__IO uint32_t*)Address) == 0xFFFFFFFF)
+    {
+      break; /* End of written area */
+    }
+    EE_IndexUpdate((*(__IO uint16_t*)(Address + 2)), (*(__IO uint16_t*)Address));
+    Address = Address + 4;
+  }
+}
+
 /**
   * @}
   */ 
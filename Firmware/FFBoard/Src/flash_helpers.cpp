@@ -8,18 +8,204 @@
 #include "eeprom_addresses.h"
 #include <vector>
 #include "mutex.hpp"
+#include "thread.hpp"
+#include "semaphore.hpp"
+#include <cstring>
+#include "ErrorHandler.h"
 
-cpp_freertos::MutexStandard flashMutex;
+cpp_freertos::MutexStandard flashMutex; // Locked while the eeprom emulation writes
 // Flash helpers
 
+/*
+ * Write-back cache.
+ * During a batch Flash_Write only records changed variables. They are committed together from a low priority thread
+ * so the command thread returns immediately and a page transfer happens at most once per batch.
+ * Reads return cached values until they are written.
+ */
+class FlashCommitThread : public cpp_freertos::Thread {
+public:
+	FlashCommitThread() : Thread("flashsave",256,17){ // Lowest priority above the default task
+		this->Start();
+	}
+	void Run();
+	cpp_freertos::BinarySemaphore commitSem;
+};
+
+static cpp_freertos::MutexStandard flashCacheMutex;
+static FlashCommitThread* flashCommitThread = nullptr;
+static bool flashBatchOpen = false;
+// Collected during the batch
+static uint16_t flashPendingAdr[NB_OF_VAR];
+static uint16_t flashPendingDat[NB_OF_VAR];
+static volatile uint16_t flashPendingCount = 0;
+// Currently written by the commit thread
+static uint16_t flashCommitAdr[NB_OF_VAR];
+static uint16_t flashCommitDat[NB_OF_VAR];
+static volatile uint16_t flashCommitCount = 0;
 
 
+static int32_t Flash_FindCached(const uint16_t* adrs,uint16_t count,uint16_t adr){
+	for(uint16_t i = 0; i < count; i++){
+		if(adrs[i] == adr){
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Looks up a variable that is not yet written to flash. Cache mutex must be locked
+ */
+static bool Flash_ReadCached(uint16_t adr,uint16_t *buf){
+	int32_t idx = Flash_FindCached(flashPendingAdr, flashPendingCount, adr);
+	if(idx >= 0){
+		*buf = flashPendingDat[idx];
+		return true;
+	}
+	idx = Flash_FindCached(flashCommitAdr, flashCommitCount, adr);
+	if(idx >= 0){
+		*buf = flashCommitDat[idx];
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Writes all pending variables with a single unlock
+ */
+void FlashCommitThread::Run(){
+	while(true){
+		commitSem.Take();
+		while(true){
+			flashCacheMutex.Lock();
+			if(flashBatchOpen || flashPendingCount == 0){
+				flashCacheMutex.Unlock();
+				break;
+			}
+			memcpy(flashCommitAdr, flashPendingAdr, flashPendingCount * sizeof(uint16_t));
+			memcpy(flashCommitDat, flashPendingDat, flashPendingCount * sizeof(uint16_t));
+			flashCommitCount = flashPendingCount;
+			flashPendingCount = 0;
+			flashCacheMutex.Unlock();
+
+			flashMutex.Lock();
+			if(flashCommitCount != 0){ // Cancelled by a format
+				HAL_FLASH_Unlock();
+				uint16_t status = EE_WriteVariables(flashCommitAdr, flashCommitDat, flashCommitCount);
+				HAL_FLASH_Lock();
+				if(status != HAL_OK){
+					ErrorHandler::addError(Error(ErrorCode::flashWriteFailed, ErrorType::warning, "Saving to flash failed"));
+				}
+			}
+			flashMutex.Unlock();
+
+			flashCacheMutex.Lock();
+			flashCommitCount = 0;
+			flashCacheMutex.Unlock();
+		}
+	}
+}
+
+/*
+ * Defers all following Flash_Write calls until Flash_CommitBatch is called
+ */
+void Flash_BeginBatch(){
+	if(flashCommitThread == nullptr){
+		flashCommitThread = new FlashCommitThread();
+	}
+	flashCacheMutex.Lock();
+	flashBatchOpen = true;
+	flashCacheMutex.Unlock();
+}
+
+/*
+ * Ends the batch and writes all changed variables in the background
+ */
+void Flash_CommitBatch(){
+	flashCacheMutex.Lock();
+	flashBatchOpen = false;
+	flashCacheMutex.Unlock();
+	if(flashCommitThread){
+		flashCommitThread->commitSem.Give();
+	}
+}
+
+/*
+ * Returns true while cached variables are not yet written
+ */
+bool Flash_BatchBusy(){
+	return flashBatchOpen || flashPendingCount != 0 || flashCommitCount != 0;
+}
+
+/*
+ * Waits until all cached variables are written. Call before resetting
+ */
+bool Flash_WaitCommit(uint32_t timeout){
+	uint32_t start = HAL_GetTick();
+	while(flashPendingCount != 0 || flashCommitCount != 0){
+		if(HAL_GetTick() - start > timeout){
+			return false;
+		}
+		vTaskDelay(1);
+	}
+	return true;
+}
+
+/*
+ * Erases all variables. Cancels deferred writes so they are not written back after the erase
+ */
+HAL_StatusTypeDef Flash_Format(){
+	flashCacheMutex.Lock();
+	flashBatchOpen = false;
+	flashPendingCount = 0;
+	flashCacheMutex.Unlock();
+
+	flashMutex.Lock(); // Waits for a running commit
+	flashCacheMutex.Lock();
+	flashCommitCount = 0;
+	flashCacheMutex.Unlock();
+	HAL_FLASH_Unlock();
+	HAL_StatusTypeDef status = EE_Format();
+	HAL_FLASH_Lock();
+	flashMutex.Unlock();
+	return status;
+}
+
 /*
  * Writes a variable to eeprom emulation adr
  * Returns true on success or false if variable is the same or error
+ * Only records the variable while a batch is open or being committed
  */
 bool Flash_Write(uint16_t adr,uint16_t dat){
-	//flashMutex.Lock();
+	if(flashBatchOpen || flashPendingCount != 0 || flashCommitCount != 0){
+		flashCacheMutex.Lock();
+		uint16_t buf;
+		bool found = Flash_ReadCached(adr, &buf) || EE_ReadVariable(adr, &buf) == 0;
+		bool res = !found || buf != dat;
+		if(res){
+			int32_t idx = Flash_FindCached(flashPendingAdr, flashPendingCount, adr);
+			if(idx < 0 && flashPendingCount < NB_OF_VAR){
+				idx = flashPendingCount++;
+				flashPendingAdr[idx] = adr;
+			}
+			if(idx >= 0){
+				flashPendingDat[idx] = dat;
+				bool commitNow = !flashBatchOpen;
+				flashCacheMutex.Unlock();
+				if(commitNow && flashCommitThread){
+					flashCommitThread->commitSem.Give(); // Write after the running commit
+				}
+				return true;
+			}
+		}
+		flashCacheMutex.Unlock();
+		if(!res){
+			return false;
+		}
+		// Cache full. Write directly
+	}
+
+	flashMutex.Lock();
 	uint16_t buf;
 	uint16_t readRes = EE_ReadVariable(adr, &buf);
 	bool res = false;
@@ -29,7 +215,7 @@ bool Flash_Write(uint16_t adr,uint16_t dat){
 		HAL_FLASH_Lock();
 		res = true;
 	}
-	//flashMutex.Unlock();
+	flashMutex.Unlock();
 	return res;
 
 }
@@ -38,21 +224,24 @@ bool Flash_Write(uint16_t adr,uint16_t dat){
  * Reads a variable from eeprom emulation and returns true on success
  */
 bool Flash_Read(uint16_t adr,uint16_t *buf){
-	//flashMutex.Lock();
-	bool res = EE_ReadVariable(adr, buf) == 0;
-	//flashMutex.Unlock();
-	return res;
+	if(flashPendingCount != 0 || flashCommitCount != 0){
+		flashCacheMutex.Lock();
+		bool cached = Flash_ReadCached(adr, buf);
+		flashCacheMutex.Unlock();
+		if(cached){
+			return true;
+		}
+	}
+	return EE_ReadVariable(adr, buf) == 0;
 }
 
 /*
  * Reads a variable or if it does not exist default is written
  */
 bool Flash_ReadWriteDefault(uint16_t adr,uint16_t *buf,uint16_t def){
-	if(EE_ReadVariable(adr, buf) != 0){
+	if(!Flash_Read(adr, buf)){
 		*buf = def;
-		HAL_FLASH_Unlock();
-		EE_WriteVariable(adr, def);
-		HAL_FLASH_Lock();
+		Flash_Write(adr, def);
 		return false;
 	}
 	return true;
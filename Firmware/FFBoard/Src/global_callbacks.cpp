@@ -27,6 +27,7 @@
 
 #ifdef CANBUS
 #include "CanHandler.h"
+#include "CAN.h"
 #endif
 
 #ifdef MIDI
@@ -36,6 +37,8 @@
 
 #include "cdc_device.h"
 #include "CDCcomm.h"
+#include "TimingProbes.h"
+#include "HeapProfiler.h"
 
 
 extern FFBoardMain* mainclass;
@@ -112,6 +115,10 @@ CAN_RxHeaderTypeDef canRxHeader1; // Receive header 1
 // RX
 void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef *hcan){
 	if(HAL_CAN_GetRxMessage(hcan, CAN_RX_FIFO0, &canRxHeader0, canRxBuf0) == HAL_OK){
+		for(CANPort* port : CANPort::getPorts()){
+			if(port->dispatchRxMessage(hcan,canRxBuf0,&canRxHeader0,CAN_RX_FIFO0))
+				return; // Handled by the owner of the filter
+		}
 		for(CanHandler* c : CanHandler::canHandlers){
 			c->canRxPendCallback(hcan,canRxBuf0,&canRxHeader0,CAN_RX_FIFO0);
 		}
@@ -119,6 +126,10 @@ void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef *hcan){
 }
 void HAL_CAN_RxFifo1MsgPendingCallback(CAN_HandleTypeDef *hcan){
 	if(HAL_CAN_GetRxMessage(hcan, CAN_RX_FIFO1, &canRxHeader1, canRxBuf1) == HAL_OK){
+		for(CANPort* port : CANPort::getPorts()){
+			if(port->dispatchRxMessage(hcan,canRxBuf1,&canRxHeader1,CAN_RX_FIFO1))
+				return; // Handled by the owner of the filter
+		}
 		for(CanHandler* c : CanHandler::canHandlers){
 			c->canRxPendCallback(hcan,canRxBuf1,&canRxHeader1,CAN_RX_FIFO1);
 		}
@@ -139,37 +150,58 @@ void HAL_CAN_TxMailbox0CompleteCallback(CAN_HandleTypeDef *hcan){
 	for(CanHandler* c : CanHandler::canHandlers){
 		c->canTxCpltCallback(hcan,CAN_TX_MAILBOX0);
 	}
+	for(CANPort* port : CANPort::getPorts()){
+		port->canTxCpltCallback(hcan,CAN_TX_MAILBOX0);
+	}
 }
 void HAL_CAN_TxMailbox1CompleteCallback(CAN_HandleTypeDef *hcan){
 	for(CanHandler* c : CanHandler::canHandlers){
 		c->canTxCpltCallback(hcan,CAN_TX_MAILBOX1);
 	}
+	for(CANPort* port : CANPort::getPorts()){
+		port->canTxCpltCallback(hcan,CAN_TX_MAILBOX1);
+	}
 }
 void HAL_CAN_TxMailbox2CompleteCallback(CAN_HandleTypeDef *hcan){
 	for(CanHandler* c : CanHandler::canHandlers){
 		c->canTxCpltCallback(hcan,CAN_TX_MAILBOX2);
 	}
+	for(CANPort* port : CANPort::getPorts()){
+		port->canTxCpltCallback(hcan,CAN_TX_MAILBOX2);
+	}
 }
 void HAL_CAN_TxMailbox0AbortCallback(CAN_HandleTypeDef *hcan){
 	for(CanHandler* c : CanHandler::canHandlers){
 		c->canTxAbortCallback(hcan,CAN_TX_MAILBOX0);
 	}
+	for(CANPort* port : CANPort::getPorts()){
+		port->canTxAbortCallback(hcan,CAN_TX_MAILBOX0);
+	}
 }
 void HAL_CAN_TxMailbox1AbortCallback(CAN_HandleTypeDef *hcan){
 	for(CanHandler* c : CanHandler::canHandlers){
 		c->canTxAbortCallback(hcan,CAN_TX_MAILBOX1);
 	}
+	for(CANPort* port : CANPort::getPorts()){
+		port->canTxAbortCallback(hcan,CAN_TX_MAILBOX1);
+	}
 }
 void HAL_CAN_TxMailbox2AbortCallback(CAN_HandleTypeDef *hcan){
 	for(CanHandler* c : CanHandler::canHandlers){
 		c->canTxAbortCallback(hcan,CAN_TX_MAILBOX2);
 	}
+	for(CANPort* port : CANPort::getPorts()){
+		port->canTxAbortCallback(hcan,CAN_TX_MAILBOX2);
+	}
 }
 
 void HAL_CAN_ErrorCallback(CAN_HandleTypeDef *hcan){
 	for(CanHandler* c : CanHandler::canHandlers){
 		c->canErrorCallback(hcan);
 	}
+	for(CANPort* port : CANPort::getPorts()){
+		port->canErrorCallback(hcan); // Resets the error code
+	}
 }
 #endif
 
@@ -258,13 +290,23 @@ void tud_hid_set_report_cb(uint8_t itf, uint8_t report_id, hid_report_type_t rep
 		report_id = *buffer;
 	}
 
-	if(UsbHidHandler::globalHidHandler!=nullptr)
+	if(UsbHidHandler::globalHidHandler!=nullptr){
+		TimingProbe& probe = TimingProbes::get(TimingProbeId::hidout);
+		probe.begin();
+		HeapProfiler::enterControlPath(); // Effect updates
 		UsbHidHandler::globalHidHandler->hidOut(report_id,report_type,buffer,bufsize);
+		HeapProfiler::exitControlPath();
+		probe.end();
+	}
 
 	if(report_id == HID_ID_HIDCMD){
 		if(HID_CommandInterface::globalInterface != nullptr)
 			HID_CommandInterface::globalInterface->hidCmdCallback((HID_CMD_Data_t*)(buffer));
 	}
+	if(report_id == HID_ID_HIDCMD_BATCH){
+		if(HID_CommandInterface::globalInterface != nullptr)
+			HID_CommandInterface::globalInterface->hidCmdBatchCallback((HID_CMD_Batch_t*)(buffer),bufsize);
+	}
 
 
 }
@@ -323,6 +365,14 @@ void tud_resume_cb(){
 	mainclass->usbResume();
 }
 
+/**
+ * Called in the usb interrupt on every start of frame
+ */
+void tud_sof_isr_cb(uint8_t rhport){
+	TimingProbes::get(TimingProbeId::usbsof).tick();
+	mainclass->usbSof();
+}
+
 
 volatile uint32_t* getAnalogBuffer(ADC_HandleTypeDef* hadc,uint8_t* chans){
 	#ifdef ADC1_CHANNELS
@@ -1012,7 +1012,9 @@ void dcd_event_handler(dcd_event_t const * event, bool in_isr)
     break;
 
     case DCD_EVENT_SOF:
-      return;   // skip SOF event for now
+      // Not queued. Handled directly in the interrupt to keep the frame timing exact
+      if (tud_sof_isr_cb) tud_sof_isr_cb(event->rhport);
+      return;
     break;
 
     case DCD_EVENT_SUSPEND:
@@ -29,9 +29,8 @@
 
 #include "tusb_option.h"
 
-// Since TinyUSB doesn't use SOF for now, and this interrupt too often (1ms interval)
-// We disable SOF for now until needed later on
-#define USE_SOF     0
+// SOF is used to synchronize the HID reports to the usb frames (tud_sof_isr_cb)
+#define USE_SOF     1
 
 #if defined (STM32F105x8) || defined (STM32F105xB) || defined (STM32F105xC) || \
     defined (STM32F107xB) || defined (STM32F107xC)
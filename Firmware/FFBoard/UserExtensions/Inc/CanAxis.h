@@ -0,0 +1,153 @@
+/*
+ * CanAxis.h
+ *
+ *  Created on: 19.10.2026
+ *      Author: Yannick
+ */
+
+#ifndef USEREXTENSIONS_INC_CANAXIS_H_
+#define USEREXTENSIONS_INC_CANAXIS_H_
+#include "constants.h"
+#include "MotorDriver.h"
+#include "cpp_target_config.h"
+#include "CAN.h"
+#include "Encoder.h"
+#include "thread.hpp"
+#include "CanHandler.h"
+#include "CommandHandler.h"
+#include "PersistentStorage.h"
+
+#ifdef CANAXIS
+#define CANAXIS_THREAD_MEM 256
+#define CANAXIS_THREAD_PRIO 25 // Must be higher than main thread
+
+/*
+ * Protocol between a board running the effects (master) and remote axis nodes.
+ * Extended ids: CANAXIS_ID_BASE | msg << 8 | node id
+ *
+ * sync		master -> node	uint32 master time in µs
+ * torque	master -> node	int16 torque, uint8 sequence
+ * control	master -> node	uint8 CanAxisControl
+ * position	node -> master	float position in turns, uint32 sample time in master time µs
+ * status	node -> master	uint8 CanAxisStatus flags, uint8 last torque sequence
+ */
+#define CANAXIS_ID_BASE 0x0FFB0000
+#define CANAXIS_ID_MASK 0x1FFF0000
+enum class CanAxisMsg : uint8_t {sync=1,torque=2,control=3,position=4,status=5};
+enum class CanAxisControl : uint8_t {stop=0,start=1};
+enum CanAxisStatus : uint8_t {CANAXIS_READY = 0x01, CANAXIS_ACTIVE = 0x02, CANAXIS_SYNCED = 0x04};
+
+/*
+ * 32 bit µs time extended from the 16 bit microsecond timer.
+ * Must be called at least every 60ms to stay continuous. Resynchronizes to the systick otherwise
+ */
+class CanAxisClock {
+public:
+	uint32_t now();
+private:
+	uint16_t lastMicros = 0;
+	uint32_t lastTick = 0;
+	uint32_t time = 0;
+};
+
+uint32_t canAxisFrameId(CanAxisMsg msg,uint8_t node);
+bool canAxisSend(CANPort* port,CanAxisMsg msg,uint8_t node,const uint8_t* data,uint8_t len,CANPriority priority = CANPriority::normal);
+
+
+enum class CanAxis_commands : uint32_t{
+	nodeid,canspd,connected,posage,rate
+};
+
+/**
+ * Motor driver and encoder of a remote CanAxisNode board.
+ * Sends torque setpoints and receives timestamped positions
+ */
+class CanAxis : public MotorDriver,public PersistentStorage, public Encoder, public CanHandler, public CommandHandler, cpp_freertos::Thread{
+public:
+	CanAxis(uint8_t instance);
+	virtual ~CanAxis();
+
+	const ClassIdentifier getInfo() = 0;
+
+	void turn(int16_t power) override;
+	void stopMotor() override;
+	void startMotor() override;
+	Encoder* getEncoder() override;
+	bool hasIntegratedEncoder() override {return true;}
+	bool motorReady() override;
+
+	float getPos_f() override;
+	uint32_t getCpr() override;
+	int32_t getPos() override;
+	void setPos(int32_t pos) override;
+
+	void canRxPendCallback(CAN_HandleTypeDef *hcan,uint8_t* rxBuf,CAN_RxHeaderTypeDef* rxHeader,uint32_t fifo) override;
+
+	void saveFlash() override;
+	void restoreFlash() override;
+
+	CommandStatus command(const ParsedCommand& cmd,std::vector<CommandReply>& replies) override;
+	void registerCommands();
+	std::string getHelpstring(){return "Remote FFB axis on another board via CAN";};
+
+	void Run();
+
+private:
+	CANPort* port = &canport;
+	uint8_t instance;
+	uint8_t nodeId = 1;
+	uint8_t baudrate = CANSPEEDPRESET_1000;
+	int32_t filterId = -1;
+	void setupCanFilter();
+	void setCanRate(uint8_t canRate);
+	void sendSync();
+	void sendControl(CanAxisControl control);
+
+	CanAxisClock clock;
+	bool active = false;
+	uint8_t torqueSeq = 0;
+	volatile uint8_t nodeStatus = 0;
+	volatile uint32_t lastStatusTick = 0;
+	bool connected = false;
+
+	// Position history
+	volatile float lastPos = 0;
+	volatile float lastVelocity = 0; // turns/s from the last two samples
+	volatile uint32_t lastPosTime = 0; // Sample time in master µs
+	volatile uint32_t posFrames = 0;
+	uint32_t posRateStart = 0;
+	float posRate = 0;
+	float posOffset = 0;
+	static const uint32_t maxPredictionTime = 5000; // µs
+	float predictedPos();
+	uint32_t getPosAge();
+};
+
+/**
+ * Instance 1 of the remote axis
+ */
+class CanAxis1 : public CanAxis{
+public:
+	CanAxis1() : CanAxis{0} {inUse = true;}
+	const ClassIdentifier getInfo();
+	~CanAxis1(){inUse = false;}
+	static bool isCreatable();
+	static ClassIdentifier info;
+	static bool inUse;
+};
+
+/**
+ * Instance 2 of the remote axis
+ */
+class CanAxis2 : public CanAxis{
+public:
+	CanAxis2() : CanAxis{1} {inUse = true;}
+	const ClassIdentifier getInfo();
+	~CanAxis2(){inUse = false;}
+	static bool isCreatable();
+	static ClassIdentifier info;
+	static bool inUse;
+};
+
+#endif /* CANAXIS */
+#endif /* USEREXTENSIONS_INC_CANAXIS_H_ */
@@ -0,0 +1,81 @@
+/*
+ * CanAxisNode.h
+ *
+ *  Created on: 19.10.2026
+ *      Author: Yannick
+ */
+
+#ifndef USEREXTENSIONS_INC_CANAXISNODE_H_
+#define USEREXTENSIONS_INC_CANAXISNODE_H_
+#include "CanAxis.h"
+#ifdef CANAXIS
+#include <FFBoardMain.h>
+#include "ClassChooser.h"
+#include "mutex.hpp"
+
+/**
+ * Mainclass for a board acting as a remote axis of another board.
+ * Drives a local motor with torque received via CAN and streams the encoder position back
+ */
+class CanAxisNode: public FFBoardMain, public PersistentStorage, public CanHandler, cpp_freertos::Thread {
+	enum class CanAxisNode_commands : uint32_t{
+		nodeid,canspd,drvtype,enctype,synced,clockofs,torque
+	};
+public:
+	CanAxisNode();
+	virtual ~CanAxisNode();
+
+	static ClassIdentifier info;
+	const ClassIdentifier getInfo() override;
+	static bool isCreatable() {return true;};
+
+	CommandStatus command(const ParsedCommand& cmd,std::vector<CommandReply>& replies) override;
+	void registerCommands();
+	std::string getHelpstring(){return "Remote axis node. Receives torque from another board via CAN";};
+
+	void saveFlash() override;
+	void restoreFlash() override;
+
+	void canRxPendCallback(CAN_HandleTypeDef *hcan,uint8_t* rxBuf,CAN_RxHeaderTypeDef* rxHeader,uint32_t fifo) override;
+
+	void Run();
+	void update();
+
+	void setDrvType(uint8_t drvtype);
+	void setEncType(uint8_t enctype);
+
+private:
+	CANPort* port = &canport;
+	uint8_t nodeId = 1;
+	uint8_t baudrate = CANSPEEDPRESET_1000;
+	int32_t filterId = -1;
+	void setupCanFilter();
+	void setCanRate(uint8_t canRate);
+
+	ClassChooser<MotorDriver> drv_chooser;
+	ClassChooser<Encoder> enc_chooser;
+	std::unique_ptr<MotorDriver> drv = std::make_unique<MotorDriver>(); // dummy
+	std::shared_ptr<Encoder> enc = nullptr;
+	uint8_t drvtype = 0;
+	uint8_t enctype = 0;
+	cpp_freertos::MutexStandard drvMutex; // Locked while the driver is used or replaced
+
+	CanAxisClock clock;
+	volatile int32_t clockOffset = 0; // Master time - local time in µs
+	volatile bool synced = false;
+	volatile uint32_t lastSyncTick = 0;
+	uint32_t lastStatusTick = 0;
+
+	volatile int16_t torque = 0;
+	volatile uint8_t torqueSeq = 0;
+	volatile uint32_t lastTorqueTick = 0;
+	volatile bool active = false;
+	volatile bool activeChanged = false;
+	static const uint32_t torqueTimeout = 50; // ms without setpoint until the motor is stopped
+
+	void sendPosition();
+	void sendStatus();
+};
+
+#endif /* CANAXIS */
+#endif /* USEREXTENSIONS_INC_CANAXISNODE_H_ */
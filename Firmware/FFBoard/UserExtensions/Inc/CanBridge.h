@@ -27,6 +27,11 @@ typedef struct{
 	bool enabled = false;
 } CAN_Config_t;
 
+typedef struct{
+	CAN_rx_msg msg;
+	uint32_t time = 0; // µs at reception
+} CAN_rx_timed_msg;
+
 
 
 /**
@@ -35,7 +40,7 @@ typedef struct{
  */
 class CanBridge: public FFBoardMain, public CanHandler {
 	enum class CanBridge_commands : uint32_t{
-		can,canrtr,canspd
+		can,canrtr,canspd,rxdrop
 	};
 public:
 
@@ -56,7 +61,6 @@ public:
 	std::string messageToString(CAN_rx_msg msg);
 
 	void update(); // Main loop
-	volatile bool replyPending = false;
 
 	void registerCommands();
 	virtual std::string getHelpstring(){return "CAN commands:\ncan=(msgint)?(id) send message (canrtr with rtr bit). Or can? (last received message). canspd (speed).\nThis class is GVRET/SavvyCAN compatible!";}
@@ -64,8 +68,21 @@ public:
 
 private:
 	CANPort* port = &canport;
-	std::vector<CAN_rx_msg> rxmessages;
 	CAN_rx_msg lastmsg;
+
+	// Filled in the rx interrupt and drained in update()
+	std::array<CAN_rx_timed_msg,64> rxBuffer;
+	volatile uint8_t rxHead = 0; // Written only by the interrupt
+	volatile uint8_t rxTail = 0; // Written only by update()
+	volatile uint32_t rxDropped = 0;
+	static const uint8_t gvretFrameMaxLen = 20; // 0xF1,0,time(4),id(4),len,data(8),0
+	std::array<uint8_t,512> gvretTxBuf; // Frames packed for a single cdc write
+
+	uint32_t timestamp();
+	uint16_t lastMicros = 0;
+	uint32_t lastTimeTick = 0;
+	uint32_t timeUs = 0;
+	uint8_t packGvretFrame(const CAN_rx_timed_msg& frame,uint8_t* buf);
 	int32_t filterId = -1;
 	const uint8_t numBuses = 1;
 
@@ -38,8 +38,11 @@ enum class ClassType : uint16_t {
 #define CLSID_MAIN_TMCDBG 	0xB
 #define CLSID_MAIN_CAN	 	0xC
 #define CLSID_MAIN_MIDI 	0xD
+#define CLSID_MAIN_CANAXIS	0xE
 #define CLSID_SYSTEM		0x10 // sys main command thread
 #define CLSID_ERRORS		0x11
+#define CLSID_SUBSCRIPTIONS	0x12 // Periodic command value streaming
+#define CLSID_PROFILES		0x13 // Stored config profiles
 
 // Button sources for gamepad
 #define CLSID_BTN_NONE		0x20
@@ -67,6 +70,8 @@ enum class ClassType : uint16_t {
 #define CLSID_MOT_ODRV1		0x86
 #define CLSID_MOT_VESC0		0x87
 #define CLSID_MOT_VESC1		0x88
+#define CLSID_MOT_CANAXIS0	0x89
+#define CLSID_MOT_CANAXIS1	0x8A
 
 // Internal classes
 #define CLSID_AXIS			0xA01
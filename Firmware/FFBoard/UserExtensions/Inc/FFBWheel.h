@@ -64,6 +64,7 @@ public:
 	void usbInit(); // initialize a composite usb device
 	void usbSuspend(); // Called on usb disconnect and suspend
 	void usbResume(); // Called on usb resume
+	void usbSof(); // Called on usb start of frame
 
 	void saveFlash();
 	void restoreFlash();
@@ -83,6 +84,7 @@ private:
 	volatile Control_t control;
 	std::unique_ptr<EffectsCalculator> effects_calc;
 	void send_report();
+	void sampleInputs();
 
 	/* USB Report rate
 	 * Warning: Report rate initialized by bInterval is overridden by saved speed preset at startup!
@@ -119,6 +121,19 @@ private:
 	std::unique_ptr<HID_CommandInterface> hidCommands = std::make_unique<HID_CommandInterface>();
 
 	uint32_t lastUsbReportTick = 0;
+
+	// Frame timing
+	volatile uint32_t lastSofTick = 0;
+	volatile uint16_t lastSofTime = 0; // micros() at the last SOF
+	static const uint16_t frameTime = 1000; // µs
+	static const uint16_t sampleMargin = 100; // µs before the next SOF to finish sampling the inputs
+
+	// Inputs sampled ahead of the next report
+	bool inputsSampled = false;
+	uint16_t inputSampleTime = 0; // Peak duration of sampleInputs in µs
+	uint64_t inputButtons = 0;
+	int32_t inputAxes[8] = {0};
+	uint8_t inputAxisCount = 0;
 };
 
 #endif /* SRC_FFBWHEEL_H_ */
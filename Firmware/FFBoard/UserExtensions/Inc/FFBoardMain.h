@@ -21,6 +21,8 @@
 #include "CommandInterface.h"
 
 #include "SystemCommands.h"
+#include "CommandSubscriptions.h"
+#include "ConfigProfiles.h"
 #include "target_constants.h"
 
 
@@ -48,6 +50,7 @@ public:
 
 	virtual void usbSuspend(); // Called on usb disconnect and suspend
 	virtual void usbResume(); // Called on usb resume
+	virtual void usbSof(); // Called from the usb interrupt on every start of frame
 
 	virtual CommandStatus command(const ParsedCommand& cmd,std::vector<CommandReply>& replies);
 
@@ -57,6 +60,8 @@ public:
 	std::unique_ptr<CDC_CommandInterface> cdcCmdInterface = std::make_unique<CDC_CommandInterface>();
 	ErrorPrinter errorPrinter; // Prints errors to serial
 	SystemCommands systemCommands; //!< System command handler
+	CommandSubscriptions subscriptions; //!< Streams subscribed command values
+	ConfigProfiles profiles; //!< Stored tuning profiles
 
 #ifdef UARTCOMMANDS
 	std::unique_ptr<UART_CommandInterface> uartCmdInterface = std::make_unique<UART_CommandInterface>(500000); // UART command interface
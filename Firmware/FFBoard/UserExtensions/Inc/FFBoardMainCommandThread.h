@@ -57,7 +57,9 @@ public:
 protected:
 	virtual void updateSys();
 
-	virtual void executeCommands(std::vector<ParsedCommand> commands,CommandInterface* commandInterface);
+	virtual void executeCommands(std::vector<ParsedCommand>& commands,CommandInterface* commandInterface);
+
+	static const uint32_t replySlots = 8; // Replies per command that can be stored without allocating
 
 
 	static cpp_freertos::BinarySemaphore threadSem; // Blocks this thread. more efficient than suspending/waking
@@ -14,12 +14,24 @@
 #include "Encoder.h"
 #include "PersistentStorage.h"
 #include "CommandHandler.h"
+#include "TimerHandler.h"
 
 #define MAGNTEK_READ 0x80
 
-class MtEncoderSPI: public Encoder, public SPIDevice, public PersistentStorage, public CommandHandler{
+/*
+ * Angle reading taken by a background transfer
+ */
+struct MtEncoderSample {
+	int32_t angle = 0;		// Angle within one rotation
+	int32_t rotations = 0;
+	uint32_t time = 0;		// micros() when the transfer finished
+	bool nomag = false;
+	bool overspeed = false;
+};
+
+class MtEncoderSPI: public Encoder, public SPIDevice, public PersistentStorage, public CommandHandler, public TimerHandler{
 	enum class MtEncoderSPI_commands : uint32_t{
-		cspin
+		cspin,samplerate
 	};
 public:
 	MtEncoderSPI();
@@ -45,12 +57,19 @@ public:
 	void initSPI();
 	void updateAngleStatus();
 
+	void setSampleRate(uint8_t khz);
+	void spiRequestError(SPIPort* port);
+	MtEncoderSample getSample();
+	void timerElapsed(TIM_HandleTypeDef* htim);
+	void spiTxRxCompleted(SPIPort* port);
+
 	CommandStatus command(const ParsedCommand& cmd,std::vector<CommandReply>& replies);
 	void setCsPin(uint8_t cspin);
 	//virtual const ClassType getClassType() override {return ClassType::Encoder;};
 private:
 	uint8_t readSpi(uint8_t addr);
 	void writeSpi(uint8_t addr,uint8_t data);
+	void processAngle(uint8_t* rxbuf);
 
 	bool nomag = false; // Magnet lost in last report
 	bool overspeed = false; // Overspeed flag set in last report
@@ -60,6 +79,16 @@ private:
 	int32_t rotations = 0;
 	int32_t offset = 0;
 	uint8_t cspin = 0;
+
+	// Background sampling. Timer starts a DMA transfer, completion stores the latest sample
+	uint8_t sampleRate = 0; // kHz. 0 reads the encoder on each request
+	TIM_HandleTypeDef* timer = &TIM_MTENC;
+	uint8_t dma_txbuf[4] = {0x03 | MAGNTEK_READ,0,0,0};
+	uint8_t dma_rxbuf[4] = {0,0,0,0};
+	MtEncoderSample sample;
+	volatile uint32_t sampleSeq = 0; // Odd while the sample is written
+	volatile bool dmaPending = false; // Timer transfer queued or running. Only one writer may update the position
+	bool waitDmaIdle();
 };
 
 #endif /* USEREXTENSIONS_SRC_MTENCODERSPI_H_ */
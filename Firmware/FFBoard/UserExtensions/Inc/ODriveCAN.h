@@ -29,7 +29,7 @@ enum class ODriveEncoderFlags : uint32_t {ERROR_NONE = 0,ERROR_UNSTABLE_GAIN = 0
 enum class ODriveAxisError : uint32_t {AXIS_ERROR_NONE = 0x00000000,AXIS_ERROR_INVALID_STATE  = 0x00000001, AXIS_ERROR_WATCHDOG_TIMER_EXPIRED = 0x00000800,AXIS_ERROR_MIN_ENDSTOP_PRESSED = 0x00001000, AXIS_ERROR_MAX_ENDSTOP_PRESSED = 0x00002000,AXIS_ERROR_ESTOP_REQUESTED = 0x00004000,AXIS_ERROR_HOMING_WITHOUT_ENDSTOP = 0x00020000,AXIS_ERROR_OVER_TEMP = 0x00040000,AXIS_ERROR_UNKNOWN_POSITION = 0x00080000};
 
 enum class ODriveCAN_commands : uint32_t{
-	canid,canspd,errors,state,maxtorque,vbus,anticogging,connected
+	canid,canspd,errors,state,maxtorque,vbus,anticogging,connected,posage,encrate,pollinterval
 };
 
 class ODriveCAN : public MotorDriver,public PersistentStorage, public Encoder, public CanHandler, public CommandHandler, cpp_freertos::Thread{
@@ -49,13 +49,13 @@ public:
 	bool hasIntegratedEncoder() {return true;}
 
 	template<class T>
-	void sendMsg(uint8_t cmd,T value){
+	void sendMsg(uint8_t cmd,T value,CANPriority priority = CANPriority::normal){
 		CAN_tx_msg msg;
 		memcpy(&msg.data,&value,sizeof(T));
 		msg.header.RTR = CAN_RTR_DATA;
 		msg.header.DLC = sizeof(T);
 		msg.header.StdId = cmd | (nodeId << 5);
-		port->sendMessage(msg);
+		port->sendMessage(msg,priority);
 	}
 
 	void sendMsg(uint8_t cmd,float value);
@@ -70,6 +70,7 @@ public:
 	void canRxPendCallback(CAN_HandleTypeDef *hcan,uint8_t* rxBuf,CAN_RxHeaderTypeDef* rxHeader,uint32_t fifo) override;
 
 	float getPos_f() override;
+	uint32_t getPosAge();
 	uint32_t getCpr() override;
 	int32_t getPos() override;
 	void setPos(int32_t pos) override;
@@ -91,7 +92,16 @@ public:
 private:
 	CANPort* port = &canport;
 	float lastPos = 0;
-	float lastSpeed = 0;
+	float lastSpeed = 0; // turns/s as reported by the odrive
+	volatile uint16_t lastPosTime = 0;	// micros() of the last encoder estimate
+	volatile uint32_t lastPosTick = 0;	// HAL_GetTick() of the last encoder estimate. Guards the 16 bit micros() wrap
+	volatile uint16_t lastPollTime = 0;	// micros() of the last estimate request
+	volatile uint32_t posFrames = 0;	// Estimate frames since posRateStart
+	uint32_t posRateStart = 0;
+	float posRate = 0;					// Measured estimate frames per second
+	uint16_t pollInterval = 2000;		// µs. Estimates are only requested if the cyclic stream is slower. 0 disables requests
+	static const uint16_t maxPredictionTime = 5000; // µs
+	float predictedPos();
 	float posOffset = 0;
 	float lastVoltage = 0;
 	uint32_t lastVoltageUpdate = 0;
@@ -112,7 +122,8 @@ private:
 
 	bool active = false;
 
-	int32_t filterId = 0;
+	int32_t filterId = -1;
+	void setupCanFilter();
 	volatile ODriveLocalState state = ODriveLocalState::IDLE;
 	bool connected = false;
 
@@ -18,6 +18,7 @@
 #include "SpiHandler.h"
 #include "thread.hpp"
 #include "ExtiHandler.h"
+#include "AdcHandler.h"
 #include "SPI.h"
 
 #include "semaphore.hpp"
@@ -30,8 +31,8 @@
 
 extern SPI_HandleTypeDef HSPIDRV;
 
-enum class TMC_ControlState {uninitialized,No_power,Shutdown,Running,Init_wait,ABN_init,AENC_init,Enc_bang,HardError,OverTemp,EncoderFinished};
-enum class ENC_InitState {uninitialized,estimating,aligning,checking,OK};
+enum class TMC_ControlState {uninitialized,No_power,Shutdown,Running,Init_wait,ABN_init,AENC_init,Enc_bang,HardError,OverTemp,EncoderFinished,PidAutotune};
+enum class ENC_InitState {uninitialized,estimating,aligning,checking,indexSearch,OK};
 
 enum class MotorType : uint8_t {NONE=0,DC=1,STEPPER=2,BLDC=3,ERR};
 enum class PhiE : uint8_t {ext=1,openloop=2,abn=3,hall=5,aenc=6,aencE=7,NONE};
@@ -151,6 +152,19 @@ struct TMC4671PIDConf{
 	bool sequentialPI	= false; // Advanced pid
 };
 
+/**
+ * Result of the current loop identification run by autotuneCurrentPI()
+ */
+struct TMC4671MotorIdent{
+	float a = 0; // Discrete pole of the identified current response
+	float b = 0; // Discrete input gain in current counts per voltage count
+	float ts = 0; // Sample time of the identification in s
+	float tau = 0; // Electrical time constant L/R in s
+	float resistance = 0; // Phase resistance in Ohm. Only valid if current scaler is known
+	float inductance = 0; // Phase inductance in H. Only valid if current scaler is known
+	bool valid = false;
+};
+
 struct TMC4671Limits{
 	uint16_t pid_torque_flux_ddt	= 32767;
 	uint16_t pid_uq_ud				= 30000;
@@ -179,6 +193,27 @@ struct TMC4671FlashAddrs{
 	uint16_t torque_i = ADR_TMC1_TORQUE_I;
 	uint16_t flux_p = ADR_TMC1_FLUX_P;
 	uint16_t flux_i = ADR_TMC1_FLUX_I;
+	uint16_t encSig = ADR_TMC1_ENC_SIG;
+	uint16_t adcOffset0 = ADR_TMC1_ADC_I0_OFS;
+	uint16_t adcOffset1 = ADR_TMC1_ADC_I1_OFS;
+	uint16_t encPhiE = ADR_TMC1_ENC_PHIE;
+	uint16_t aenc0Offset = ADR_TMC1_AENC0_OFS;
+	uint16_t aenc0Scale = ADR_TMC1_AENC0_SCALE;
+	uint16_t aenc1Offset = ADR_TMC1_AENC1_OFS;
+	uint16_t aenc1Scale = ADR_TMC1_AENC1_SCALE;
+	uint16_t aenc2Offset = ADR_TMC1_AENC2_OFS;
+	uint16_t aenc2Scale = ADR_TMC1_AENC2_SCALE;
+};
+
+/**
+ * Encoder alignment and adc calibration results stored in flash to skip the calibration at startup
+ */
+struct TMC4671AlignCache{
+	bool valid = false; // Signature matched the current configuration
+	bool indexValid = false; // ABN: electrical angle at the index pulse is known
+	int16_t phiE = 0; // ABN: electrical angle at the index pulse. AENC: phiE offset
+	uint16_t adc_I0_offset = 0;
+	uint16_t adc_I1_offset = 0;
 };
 
 struct TMC4671ABNConf{
@@ -243,12 +278,12 @@ struct TMC4671Biquad{
 };
 
 
-class TMC4671 : public MotorDriver, public PersistentStorage, public Encoder, public CommandHandler, public SPIDevice, public ExtiHandler, public cpp_freertos::Thread{
+class TMC4671 : public MotorDriver, public PersistentStorage, public Encoder, public CommandHandler, public SPIDevice, public ExtiHandler, public AdcHandler, public cpp_freertos::Thread{
 
 	enum class TMC4671_commands : uint32_t{
 		cpr,mtype,encsrc,tmcHwType,encalign,poles,acttrq,pwmlim,
 		torqueP,torqueI,fluxP,fluxI,velocityP,velocityI,posP,posI,
-		tmctype,pidPrec,phiesrc,fluxoffset,seqpi,tmcIscale,encdir,temp,reg
+		tmctype,pidPrec,phiesrc,fluxoffset,seqpi,tmcIscale,encdir,temp,reg,pidautotune,encCache
 	};
 
 public:
@@ -300,6 +335,12 @@ public:
 	void estimateABNparams();
 	bool checkEncoder();
 	void calibrateAenc();
+	bool findEncoderIndex();
+	int16_t abnCountToPhiE(int32_t count);
+	bool checkAencSignal();
+	bool identifyCurrentLoop(TMC4671MotorIdent& ident,int16_t amplitude);
+	bool autotuneCurrentPI(uint16_t bandwidth);
+	TMC4671PIDConf calculateCurrentPI(const TMC4671MotorIdent& ident,uint16_t bandwidth);
 
 	void setEncoderType(EncoderType_TMC type);
 	uint32_t getEncCpr();
@@ -339,6 +380,9 @@ public:
 	bool useSvPwm = true;
 
 	int16_t bangInitPower = 5000; // Default current in setup routines
+	int16_t autotuneVoltage = 3000; // PRBS amplitude in Ud counts for current loop identification
+	uint16_t autotuneBandwidth = 1000; // Target current loop bandwidth in Hz
+	TMC4671MotorIdent motorIdent;
 
 	void setTorque(int16_t torque);
 
@@ -403,8 +447,15 @@ public:
 	uint32_t encToPos(uint32_t enc);
 
 	void exti(uint16_t GPIO_Pin);
+	void adcUpd(volatile uint32_t* ADC_BUF, uint8_t chans, ADC_HandleTypeDef* hadc) override;
 	void encoderIndexHit();
 
+	// Supervisor events. Sent as task notification bits to wake up the state machine
+	static const uint32_t TMC_EVT_FLAG = 0x01;	// Status flag pin interrupt
+	static const uint32_t TMC_EVT_STATE = 0x02;	// State changed
+	static const uint32_t TMC_EVT_POWER = 0x04;	// Supply voltage went in or out of range
+	void notifySupervisor(uint32_t events);
+
 	StatusFlags readFlags(bool maskedOnly = true);
 	void setStatusMask(StatusFlags mask);
 	void setStatusMask(uint32_t mask); // Mask for status pin.
@@ -418,14 +469,24 @@ public:
 
 	void saveFlash() override;
 	void restoreFlash() override;
+	uint16_t getProfileKey() override {return flashAddrs.mconf;};
+	uint8_t saveProfile(uint16_t* buf,uint8_t maxLen) override;
+	void loadProfile(const uint16_t* buf,uint8_t len) override;
 	TMC4671FlashAddrs flashAddrs;
 
 	uint16_t encodeEncHallMisc();
 	void restoreEncHallMisc(uint16_t val);
 
+	// Alignment cache
+	TMC4671AlignCache alignCache;
+	uint16_t alignCacheHash();
+	void restoreAlignCache();
+	void saveAlignCache();
+	void invalidateAlignCache();
+
 	bool allowSlowSPI = true; // For engineering sample
 
-	void beginSpiTransfer(SPIPort* port);
+	void beginSpiTransfer(SPIPort* port,bool busOwned = false);
 	void endSpiTransfer(SPIPort* port);
 	//void spiTxCompleted(SPIPort* port);
 
@@ -454,6 +515,14 @@ private:
 	uint8_t enc_retry_max = 5;
 
 	uint32_t lastStatTime = 0;
+	// Background checks run fast after events and back off when nothing happens
+	const uint32_t statCheckIntervalMin = 50;
+	const uint32_t statCheckIntervalMax = 2000;
+	uint32_t statCheckInterval = statCheckIntervalMin;
+	volatile bool powerState = false; // Last power state seen by the adc callback
+	volatile bool supervisorStarted = false;
+	uint32_t supervisorTimeout();
+	void backgroundCheck();
 
 
 	uint8_t spi_buf[5] = {0};
@@ -471,6 +540,8 @@ private:
 
 	uint32_t initTime = 0;
 	bool manualEncAlign = false;
+	bool indexCachePending = false; // Index was hit and the angle at the index should be stored
+	const uint16_t adcCacheTolerance = 300; // Max adc offset deviation from cached values
 	bool spiActive = false; // Flag for tx interrupt that the transfer was started by this instance
 
 };
@@ -40,6 +40,7 @@ enum class VescCANMsg : uint8_t {
 	CAN_PACKET_PROCESS_RX_BUFFER = 7,
 	CAN_PACKET_PROCESS_SHORT_BUFFER = 8,
 	CAN_PACKET_SET_CURRENT_REL = 10,
+	CAN_PACKET_STATUS_4 = 16,
 	CAN_PACKET_PING = 17,
 	CAN_PACKET_PONG = 18,
 	CAN_PACKET_POLL_ROTOR_POS = 56
@@ -55,7 +56,7 @@ enum class VescEncoderMode : uint8_t {
 };
 
 enum class VescCAN_commands : uint32_t {
-	offbcanid,vesccanid,canspd,errorflags,vescstate,voltage,encrate,pos,torque,forcePosRead,useEncoder,offset
+	offbcanid,vesccanid,canspd,errorflags,vescstate,voltage,encrate,pos,torque,forcePosRead,useEncoder,offset,posage
 };
 
 struct VescFlashAddrs{
@@ -130,12 +131,23 @@ private:
 	volatile float encRate = 0;				// encoder rate to test if can speed setting is OK
 	volatile uint32_t lastVescResponse = 0;	// record last time when vesc respond
 
+	// Position history fed by the periodic VESC status frames or by polled rotor positions
+	bool streamPosition() const {return VESC_can_Id != 0xFF;} // STATUS_4 streaming needs a known vesc id
+	volatile uint16_t lastPosTime = 0;		// micros() of the last position frame
+	volatile uint32_t lastPosTick = 0;		// HAL_GetTick() of the last position frame. Guards the 16 bit micros() wrap
+	volatile float posVelocity = 0;			// filtered velocity in turns/s
+	static const uint16_t maxExtrapolationTime = 3000; // µs. Stop extrapolating after a few missed frames
+	static const uint32_t maxFrameGap = 20;		// ms. Larger gaps reset the velocity estimate
+	float extrapolatedPos();
+	uint32_t getPosAge();
+
 	void saveFlashOffset();
 
 	// CAN section
 
 	CANPort *port = &canport;
-	int32_t filterId = 0;
+	int32_t filterIds[3] = {-1,-1,-1};
+	void setupCanFilter();
 	uint8_t baudrate = CANSPEEDPRESET_500; 	// 250000, 500000, 1M
 	uint8_t OFFB_can_Id = 0x40; 			// Default OpenFFBoard CAN ID
 	uint8_t VESC_can_Id = 0xFF;				// Default VESC CAN id
@@ -149,7 +161,7 @@ private:
 	void decodeEncoderPosition(float newPos);
 	void askGetValue();
 	void askPositionEncoder();
-	void sendMsg(uint8_t cmd, uint8_t *buffer, uint8_t len);
+	void sendMsg(uint8_t cmd, uint8_t *buffer, uint8_t len, CANPriority priority = CANPriority::normal);
 	void decode_buffer(uint8_t *buffer, uint8_t len);
 
 	void buffer_append_float32(uint8_t *buffer, float number, float scale, int32_t *index);
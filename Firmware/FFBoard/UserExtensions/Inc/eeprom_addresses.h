@@ -10,7 +10,7 @@
 
 #include "main.h"
 // Change this to the amount of currently registered variables
-#define NB_OF_VAR	83
+#define NB_OF_VAR	261
 
 extern uint16_t VirtAddVarTab[NB_OF_VAR];
 
@@ -94,6 +94,16 @@ uint16_t EE_ReadVariable(uint16_t VirtAddress, uint16_t* Data) will return 1 if
 #define ADR_TMC1_TORQUE_I				0x328
 #define ADR_TMC1_FLUX_P					0x329
 #define ADR_TMC1_FLUX_I					0x32A
+#define ADR_TMC1_ENC_SIG				0x32B // Encoder alignment cache signature. 0-11 config hash, 12 ABN npol, 13 ABN dir, 14 AENC dir, 15 index angle valid
+#define ADR_TMC1_ADC_I0_OFS				0x32C
+#define ADR_TMC1_ADC_I1_OFS				0x32D
+#define ADR_TMC1_ENC_PHIE				0x32E // ABN: electrical angle at index. AENC: phiE offset
+#define ADR_TMC1_AENC0_OFS				0x32F
+#define ADR_TMC1_AENC0_SCALE			0x330
+#define ADR_TMC1_AENC1_OFS				0x331
+#define ADR_TMC1_AENC1_SCALE			0x332
+#define ADR_TMC1_AENC2_OFS				0x333
+#define ADR_TMC1_AENC2_SCALE			0x334
 
 
 // AXIS2
@@ -116,6 +126,16 @@ uint16_t EE_ReadVariable(uint16_t VirtAddress, uint16_t* Data) will return 1 if
 #define ADR_TMC2_TORQUE_I				0x368
 #define ADR_TMC2_FLUX_P					0x369
 #define ADR_TMC2_FLUX_I					0x36A
+#define ADR_TMC2_ENC_SIG				0x36B // Encoder alignment cache signature. 0-11 config hash, 12 ABN npol, 13 ABN dir, 14 AENC dir, 15 index angle valid
+#define ADR_TMC2_ADC_I0_OFS				0x36C
+#define ADR_TMC2_ADC_I1_OFS				0x36D
+#define ADR_TMC2_ENC_PHIE				0x36E // ABN: electrical angle at index. AENC: phiE offset
+#define ADR_TMC2_AENC0_OFS				0x36F
+#define ADR_TMC2_AENC0_SCALE			0x370
+#define ADR_TMC2_AENC1_OFS				0x371
+#define ADR_TMC2_AENC1_SCALE			0x372
+#define ADR_TMC2_AENC2_OFS				0x373
+#define ADR_TMC2_AENC2_SCALE			0x374
 
 
 // AXIS3
@@ -138,6 +158,16 @@ uint16_t EE_ReadVariable(uint16_t VirtAddress, uint16_t* Data) will return 1 if
 #define ADR_TMC3_TORQUE_I				0x3A8
 #define ADR_TMC3_FLUX_P					0x3A9
 #define ADR_TMC3_FLUX_I					0x3AA
+#define ADR_TMC3_ENC_SIG				0x3AB // Encoder alignment cache signature. 0-11 config hash, 12 ABN npol, 13 ABN dir, 14 AENC dir, 15 index angle valid
+#define ADR_TMC3_ADC_I0_OFS				0x3AC
+#define ADR_TMC3_ADC_I1_OFS				0x3AD
+#define ADR_TMC3_ENC_PHIE				0x3AE // ABN: electrical angle at index. AENC: phiE offset
+#define ADR_TMC3_AENC0_OFS				0x3AF
+#define ADR_TMC3_AENC0_SCALE			0x3B0
+#define ADR_TMC3_AENC1_OFS				0x3B1
+#define ADR_TMC3_AENC1_SCALE			0x3B2
+#define ADR_TMC3_AENC2_OFS				0x3B3
+#define ADR_TMC3_AENC2_SCALE			0x3B4
 
 
 // Odrive
@@ -158,7 +188,21 @@ uint16_t EE_ReadVariable(uint16_t VirtAddress, uint16_t* Data) will return 1 if
 #define ADR_VESC3_OFFSET				0x3E8 //16b offset
 
 
+// Remote CAN axis
+#define ADR_CANAXIS_NODEIDS				0x3F0 //0-5 node of axis 1, 6-11 node of axis 2, 12-14 can speed
+#define ADR_CANAXIS_NODE_CONF			0x3F1 //0-5 own node id, 6-8 can speed
+#define ADR_CANAXIS_NODE_TYPES			0x3F2 //0-7 drvtype, 8-15 enctype
+
+
 //MT Encoder
 #define ADR_MTENC_CONF1					0x401
 
+
+// Config profiles. See ConfigProfiles.h
+#define ADR_PROFILE_ACTIVE				0x4F0 // Last applied profile. 0xff = none
+#define ADR_PROFILE_BASE				0x500 // 0x40 per profile: header (version << 8 | length), then data
+#define ADR_PROFILE(n,i)				(ADR_PROFILE_BASE + ((n) * 0x40) + (i))
+#define PROFILE_COUNT					4
+#define PROFILE_SIZE					36 // Stored words per profile including header
+
 #endif /* EEPROM_ADDRESSES_H_ */
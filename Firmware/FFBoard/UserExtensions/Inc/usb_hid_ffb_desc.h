@@ -8,7 +8,7 @@
 #ifndef USB_INC_USB_HID_FFB_DESC_H_
 #define USB_INC_USB_HID_FFB_DESC_H_
 
-#define USB_HID_FFB_REPORT_DESC_SIZE 1229//1378
+#define USB_HID_FFB_REPORT_DESC_SIZE 1250//1378
 
 extern const uint8_t hid_ffb_desc[USB_HID_FFB_REPORT_DESC_SIZE];
 
@@ -0,0 +1,309 @@
+/*
+ * CanAxis.cpp
+ *
+ *  Created on: 19.10.2026
+ *      Author: Yannick
+ */
+#include "target_constants.h"
+#include "CanAxis.h"
+#ifdef CANAXIS
+#include "critical.hpp"
+
+bool CanAxis1::inUse = false;
+ClassIdentifier CanAxis1::info = {
+		 .name = "Remote axis 1 (CAN)" ,
+		 .id=CLSID_MOT_CANAXIS0,
+};
+bool CanAxis2::inUse = false;
+ClassIdentifier CanAxis2::info = {
+		 .name = "Remote axis 2 (CAN)" ,
+		 .id=CLSID_MOT_CANAXIS1,
+};
+
+const ClassIdentifier CanAxis1::getInfo(){
+	return info;
+}
+
+const ClassIdentifier CanAxis2::getInfo(){
+	return info;
+}
+
+bool CanAxis1::isCreatable(){
+	return !CanAxis1::inUse;
+}
+
+bool CanAxis2::isCreatable(){
+	return !CanAxis2::inUse;
+}
+
+
+uint32_t CanAxisClock::now(){
+	BaseType_t savedInterruptStatus = cpp_freertos::CriticalSection::EnterFromISR();
+	uint16_t micro = micros();
+	uint32_t tick = HAL_GetTick();
+	if(tick - lastTick > 60){ // Timer may have wrapped
+		time = tick * 1000;
+	}else{
+		time += (uint16_t)(micro - lastMicros);
+	}
+	lastMicros = micro;
+	lastTick = tick;
+	uint32_t t = time;
+	cpp_freertos::CriticalSection::ExitFromISR(savedInterruptStatus);
+	return t;
+}
+
+uint32_t canAxisFrameId(CanAxisMsg msg,uint8_t node){
+	return CANAXIS_ID_BASE | ((uint32_t)msg << 8) | node;
+}
+
+bool canAxisSend(CANPort* port,CanAxisMsg msg,uint8_t node,const uint8_t* data,uint8_t len,CANPriority priority){
+	CAN_tx_msg frame;
+	frame.header.IDE = CAN_ID_EXT;
+	frame.header.RTR = CAN_RTR_DATA;
+	frame.header.ExtId = canAxisFrameId(msg, node);
+	frame.header.DLC = len;
+	memcpy(frame.data, data, len);
+	return port->sendMessage(frame, priority);
+}
+
+
+CanAxis::CanAxis(uint8_t instance) : CommandHandler("canaxis", CLSID_MOT_CANAXIS0,instance), Thread("CANAXIS", CANAXIS_THREAD_MEM, CANAXIS_THREAD_PRIO), instance(instance) {
+	nodeId = instance + 1; // Default
+	restoreFlash();
+
+	setupCanFilter();
+	this->port->setSpeedPreset(baudrate);
+	this->registerCommands();
+	this->Start();
+}
+
+CanAxis::~CanAxis() {
+	sendControl(CanAxisControl::stop);
+	if(this->filterId >= 0)
+		this->port->removeCanFilter(this->filterId);
+}
+
+/**
+ * Receives all frames sent by this node
+ */
+void CanAxis::setupCanFilter(){
+	if(this->filterId >= 0)
+		this->port->removeCanFilter(this->filterId);
+	this->filterId = this->port->addCanFilter(CANPort::extIdFilter(CANAXIS_ID_BASE | nodeId, CANAXIS_ID_MASK | 0xFF), this);
+}
+
+void CanAxis::registerCommands(){
+	CommandHandler::registerCommands();
+	registerCommand("nodeid", CanAxis_commands::nodeid, "Node id of the remote board",CMDFLAG_GET | CMDFLAG_SET);
+	registerCommand("canspd", CanAxis_commands::canspd, "CAN baudrate",CMDFLAG_GET | CMDFLAG_SET);
+	registerCommand("connected", CanAxis_commands::connected, "Node connection state (status flags)",CMDFLAG_GET);
+	registerCommand("posage", CanAxis_commands::posage, "Time since last position sample (us)",CMDFLAG_GET);
+	registerCommand("rate", CanAxis_commands::rate, "Received positions per second",CMDFLAG_GET);
+}
+
+void CanAxis::restoreFlash(){
+	uint16_t ids = 0;
+	if(Flash_Read(ADR_CANAXIS_NODEIDS, &ids)){
+		uint8_t id = (ids >> (6 * instance)) & 0x3F;
+		if(id != 0)
+			nodeId = id;
+		setCanRate((ids >> 12) & 0x7);
+	}
+}
+
+void CanAxis::saveFlash(){
+	uint16_t ids = 0;
+	Flash_Read(ADR_CANAXIS_NODEIDS, &ids);
+	ids &= ~(0x3F << (6 * instance));
+	ids |= (nodeId & 0x3F) << (6 * instance);
+	ids &= ~0x7000;
+	ids |= (baudrate & 0x7) << 12;
+	Flash_Write(ADR_CANAXIS_NODEIDS, ids);
+}
+
+void CanAxis::setCanRate(uint8_t canRate){
+	baudrate = clip<uint8_t,uint8_t>(canRate, 3, 5);
+	port->setSpeedPreset(baudrate);
+}
+
+/**
+ * Sends the master time. The node aligns its clock to it
+ */
+void CanAxis::sendSync(){
+	uint32_t time = clock.now();
+	canAxisSend(port, CanAxisMsg::sync, nodeId, (uint8_t*)&time, sizeof(time), CANPriority::high);
+}
+
+void CanAxis::sendControl(CanAxisControl control){
+	uint8_t data = (uint8_t)control;
+	canAxisSend(port, CanAxisMsg::control, nodeId, &data, 1);
+}
+
+void CanAxis::Run(){
+	while(true){
+		this->Delay(100);
+		sendSync();
+
+		connected = HAL_GetTick() - lastStatusTick < 500;
+		if(connected && active != ((nodeStatus & CANAXIS_ACTIVE) != 0)){
+			sendControl(active ? CanAxisControl::start : CanAxisControl::stop); // Node restarted or missed the command
+		}
+
+		uint32_t ratePeriod = HAL_GetTick() - posRateStart;
+		if(ratePeriod >= 1000){
+			posRate = posFrames * 1000.0 / ratePeriod;
+			posFrames = 0;
+			posRateStart = HAL_GetTick();
+		}
+	}
+}
+
+void CanAxis::turn(int16_t power){
+	if(!motorReady())
+		return;
+	uint8_t data[3];
+	memcpy(data, &power, sizeof(power));
+	data[2] = torqueSeq++;
+	canAxisSend(port, CanAxisMsg::torque, nodeId, data, sizeof(data), CANPriority::high);
+}
+
+void CanAxis::stopMotor(){
+	active = false;
+	sendControl(CanAxisControl::stop);
+}
+
+void CanAxis::startMotor(){
+	active = true;
+	sendControl(CanAxisControl::start);
+}
+
+bool CanAxis::motorReady(){
+	return connected && (nodeStatus & CANAXIS_READY);
+}
+
+Encoder* CanAxis::getEncoder(){
+	return static_cast<Encoder*>(this);
+}
+
+/**
+ * Extrapolates the last sample to the current master time.
+ * Both clocks are aligned by the sync message so the sample age is exact
+ */
+float CanAxis::predictedPos(){
+	cpp_freertos::CriticalSection::Enter();
+	float pos = lastPos;
+	float vel = lastVelocity;
+	uint32_t time = lastPosTime;
+	cpp_freertos::CriticalSection::Exit();
+	int32_t age = clock.now() - time;
+	if(age <= 0 || age > 50000){ // Sample from the future or stream stopped
+		return pos;
+	}
+	return pos + vel * (std::min<uint32_t>(age, maxPredictionTime) / 1000000.0f);
+}
+
+uint32_t CanAxis::getPosAge(){
+	int32_t age = clock.now() - lastPosTime;
+	return std::max<int32_t>(age, 0);
+}
+
+float CanAxis::getPos_f(){
+	return predictedPos() - posOffset;
+}
+
+int32_t CanAxis::getPos(){
+	return getCpr() * getPos_f();
+}
+
+uint32_t CanAxis::getCpr(){
+	return 0xffff;
+}
+
+void CanAxis::setPos(int32_t pos){
+	posOffset = predictedPos() - ((float)pos / (float)getCpr());
+}
+
+
+CommandStatus CanAxis::command(const ParsedCommand& cmd,std::vector<CommandReply>& replies){
+	switch(static_cast<CanAxis_commands>(cmd.cmdId)){
+	case CanAxis_commands::nodeid:
+		if(cmd.type == CMDtype::set){
+			nodeId = cmd.val & 0x3F;
+			setupCanFilter();
+		}else{
+			return handleGetSet(cmd, replies, this->nodeId);
+		}
+		break;
+	case CanAxis_commands::canspd:
+		if(cmd.type == CMDtype::get){
+			replies.push_back(CommandReply(baudrate));
+		}else if(cmd.type == CMDtype::set){
+			setCanRate(cmd.val);
+		}else{
+			return CommandStatus::ERR;
+		}
+		break;
+	case CanAxis_commands::connected:
+		if(cmd.type == CMDtype::get){
+			replies.push_back(CommandReply(connected ? nodeStatus : 0));
+		}else{
+			return CommandStatus::ERR;
+		}
+		break;
+	case CanAxis_commands::posage:
+		if(cmd.type == CMDtype::get){
+			replies.push_back(CommandReply(getPosAge()));
+		}else{
+			return CommandStatus::ERR;
+		}
+		break;
+	case CanAxis_commands::rate:
+		if(cmd.type == CMDtype::get){
+			replies.push_back(CommandReply((uint32_t)posRate));
+		}else{
+			return CommandStatus::ERR;
+		}
+		break;
+	default:
+		return CommandStatus::NOT_FOUND;
+	}
+	return CommandStatus::OK;
+}
+
+
+void CanAxis::canRxPendCallback(CAN_HandleTypeDef *hcan,uint8_t* rxBuf,CAN_RxHeaderTypeDef* rxHeader,uint32_t fifo){
+	if(rxHeader->IDE != CAN_ID_EXT || (rxHeader->ExtId & CANAXIS_ID_MASK) != CANAXIS_ID_BASE || (rxHeader->ExtId & 0xFF) != nodeId){
+		return;
+	}
+	CanAxisMsg msg = (CanAxisMsg)((rxHeader->ExtId >> 8) & 0xFF);
+
+	switch(msg){
+	case CanAxisMsg::position:
+	{
+		float pos;
+		uint32_t time;
+		memcpy(&pos, rxBuf, sizeof(pos));
+		memcpy(&time, rxBuf+4, sizeof(time));
+		int32_t dt = time - lastPosTime;
+		if(dt > 0 && dt < 50000){
+			float vel = (pos - lastPos) * (1000000.0f / dt);
+			lastVelocity = (lastVelocity + vel) * 0.5f;
+		}else{
+			lastVelocity = 0;
+		}
+		lastPos = pos;
+		lastPosTime = time;
+		posFrames++;
+		break;
+	}
+	case CanAxisMsg::status:
+		nodeStatus = rxBuf[0];
+		lastStatusTick = HAL_GetTick();
+		break;
+	default:
+		break;
+	}
+}
+
+#endif
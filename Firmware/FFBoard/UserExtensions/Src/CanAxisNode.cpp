@@ -0,0 +1,300 @@
+/*
+ * CanAxisNode.cpp
+ *
+ *  Created on: 19.10.2026
+ *      Author: Yannick
+ */
+#include "target_constants.h"
+#include "CanAxisNode.h"
+#ifdef CANAXIS
+#include "cmsis_os2.h"
+#include "ledEffects.h"
+#ifdef TMC4671DRIVER
+#include "TMC4671.h"
+#endif
+
+ClassIdentifier CanAxisNode::info = {
+		 .name = "Remote axis node (CAN)" ,
+		 .id=CLSID_MAIN_CANAXIS,
+		 .hidden=false
+ };
+
+const ClassIdentifier CanAxisNode::getInfo(){
+	return info;
+}
+
+CanAxisNode::CanAxisNode() : Thread("CANNODE", CANAXIS_THREAD_MEM, CANAXIS_THREAD_PRIO), drv_chooser(MotorDriver::all_drivers),enc_chooser{Encoder::all_encoders} {
+	restoreFlash();
+	this->port->setSpeedPreset(baudrate);
+	this->Start(); // Before the filter so received frames can notify the thread
+	setupCanFilter();
+	registerCommands();
+}
+
+CanAxisNode::~CanAxisNode() {
+	if(this->filterId >= 0)
+		this->port->removeCanFilter(this->filterId);
+	drv->turn(0);
+	drv->stopMotor();
+}
+
+/**
+ * Receives all frames for this node
+ */
+void CanAxisNode::setupCanFilter(){
+	if(this->filterId >= 0)
+		this->port->removeCanFilter(this->filterId);
+	this->filterId = this->port->addCanFilter(CANPort::extIdFilter(CANAXIS_ID_BASE | nodeId, CANAXIS_ID_MASK | 0xFF), this);
+}
+
+void CanAxisNode::registerCommands(){
+	registerCommand("nodeid", CanAxisNode_commands::nodeid, "Node id of this board",CMDFLAG_GET | CMDFLAG_SET);
+	registerCommand("canspd", CanAxisNode_commands::canspd, "CAN baudrate",CMDFLAG_GET | CMDFLAG_SET);
+	registerCommand("drvtype", CanAxisNode_commands::drvtype, "Motor driver type get/set/list",CMDFLAG_GET | CMDFLAG_SET | CMDFLAG_INFOSTRING);
+	registerCommand("enctype", CanAxisNode_commands::enctype, "Encoder type get/set/list",CMDFLAG_GET | CMDFLAG_SET | CMDFLAG_INFOSTRING);
+	registerCommand("synced", CanAxisNode_commands::synced, "Clock synchronized to the master",CMDFLAG_GET);
+	registerCommand("clockofs", CanAxisNode_commands::clockofs, "Master time - local time (us)",CMDFLAG_GET);
+	registerCommand("torque", CanAxisNode_commands::torque, "Last torque setpoint",CMDFLAG_GET);
+}
+
+void CanAxisNode::restoreFlash(){
+	uint16_t conf = 0;
+	if(Flash_Read(ADR_CANAXIS_NODE_CONF, &conf)){
+		uint8_t id = conf & 0x3F;
+		if(id != 0)
+			nodeId = id;
+		setCanRate((conf >> 6) & 0x7);
+	}
+	uint16_t types = 0;
+	if(Flash_Read(ADR_CANAXIS_NODE_TYPES, &types)){
+		setDrvType(types & 0xff);
+		setEncType((types >> 8) & 0xff);
+	}
+}
+
+void CanAxisNode::saveFlash(){
+	uint16_t conf = (nodeId & 0x3F) | ((baudrate & 0x7) << 6);
+	Flash_Write(ADR_CANAXIS_NODE_CONF, conf);
+	Flash_Write(ADR_CANAXIS_NODE_TYPES, drvtype | (enctype << 8));
+}
+
+void CanAxisNode::setCanRate(uint8_t canRate){
+	baudrate = clip<uint8_t,uint8_t>(canRate, 3, 5);
+	port->setSpeedPreset(baudrate);
+}
+
+/**
+ * Creates the local motor driver
+ */
+void CanAxisNode::setDrvType(uint8_t drvtype){
+	if (!drv_chooser.isValidClassId(drvtype)){
+		return;
+	}
+	drvMutex.Lock();
+	this->drv.reset(nullptr);
+	MotorDriver* drv = drv_chooser.Create((uint16_t)drvtype);
+	if (drv == nullptr){
+		this->drv = std::make_unique<MotorDriver>();
+		drvMutex.Unlock();
+		return;
+	}
+	this->drv = std::unique_ptr<MotorDriver>(drv);
+	this->drvtype = drvtype;
+	if(!this->drv->hasIntegratedEncoder()){
+		this->drv->setEncoder(this->enc);
+	}
+#ifdef TMC4671DRIVER
+	TMC4671* tmc = dynamic_cast<TMC4671*>(drv);
+	if(tmc != nullptr){
+		tmc->setMotionMode(MotionMode::torque);
+		tmc->Start();
+	}
+#endif
+	if(active){
+		drv->startMotor();
+	}
+	drvMutex.Unlock();
+}
+
+void CanAxisNode::setEncType(uint8_t enctype){
+	if (enc_chooser.isValidClassId(enctype) && !drv->hasIntegratedEncoder()){
+		drvMutex.Lock();
+		this->enctype = enctype;
+		this->enc = std::shared_ptr<Encoder>(enc_chooser.Create(enctype));
+		this->drv->setEncoder(this->enc);
+		drvMutex.Unlock();
+	}
+}
+
+/**
+ * Applies the latest torque setpoint and streams the position.
+ * Runs after every setpoint and at least every ms
+ */
+void CanAxisNode::Run(){
+	while(true){
+		uint32_t events = 0;
+		xTaskNotifyWait(0, 0xffffffff, &events, 1);
+
+		drvMutex.Lock();
+		if(activeChanged){
+			activeChanged = false;
+			if(active){
+				drv->startMotor();
+			}else{
+				drv->turn(0);
+				drv->stopMotor();
+			}
+		}
+		if(active && HAL_GetTick() - lastTorqueTick < torqueTimeout){
+			drv->turn(torque);
+		}else{
+			drv->turn(0); // Master lost
+		}
+
+		sendPosition();
+		if(HAL_GetTick() - lastStatusTick >= 100){
+			lastStatusTick = HAL_GetTick();
+			sendStatus();
+		}
+		drvMutex.Unlock();
+
+		if(HAL_GetTick() - lastSyncTick > 1000){
+			synced = false;
+		}
+	}
+}
+
+void CanAxisNode::update(){
+	osDelay(50); // Everything runs in the node thread
+}
+
+/**
+ * Sends the encoder position with the sample time in the master time base
+ */
+void CanAxisNode::sendPosition(){
+	Encoder* enc = drv->getEncoder();
+	if(enc == nullptr || !synced){
+		return;
+	}
+	uint32_t time = clock.now() + clockOffset;
+	float pos = enc->getPos_f();
+	uint8_t data[8];
+	memcpy(data, &pos, sizeof(pos));
+	memcpy(data+4, &time, sizeof(time));
+	canAxisSend(port, CanAxisMsg::position, nodeId, data, sizeof(data), CANPriority::high);
+}
+
+void CanAxisNode::sendStatus(){
+	uint8_t data[2];
+	data[0] = (drv->motorReady() ? CANAXIS_READY : 0) | (active ? CANAXIS_ACTIVE : 0) | (synced ? CANAXIS_SYNCED : 0);
+	data[1] = torqueSeq;
+	canAxisSend(port, CanAxisMsg::status, nodeId, data, sizeof(data));
+}
+
+void CanAxisNode::canRxPendCallback(CAN_HandleTypeDef *hcan,uint8_t* rxBuf,CAN_RxHeaderTypeDef* rxHeader,uint32_t fifo){
+	if(rxHeader->IDE != CAN_ID_EXT || (rxHeader->ExtId & CANAXIS_ID_MASK) != CANAXIS_ID_BASE || (rxHeader->ExtId & 0xFF) != nodeId){
+		return;
+	}
+	CanAxisMsg msg = (CanAxisMsg)((rxHeader->ExtId >> 8) & 0xFF);
+	BaseType_t taskWoken = 0;
+
+	switch(msg){
+	case CanAxisMsg::sync:
+	{
+		uint32_t masterTime;
+		memcpy(&masterTime, rxBuf, sizeof(masterTime));
+		// Frame was sent one frame length before reception
+		uint32_t latency = (uint32_t)CANPort::frameBits(true, rxHeader->DLC) * 1000000 / port->getSpeed();
+		int32_t offset = masterTime + latency - clock.now();
+		if(!synced || abs(offset - clockOffset) > 1000){
+			clockOffset = offset;
+		}else{
+			clockOffset += (offset - clockOffset) / 4; // Track drift without jumps from delayed frames
+		}
+		synced = true;
+		lastSyncTick = HAL_GetTick();
+		break;
+	}
+	case CanAxisMsg::torque:
+		memcpy((void*)&torque, rxBuf, sizeof(int16_t));
+		torqueSeq = rxBuf[2];
+		lastTorqueTick = HAL_GetTick();
+		xTaskNotifyFromISR(this->GetHandle(), 1, eSetBits, &taskWoken);
+		break;
+	case CanAxisMsg::control:
+		active = rxBuf[0] == (uint8_t)CanAxisControl::start;
+		activeChanged = true;
+		xTaskNotifyFromISR(this->GetHandle(), 1, eSetBits, &taskWoken);
+		break;
+	default:
+		break;
+	}
+	portYIELD_FROM_ISR(taskWoken);
+}
+
+
+CommandStatus CanAxisNode::command(const ParsedCommand& cmd,std::vector<CommandReply>& replies){
+	switch(static_cast<CanAxisNode_commands>(cmd.cmdId)){
+	case CanAxisNode_commands::nodeid:
+		if(cmd.type == CMDtype::set){
+			nodeId = cmd.val & 0x3F;
+			setupCanFilter();
+		}else{
+			return handleGetSet(cmd, replies, this->nodeId);
+		}
+		break;
+	case CanAxisNode_commands::canspd:
+		if(cmd.type == CMDtype::get){
+			replies.push_back(CommandReply(baudrate));
+		}else if(cmd.type == CMDtype::set){
+			setCanRate(cmd.val);
+		}else{
+			return CommandStatus::ERR;
+		}
+		break;
+	case CanAxisNode_commands::drvtype:
+		if(cmd.type == CMDtype::info){
+			drv_chooser.replyAvailableClasses(replies);
+		}else if(cmd.type == CMDtype::get){
+			replies.push_back(CommandReply(drvtype));
+		}else if(cmd.type == CMDtype::set){
+			setDrvType(cmd.val);
+		}
+		break;
+	case CanAxisNode_commands::enctype:
+		if(cmd.type == CMDtype::info){
+			enc_chooser.replyAvailableClasses(replies);
+		}else if(cmd.type == CMDtype::get){
+			replies.push_back(CommandReply(enctype));
+		}else if(cmd.type == CMDtype::set){
+			setEncType(cmd.val);
+		}
+		break;
+	case CanAxisNode_commands::synced:
+		if(cmd.type == CMDtype::get){
+			replies.push_back(CommandReply(synced ? 1 : 0));
+		}else{
+			return CommandStatus::ERR;
+		}
+		break;
+	case CanAxisNode_commands::clockofs:
+		if(cmd.type == CMDtype::get){
+			replies.push_back(CommandReply(clockOffset));
+		}else{
+			return CommandStatus::ERR;
+		}
+		break;
+	case CanAxisNode_commands::torque:
+		if(cmd.type == CMDtype::get){
+			replies.push_back(CommandReply(torque));
+		}else{
+			return CommandStatus::ERR;
+		}
+		break;
+	default:
+		return CommandStatus::NOT_FOUND;
+	}
+	return CommandStatus::OK;
+}
+
+#endif
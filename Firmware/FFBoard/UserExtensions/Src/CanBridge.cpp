@@ -11,6 +11,7 @@
 
 #include "ledEffects.h"
 #include "cdc_device.h"
+#include "critical.hpp"
 
 extern TIM_TypeDef TIM_MICROS;
 
@@ -47,7 +48,8 @@ CanBridge::CanBridge() {
 	txHeader.DLC = 8;	// 8 bytes
 	txHeader.TransmitGlobalTime = DISABLE;
 
-	this->filterId = this->port->addCanFilter(sFilterConfig);
+	this->filterId = this->port->addCanFilter(sFilterConfig,this); // Accepts all frames
+	this->port->setRxMonitor(this); // Also capture frames received by motor drivers with their own filters
 	// Interrupt start
 	conf1.enabled = true;
 
@@ -55,9 +57,11 @@ CanBridge::CanBridge() {
 	registerCommand("can", CanBridge_commands::can, "Send a frame or get last received frame");
 	registerCommand("rtr", CanBridge_commands::canrtr, "Send a RTR frame");
 	registerCommand("spd", CanBridge_commands::canspd, "Change or get CAN baud");
+	registerCommand("rxdrop", CanBridge_commands::rxdrop, "Frames dropped because the receive buffer was full", CMDFLAG_GET);
 }
 
 CanBridge::~CanBridge() {
+	this->port->setRxMonitor(nullptr);
 	this->port->removeCanFilter(filterId);
 }
 
@@ -79,16 +83,48 @@ void CanBridge::sendMessage(uint32_t id, uint64_t msg,uint8_t len = 8,bool rtr =
 	}
 }
 
-// Can only send and receive 32bit for now
+/**
+ * Returns a 32 bit µs time extended from the 16 bit microsecond timer.
+ * Resynchronized to the systick if not called for a while
+ */
+uint32_t CanBridge::timestamp(){
+	BaseType_t savedInterruptStatus = cpp_freertos::CriticalSection::EnterFromISR();
+	uint16_t now = micros();
+	uint32_t tick = HAL_GetTick();
+	if(tick - lastTimeTick > 60){ // Timer may have wrapped
+		timeUs = tick * 1000;
+	}else{
+		timeUs += (uint16_t)(now - lastMicros);
+	}
+	lastMicros = now;
+	lastTimeTick = tick;
+	uint32_t time = timeUs;
+	cpp_freertos::CriticalSection::ExitFromISR(savedInterruptStatus);
+	return time;
+}
+
+/**
+ * Stores received frames with a timestamp in the ring buffer.
+ * Frames are dropped and counted if update() can not keep up
+ */
 void CanBridge::canRxPendCallback(CAN_HandleTypeDef *hcan,uint8_t* rxBuf,CAN_RxHeaderTypeDef* rxHeader,uint32_t fifo){
 
 	if(fifo == rxfifo){
-
+		uint32_t time = timestamp();
 		memcpy(&lastmsg.data,rxBuf,8);
 		lastmsg.header = *rxHeader;
-		pulseSysLed();
 
-		replyPending = true;
+		uint8_t next = (rxHead + 1) % rxBuffer.size();
+		if(next == rxTail){
+			rxDropped++;
+			return;
+		}
+		CAN_rx_timed_msg& frame = rxBuffer[rxHead];
+		memcpy(frame.msg.data,rxBuf,8);
+		frame.msg.header = *rxHeader;
+		frame.time = time;
+		rxHead = next;
+		pulseSysLed();
 	}
 }
 
@@ -101,42 +137,65 @@ std::string CanBridge::messageToString(CAN_rx_msg msg){
 	return buf;
 }
 
-void CanBridge::update(){
-	if(replyPending){
-		CAN_rx_msg msg = lastmsg;
-		if(gvretMode){
-			CAN_RxHeaderTypeDef rxHeader = msg.header;
-			uint32_t time = rxHeader.Timestamp;
-			uint32_t id = rxHeader.StdId;
-			if(rxHeader.ExtId != 0){
-				id = rxHeader.ExtId;
-				id |= 0x80000000;
-			}
-			std::vector<char> reply = {
-					0xF1,0,(char)(time & 0xff), (char)((time >> 8) & 0xff), (char)((time >> 16) & 0xff), (char)((time >> 24) & 0xff),
-					(char)(id & 0xff), (char)((id >> 8) & 0xff), (char)((id >> 16) & 0xff), (char)((id >> 24) & 0xff),
-					(char)((rxHeader.DLC & 0xf) | (1 >> 4))
-			};
-
-			for(uint8_t i = 0; i< rxHeader.DLC; i++){
-				reply.push_back(msg.data[i]);
-			}
+/**
+ * Writes a frame in GVRET binary format to buf. Returns the length
+ */
+uint8_t CanBridge::packGvretFrame(const CAN_rx_timed_msg& frame,uint8_t* buf){
+	const CAN_RxHeaderTypeDef& rxHeader = frame.msg.header;
+	uint32_t time = frame.time;
+	uint32_t id = rxHeader.StdId;
+	if(rxHeader.IDE == CAN_ID_EXT){
+		id = rxHeader.ExtId;
+		id |= 0x80000000;
+	}
+	uint8_t dlc = std::min<uint8_t>(rxHeader.DLC, 8);
+	uint8_t len = 0;
+	buf[len++] = 0xF1;
+	buf[len++] = 0;
+	buf[len++] = time & 0xff;
+	buf[len++] = (time >> 8) & 0xff;
+	buf[len++] = (time >> 16) & 0xff;
+	buf[len++] = (time >> 24) & 0xff;
+	buf[len++] = id & 0xff;
+	buf[len++] = (id >> 8) & 0xff;
+	buf[len++] = (id >> 16) & 0xff;
+	buf[len++] = (id >> 24) & 0xff;
+	buf[len++] = dlc; // Bus 0 in upper nibble
+	memcpy(buf+len, frame.msg.data, dlc);
+	len += dlc;
+	buf[len++] = 0;
+	return len;
+}
 
-			reply.push_back(0);
-//			for(char c : reply){
-//				replystr.push_back(c);
-//			}
-			tud_cdc_n_write(0,reply.data(), reply.size());
+/**
+ * Drains the receive buffer.
+ * In GVRET mode as many frames as fit in the cdc buffer are packed into a single write
+ */
+void CanBridge::update(){
+	if(rxTail == rxHead){
+		return;
+	}
+	if(gvretMode){
+		uint32_t len = 0;
+		uint32_t available = std::min<uint32_t>(tud_cdc_n_write_available(0), gvretTxBuf.size());
+		while(rxTail != rxHead && len + gvretFrameMaxLen <= available){
+			len += packGvretFrame(rxBuffer[rxTail], gvretTxBuf.data()+len);
+			rxTail = (rxTail + 1) % rxBuffer.size();
+		}
+		if(len){
+			tud_cdc_n_write(0,gvretTxBuf.data(), len);
 			tud_cdc_write_flush();
-		}else{
-			std::string replystr = messageToString(msg);
-			CommandHandler::logSerial(replystr);
-
-//			tud_cdc_n_write(0,replystr.c_str(), replystr.length());
-//			tud_cdc_write_flush();
 		}
-
-		replyPending = false;
+	}else{
+		std::string replystr;
+		while(rxTail != rxHead){
+			if(!replystr.empty()){
+				replystr += "\n";
+			}
+			replystr += messageToString(rxBuffer[rxTail].msg);
+			rxTail = (rxTail + 1) % rxBuffer.size();
+		}
+		CommandHandler::logSerial(replystr);
 	}
 }
 
@@ -206,7 +265,7 @@ void CanBridge::cdcRcv(char* Buf, uint32_t *Len){
 			}
 			case(1):
 			{	// sync. Microseconds since start up LSB to MSB
-				uint32_t time = HAL_GetTick()*1000;//HAL_CAN_GetTxTimestamp(CanHandle, txMailbox); // or use systick and scale.
+				uint32_t time = timestamp(); // Same time base as received frames
 				std::vector<char> t = {0xF1,cmd,(char)(time & 0xff), (char)((time >> 8) & 0xff), (char)((time >> 16) & 0xff), (char)((time >> 24) & 0xff)};
 				reply.insert(reply.end(),t.begin(),t.end());
 
@@ -318,6 +377,14 @@ CommandStatus CanBridge::command(const ParsedCommand& cmd,std::vector<CommandRep
 		}
 		break;
 
+	case CanBridge_commands::rxdrop:
+		if(cmd.type == CMDtype::get){
+			replies.push_back(CommandReply(rxDropped));
+		}else{
+			return CommandStatus::ERR;
+		}
+		break;
+
 	case CanBridge_commands::canspd:
 		if(cmd.type == CMDtype::get){
 			replies.push_back(CommandReply(this->port->getSpeed()));
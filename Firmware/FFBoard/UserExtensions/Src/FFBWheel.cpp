@@ -10,6 +10,8 @@
 #include "hid_device.h"
 #include "tusb.h"
 #include "usb_hid_ffb_desc.h"
+#include "TimingProbes.h"
+#include "HeapProfiler.h"
 
 // Unique identifier for listing
 ClassIdentifier FFBWheel::info = {
@@ -128,14 +130,19 @@ void FFBWheel::update(){
 
 
 
-	// TODO Emulate a SOF timer...
-	if(HAL_GetTick() - lastUsbReportTick > 0 && !control.usb_disabled){
+	// Frames are triggered by the usb SOF. Emulated by the systick if no SOF arrives
+	if(HAL_GetTick() - lastSofTick > 2 && HAL_GetTick() - lastUsbReportTick > 0 && !control.usb_disabled){
 		lastUsbReportTick = HAL_GetTick();
+		lastSofTime = micros();
 		control.usb_update_flag  = true;
 	}
 
 	// If either usb or timer triggered
 	if(control.usb_update_flag || control.update_flag){
+		TimingProbe& updateProbe = TimingProbes::get(TimingProbeId::ffbupdate);
+		TimingProbes::get(TimingProbeId::ctrltick).tick();
+		updateProbe.begin();
+		HeapProfiler::enterControlPath();
 		axes_manager->update();
 		control.update_flag = false;
 		if(control.usb_update_flag){
@@ -146,7 +153,29 @@ void FFBWheel::update(){
 			}
 		}
 		axes_manager->updateTorque();
+		HeapProfiler::exitControlPath();
+		updateProbe.end();
 	}
+
+	// Sample the inputs at the end of the frame before a report is due so they are fresh when sent on the next SOF
+	if(!inputsSampled && report_rate_cnt + 1 >= usb_report_rate){
+		uint16_t frameOffset = micros() - lastSofTime;
+		if(frameOffset + inputSampleTime + sampleMargin >= frameTime){
+			sampleInputs();
+		}
+	}
+}
+
+/**
+ * Start of a usb frame. Called in the usb interrupt.
+ * Reports queued right after the SOF are sent in the same frame
+ */
+void FFBWheel::usbSof(){
+	if(control.usb_disabled)
+		return;
+	lastSofTime = micros();
+	lastSofTick = HAL_GetTick();
+	control.usb_update_flag = true;
 }
 
 
@@ -220,26 +249,55 @@ bool FFBWheel::getFfbActive(){
 }
 
 /**
- * Sends periodic gamepad reports of buttons and analog axes
+ * Reads buttons and analog inputs for the next report.
+ * Slow sources are read ahead so the report can be sent immediately after the SOF
  */
-void FFBWheel::send_report(){
+void FFBWheel::sampleInputs(){
+	uint16_t startTime = micros();
 
 	// Read buttons
-	reportHID.buttons = 0; // Reset buttons
+	inputButtons = 0;
 	uint8_t shift = 0;
-	if(btns.size() != 0){
-		for(auto &btn : btns){
-			uint64_t buf = 0;
-			uint8_t amount = btn->readButtons(&buf);
-			reportHID.buttons |= buf << shift;
-			shift += amount;
+	for(auto &btn : btns){
+		uint64_t buf = 0;
+		uint8_t amount = btn->readButtons(&buf);
+		inputButtons |= buf << shift;
+		shift += amount;
+	}
+
+	// Analog inputs
+	inputAxisCount = 0;
+	for(auto &ain : analog_inputs){
+		std::vector<int32_t>* axes = ain->getAxes();
+		for(int32_t val : *axes){
+			if(inputAxisCount >= analogAxisCount)
+				break;
+			inputAxes[inputAxisCount++] = val;
 		}
 	}
+	inputsSampled = true;
+
+	// Track the peak sampling time with a slow decay
+	uint16_t duration = (uint16_t)micros() - startTime;
+	if(duration > inputSampleTime){
+		inputSampleTime = duration;
+	}else if(inputSampleTime > 0){
+		inputSampleTime--;
+	}
+}
+
+/**
+ * Sends periodic gamepad reports of buttons and analog axes
+ */
+void FFBWheel::send_report(){
+	if(!inputsSampled){ // Sampling did not finish before this frame
+		sampleInputs();
+	}
+	inputsSampled = false;
 
+	reportHID.buttons = inputButtons;
 
 	// Encoder
-	//axes_manager->addAxesToReport(analogAxesReport, &count);
-
 	std::vector<int32_t>* axes = axes_manager->getAxisValues();
 	uint8_t count = 0;
 	for(auto val : *axes){
@@ -247,14 +305,10 @@ void FFBWheel::send_report(){
 	}
 
 	// Fill remaining values with analog inputs
-	for(auto &ain : analog_inputs){
-		std::vector<int32_t>* axes = ain->getAxes();
-		for(int32_t val : *axes){
-			if(count >= analogAxisCount)
-				break;
-			setHidReportAxis(&reportHID,count++,val);
-		}
-	} // Fill rest
+	for(uint8_t i = 0; i < inputAxisCount && count < analogAxisCount; i++){
+		setHidReportAxis(&reportHID,count++,inputAxes[i]);
+	}
+	// Fill rest
 	for(;count<analogAxisCount; count++){
 		setHidReportAxis(&reportHID,count,0);
 	}
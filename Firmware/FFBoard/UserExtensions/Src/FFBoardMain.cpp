@@ -86,6 +86,13 @@ void FFBoardMain::usbResume(){
 
 }
 
+/**
+ * Called in interrupt context at the start of every usb frame (1ms)
+ */
+void FFBoardMain::usbSof(){
+
+}
+
 
 std::string FFBoardMain::getHelpstring(){
 	return "Failsafe mainclass with no features. Choose a different mainclass. sys.lsmain to get a list";
@@ -19,6 +19,7 @@
 #include "ClassChooser.h"
 #include "FFBoardMain.h"
 #include "critical.hpp"
+#include "TimingProbes.h"
 
 
 Error FFBoardMainCommandThread::cmdNotFoundError = Error(ErrorCode::cmdNotFound,ErrorType::temporary,"Invalid command");
@@ -31,6 +32,8 @@ cpp_freertos::BinarySemaphore FFBoardMainCommandThread::threadSem = cpp_freertos
 // Note: allocate enough memory for the command thread to store replies
 FFBoardMainCommandThread::FFBoardMainCommandThread(FFBoardMain* mainclass) : Thread("cmdparser",1024, 35) {
 	//main = mainclass;
+	results.resize(1); // Single result slot reused for every command
+	results[0].reply.reserve(replySlots);
 	this->Start();
 }
 
@@ -45,7 +48,10 @@ void FFBoardMainCommandThread::updateSys(){
 	for(CommandInterface* itf : CommandInterface::cmdInterfaces){
 		if(itf->hasNewCommands()){
 			itf->getNewCommands(commands);
+			TimingProbe& probe = TimingProbes::get(TimingProbeId::cmdexec);
+			probe.begin();
 			this->executeCommands(commands, itf);
+			probe.end();
 			commands.clear();
 			if(commands.capacity() > 20)
 				commands.shrink_to_fit();
@@ -85,14 +91,15 @@ void FFBoardMainCommandThread::wakeUp(){
 /**
  * Executes parsed commands and calls other command handlers.
  * Not global so it can be overridden by main classes to change behaviour or suppress outputs.
+ * The result and its reply vector are reused so commands execute without allocating
  */
-void FFBoardMainCommandThread::executeCommands(std::vector<ParsedCommand> commands,CommandInterface* commandInterface){
+void FFBoardMainCommandThread::executeCommands(std::vector<ParsedCommand>& commands,CommandInterface* commandInterface){
 
 	//cpp_freertos::CriticalSection::SuspendScheduler();
+	CommandResult& resultObj = this->results[0];
 	for(ParsedCommand& cmd : commands){
-		this->results.clear();
+		resultObj.reply.clear();
 
-		CommandResult resultObj;
 		CommandStatus status = CommandStatus::NOT_FOUND;
 		CommandHandler* handler = cmd.target;
 
@@ -104,6 +111,7 @@ void FFBoardMainCommandThread::executeCommands(std::vector<ParsedCommand> comman
 			validFlags = static_cast<uint32_t>(cmd.type) & cmdDef->flags; // type uses the same flag values
 		}
 		if(CommandHandler::isInHandlerList(handler)  && validFlags){ // check if pointer is still present in handler list
+			CommandHandler::commandMutex.Lock(); // Other threads may execute commands too
 			// Call internal commands first
 			status = handler->internalCommand(cmd,resultObj.reply,commandInterface);
 
@@ -111,6 +119,7 @@ void FFBoardMainCommandThread::executeCommands(std::vector<ParsedCommand> comman
 			if(status == CommandStatus::NOT_FOUND){
 				status = handler->command(cmd,resultObj.reply);
 			}
+			CommandHandler::commandMutex.Unlock();
 
 		}
 		// If status is not no reply append a reply object. If command was not found the reply vector should be empty but the not found flag set
@@ -119,11 +128,7 @@ void FFBoardMainCommandThread::executeCommands(std::vector<ParsedCommand> comman
 			resultObj.originalCommand = cmd;
 			resultObj.type = status;
 			resultObj.commandHandler = handler;
-			//this->results.push_back(resultObj);
-			// Not found if result is empty
-			this->results.push_back(resultObj);
-		}
-		if(!this->results.empty()){
+
 			for(CommandInterface* itf : CommandInterface::cmdInterfaces){
 				// Block until replies are sent
 				uint32_t remainingTime = 100;
@@ -135,5 +140,11 @@ void FFBoardMainCommandThread::executeCommands(std::vector<ParsedCommand> comman
 			}
 		}
 	}
+	// Release memory of unusually large replies
+	if(resultObj.reply.capacity() > replySlots){
+		resultObj.reply.clear();
+		resultObj.reply.shrink_to_fit();
+		resultObj.reply.reserve(replySlots);
+	}
 	//cpp_freertos::CriticalSection::ResumeScheduler();
 }
@@ -25,13 +25,16 @@ MtEncoderSPI::MtEncoderSPI() : SPIDevice(ext3_spi,ext3_spi.getFreeCsPins()[0]),
 	this->spiConfig.peripheral.CLKPhase = SPI_PHASE_2EDGE;
 	this->spiConfig.peripheral.CLKPolarity = SPI_POLARITY_HIGH;
 	this->spiConfig.cspol = true;
+	this->spiPriority = SPIPriority::critical; // Position is read in the control loop
 	restoreFlash();
 
 	CommandHandler::registerCommands();
 	registerCommand("cs", MtEncoderSPI_commands::cspin, "CS pin",CMDFLAG_GET | CMDFLAG_SET);
+	registerCommand("samplerate", MtEncoderSPI_commands::samplerate, "Background sampling rate in kHz. 0 to read on request",CMDFLAG_GET | CMDFLAG_SET);
 }
 
 MtEncoderSPI::~MtEncoderSPI() {
+	setSampleRate(0);
 	MtEncoderSPI::inUse = false;
 	spiPort.freeCsPin(this->spiConfig.cs);
 }
@@ -40,10 +43,12 @@ void MtEncoderSPI::restoreFlash(){
 	uint16_t conf_int = Flash_Read(ADR_MTENC_CONF1, 0);
 	uint8_t cspin = conf_int & 0xF;
 	setCsPin(cspin);
+	setSampleRate((conf_int >> 4) & 0xF);
 }
 
 void MtEncoderSPI::saveFlash(){
 	uint16_t conf_int = this->cspin & 0xF;
+	conf_int |= (this->sampleRate & 0xF) << 4;
 	Flash_Write(ADR_MTENC_CONF1, conf_int);
 }
 
@@ -57,7 +62,8 @@ void MtEncoderSPI::initSPI(){
 	spiPort.takeSemaphore();
 	spiPort.freeCsPin(this->spiConfig.cs);
 
-	spiPort.configurePort(&this->spiConfig.peripheral);
+	this->spiConfig.updateRegisterImage();
+	spiPort.configurePort(&this->spiConfig);
 	spiPort.giveSemaphore();
 }
 
@@ -88,7 +94,14 @@ void MtEncoderSPI::updateAngleStatus(){
 	uint8_t txbuf[4] = {0x03 | MAGNTEK_READ,0,0,0};
 	uint8_t rxbuf[4] = {0,0,0,0};
 	spiPort.transmitReceive(txbuf, rxbuf, 4, this, 1000);
+	processAngle(rxbuf);
+}
 
+/**
+ * Decodes a burst read of the angle registers and stores it as the latest sample
+ */
+void MtEncoderSPI::processAngle(uint8_t* rxbuf){
+	uint32_t time = micros();
 	uint32_t angle17_10 = rxbuf[1];
 	uint32_t angle9_4 = rxbuf[2];
 	uint32_t angle3_0 = rxbuf[3];
@@ -109,15 +122,98 @@ void MtEncoderSPI::updateAngleStatus(){
 
 	curPos = rotations * getCpr() + curAngleInt;
 	lastAngleInt = curAngleInt;
+
+	// Single writer. Readers retry if the sequence changed while copying
+	sampleSeq++;
+	__DMB();
+	sample.angle = curAngleInt;
+	sample.rotations = rotations;
+	sample.time = time;
+	sample.nomag = nomag;
+	sample.overspeed = overspeed;
+	__DMB();
+	sampleSeq++;
+}
+
+/**
+ * Returns the latest sample without blocking
+ */
+MtEncoderSample MtEncoderSPI::getSample(){
+	MtEncoderSample s;
+	uint32_t seq;
+	do{
+		seq = sampleSeq;
+		__DMB();
+		s = sample;
+		__DMB();
+	}while((seq & 1) || seq != sampleSeq);
+	return s;
+}
+
+/**
+ * Starts or stops timer triggered reads of the angle.
+ * getPos returns the last sample instantly if enabled
+ */
+void MtEncoderSPI::setSampleRate(uint8_t khz){
+	khz = std::min<uint8_t>(khz, 10);
+	HAL_TIM_Base_Stop_IT(timer);
+	this->sampleRate = 0;
+	if(!waitDmaIdle()){
+		return; // Transfer did not finish. Keep sampling off
+	}
+	this->sampleRate = khz;
+	if(khz == 0){
+		return;
+	}
+	updateAngleStatus(); // Valid sample before the first timer update. No transfer can complete concurrently
+	uint32_t timerClock = HAL_RCC_GetPCLK1Freq() * 2; // APB1 timers run at twice the bus clock
+	timer->Instance->PSC = (timerClock / 1000000) - 1;
+	timer->Instance->ARR = (1000 / khz) - 1;
+	timer->Instance->EGR = TIM_EGR_UG; // Load prescaler
+	__HAL_TIM_CLEAR_FLAG(timer, TIM_FLAG_UPDATE);
+	HAL_TIM_Base_Start_IT(timer);
+}
+
+/**
+ * Waits until a transfer started by the timer is finished. Timer must be stopped
+ */
+bool MtEncoderSPI::waitDmaIdle(){
+	uint32_t start = HAL_GetTick();
+	while(dmaPending){
+		if(HAL_GetTick() - start > 10){
+			return false;
+		}
+		vTaskDelay(1);
+	}
+	return true;
+}
+
+void MtEncoderSPI::timerElapsed(TIM_HandleTypeDef* htim){
+	if(htim == timer && sampleRate && !dmaPending){
+		dmaPending = true;
+		spiPort.transmitReceive_DMA(dma_txbuf, dma_rxbuf, 4, this); // Critical priority. Queued if the bus is busy
+	}
+}
+
+void MtEncoderSPI::spiTxRxCompleted(SPIPort* port){
+	processAngle(dma_rxbuf);
+	dmaPending = false;
+}
+
+void MtEncoderSPI::spiRequestError(SPIPort* port){
+	dmaPending = false;
 }
 
 
 int32_t MtEncoderSPI::getPos(){
-	updateAngleStatus();
-	return curPos - offset;
+	return getPosAbs() - offset;
 }
 
 int32_t MtEncoderSPI::getPosAbs(){
+	if(sampleRate){
+		MtEncoderSample s = getSample();
+		return s.rotations * (int32_t)getCpr() + s.angle;
+	}
 	updateAngleStatus();
 	return curPos;
 }
@@ -139,6 +235,18 @@ CommandStatus MtEncoderSPI::command(const ParsedCommand& cmd,std::vector<Command
 			return CommandStatus::ERR;
 		}
 		break;
+	case MtEncoderSPI_commands::samplerate:
+		if(cmd.type==CMDtype::get){
+			replies.push_back(CommandReply(this->sampleRate));
+		}else if(cmd.type==CMDtype::set){
+			if(cmd.val < 0 || cmd.val > 10){
+				return CommandStatus::ERR;
+			}
+			this->setSampleRate(cmd.val);
+		}else{
+			return CommandStatus::ERR;
+		}
+		break;
 	default:
 		return CommandStatus::NOT_FOUND;
 	}
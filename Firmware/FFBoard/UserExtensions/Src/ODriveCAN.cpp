@@ -7,6 +7,7 @@
 #include "target_constants.h"
 #ifdef ODRIVE
 #include <ODriveCAN.h>
+#include "critical.hpp"
 
 bool ODriveCAN1::inUse = false;
 ClassIdentifier ODriveCAN1::info = {
@@ -46,19 +47,7 @@ ODriveCAN::ODriveCAN(uint8_t id)  : CommandHandler("odrv", CLSID_MOT_ODRV0,id),
 	}
 	restoreFlash();
 
-	// Set up a filter to receive odrive commands
-	CAN_FilterTypeDef sFilterConfig;
-	sFilterConfig.FilterBank = 0;
-	sFilterConfig.FilterMode = CAN_FILTERMODE_IDMASK;
-	sFilterConfig.FilterScale = CAN_FILTERSCALE_32BIT;
-	sFilterConfig.FilterIdHigh = 0x0000;
-	sFilterConfig.FilterIdLow = 0x0000;
-	sFilterConfig.FilterMaskIdHigh = 0x0000;
-	sFilterConfig.FilterMaskIdLow = 0x0000;
-	sFilterConfig.FilterFIFOAssignment = CAN_RX_FIFO0;
-	sFilterConfig.FilterActivation = ENABLE;
-	sFilterConfig.SlaveStartFilterBank = 14;
-	this->filterId = this->port->addCanFilter(sFilterConfig);
+	setupCanFilter();
 
 	this->port->setSpeedPreset(baudrate);
 	this->registerCommands();
@@ -67,6 +56,17 @@ ODriveCAN::ODriveCAN(uint8_t id)  : CommandHandler("odrv", CLSID_MOT_ODRV0,id),
 
 ODriveCAN::~ODriveCAN() {
 	this->setTorque(0.0);
+	if(this->filterId >= 0)
+		this->port->removeCanFilter(this->filterId);
+}
+
+/**
+ * Sets up a filter to receive only frames of this odrive node
+ */
+void ODriveCAN::setupCanFilter(){
+	if(this->filterId >= 0)
+		this->port->removeCanFilter(this->filterId);
+	this->filterId = this->port->addCanFilter(CANPort::stdIdFilter(nodeId << 5, 0x3F << 5), this);
 }
 
 void ODriveCAN::registerCommands(){
@@ -79,6 +79,9 @@ void ODriveCAN::registerCommands(){
 	registerCommand("vbus", ODriveCAN_commands::vbus, "ODrive Vbus",CMDFLAG_GET);
 	registerCommand("anticogging", ODriveCAN_commands::anticogging, "Set 1 to start anticogging calibration",CMDFLAG_SET);
 	registerCommand("connected", ODriveCAN_commands::connected, "ODrive connection state",CMDFLAG_GET);
+	registerCommand("posage", ODriveCAN_commands::posage, "Time since last encoder estimate (us)",CMDFLAG_GET);
+	registerCommand("encrate", ODriveCAN_commands::encrate, "Received encoder estimates per second",CMDFLAG_GET);
+	registerCommand("pollinterval", ODriveCAN_commands::pollinterval, "Request estimates if older than this (us). 0 = cyclic only",CMDFLAG_GET | CMDFLAG_SET);
 }
 
 void ODriveCAN::restoreFlash(){
@@ -172,6 +175,14 @@ void ODriveCAN::Run(){
 				state = ODriveLocalState::RUNNING;
 		}
 
+		// Measure the cyclic encoder estimate rate
+		uint32_t ratePeriod = HAL_GetTick() - posRateStart;
+		if(ratePeriod >= 1000){
+			posRate = posFrames * 1000.0 / ratePeriod;
+			posFrames = 0;
+			posRateStart = HAL_GetTick();
+		}
+
 		if(HAL_GetTick() - lastVoltageUpdate > 1000){
 			requestMsg(0x17); // Update voltage
 		}
@@ -210,7 +221,7 @@ Encoder* ODriveCAN::getEncoder(){
  */
 void ODriveCAN::setPos(int32_t pos){
 	// Only change encoder count internally as offset
-	posOffset = lastPos - ((float)pos / (float)getCpr());
+	posOffset = predictedPos() - ((float)pos / (float)getCpr());
 }
 
 
@@ -223,10 +234,51 @@ void ODriveCAN::requestMsg(uint8_t cmd){
 	port->sendMessage(msg);
 }
 
+/**
+ * Returns the position predicted to the current time.
+ * The odrive should send cyclic encoder estimates (axis.config.can.encoder_rate_ms) at the FFB rate.
+ * Estimates are only requested if the stream is slower than pollInterval
+ */
 float ODriveCAN::getPos_f(){
-	if(this->connected)
-		requestMsg(0x09);
-	return lastPos-posOffset;
+	if(this->connected && pollInterval != 0){
+		uint16_t now = micros();
+		if(getPosAge() > pollInterval && (uint16_t)(now - lastPollTime) > pollInterval){
+			lastPollTime = now;
+			requestMsg(0x09);
+		}
+	}
+	return predictedPos()-posOffset;
+}
+
+/**
+ * Extrapolates the last estimate using the velocity reported in the same frame
+ */
+float ODriveCAN::predictedPos(){
+	cpp_freertos::CriticalSection::Enter();
+	float pos = lastPos;
+	float speed = lastSpeed;
+	uint16_t time = lastPosTime;
+	uint32_t tick = lastPosTick;
+	cpp_freertos::CriticalSection::Exit();
+	if(HAL_GetTick() - tick > 50){
+		return pos;
+	}
+	uint16_t age = (uint16_t)micros() - time;
+	if(age > maxPredictionTime){
+		age = maxPredictionTime;
+	}
+	return pos + speed * (age / 1000000.0f);
+}
+
+/**
+ * Time since the last encoder estimate in µs
+ */
+uint32_t ODriveCAN::getPosAge(){
+	uint32_t tickAge = HAL_GetTick() - lastPosTick;
+	if(tickAge > 50){
+		return tickAge * 1000;
+	}
+	return (uint16_t)((uint16_t)micros() - lastPosTime);
 }
 
 bool ODriveCAN::motorReady(){
@@ -242,7 +294,7 @@ uint32_t ODriveCAN::getCpr(){
 }
 void ODriveCAN::setTorque(float torque){
 	if(motorReady())
-		sendMsg<float>(0x0E,torque);
+		sendMsg<float>(0x0E,torque,CANPriority::high); // Torque must never wait behind requests
 }
 
 void ODriveCAN::setMode(ODriveControlMode controlMode,ODriveInputMode inputMode){
@@ -293,7 +345,12 @@ CommandStatus ODriveCAN::command(const ParsedCommand& cmd,std::vector<CommandRep
 		break;
 
 	case ODriveCAN_commands::canid:
-		return handleGetSet(cmd, replies, this->nodeId);
+		if(cmd.type == CMDtype::set){
+			this->nodeId = cmd.val & 0x3F;
+			setupCanFilter();
+		}else{
+			return handleGetSet(cmd, replies, this->nodeId);
+		}
 		break;
 	case ODriveCAN_commands::state:
 		if(cmd.type == CMDtype::get){
@@ -335,6 +392,22 @@ CommandStatus ODriveCAN::command(const ParsedCommand& cmd,std::vector<CommandRep
 			replies.push_back(CommandReply(connected ? 1 : 0));
 		}
 		break;
+	case ODriveCAN_commands::posage:
+		if(cmd.type == CMDtype::get){
+			replies.push_back(CommandReply(getPosAge()));
+		}else{
+			return CommandStatus::ERR;
+		}
+		break;
+	case ODriveCAN_commands::encrate:
+		if(cmd.type == CMDtype::get){
+			replies.push_back(CommandReply((uint32_t)posRate));
+		}else{
+			return CommandStatus::ERR;
+		}
+		break;
+	case ODriveCAN_commands::pollinterval:
+		return handleGetSet(cmd, replies, this->pollInterval);
 
 	default:
 		return CommandStatus::NOT_FOUND;
@@ -379,6 +452,9 @@ void ODriveCAN::canRxPendCallback(CAN_HandleTypeDef *hcan,uint8_t* rxBuf,CAN_RxH
 
 		uint64_t ts = (msg >> 32) & 0xffffffff;
 		memcpy(&lastSpeed,&ts,sizeof(float));
+		lastPosTime = micros();
+		lastPosTick = HAL_GetTick();
+		posFrames++;
 		break;
 	}
 
@@ -63,7 +63,8 @@ SPI_Buttons::SPI_Buttons(uint16_t configuration_address, uint16_t configuration_
 
 void SPI_Buttons::initSPI(){
 	spiPort.takeSemaphore();
-	spiPort.configurePort(&this->spiConfig.peripheral);
+	this->spiConfig.updateRegisterImage();
+	spiPort.configurePort(&this->spiConfig);
 	spiPort.giveSemaphore();
 }
 
@@ -113,7 +114,8 @@ void SPI_Buttons::setConfig(ButtonSourceConfig config){
 		this->spiConfig.peripheral.CLKPolarity = SPI_POLARITY_LOW;
 	}
 	spiPort.takeSemaphore();
-	spiPort.configurePort(&this->spiConfig.peripheral);
+	this->spiConfig.updateRegisterImage();
+	spiPort.configurePort(&this->spiConfig);
 	spiPort.giveSemaphore();
 
 	mask = pow(2,config.numButtons)-1;
@@ -165,10 +167,10 @@ uint8_t SPI_Buttons::readButtons(uint64_t* buf){
 	memcpy(buf,this->spi_buf,std::min<uint8_t>(this->bytes,8));
 	process(buf); // give back last buffer
 
-	if(spiPort.isTaken() || !ready)
-		return this->btnnum;	// Don't wait.
+	if(!ready)
+		return this->btnnum;
 
-	// CS pin and semaphore managed by spi port
+	// Queued by the spi port. Runs when the bus is idle. CS pin and semaphore managed by spi port
 	spiPort.receive_DMA(spi_buf, bytes, this);
 
 	return this->btnnum;
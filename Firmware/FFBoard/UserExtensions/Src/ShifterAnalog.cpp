@@ -268,6 +268,7 @@ ShifterAnalog::G27ShifterButtonClient::G27ShifterButtonClient(OutputPin& csPin)
 	spiConfig.peripheral.FirstBit = SPI_FIRSTBIT_LSB;
 	spiConfig.peripheral.CLKPhase = SPI_PHASE_1EDGE;
 	spiConfig.peripheral.CLKPolarity = SPI_POLARITY_LOW;
+	spiConfig.updateRegisterImage();
 
 }
 
@@ -14,6 +14,8 @@
 #include "RessourceManager.h"
 #include "ErrorHandler.h"
 #include "cpp_target_config.h"
+#include "TimerHandler.h"
+#include "semaphore.hpp"
 #define MAX_TMC_DRIVERS 3
 
 ClassIdentifier TMC_1::info = {
@@ -61,9 +63,11 @@ TMC4671::TMC4671(SPIPort& spiport,OutputPin cspin,uint8_t address) :CommandHandl
 	spiConfig.peripheral.CRCCalculation = SPI_CRCCALCULATION_DISABLE;
 	spiConfig.peripheral.CRCPolynomial = 10;
 	spiConfig.cspol = true;
+	spiPriority = SPIPriority::critical; // Torque and encoder updates
 
 	spiPort.takeSemaphore();
-	spiPort.configurePort(&spiConfig.peripheral);
+	this->spiConfig.updateRegisterImage();
+	spiPort.configurePort(&this->spiConfig);
 	spiPort.giveSemaphore();
 
 	this->restoreFlash();
@@ -85,13 +89,16 @@ const ClassIdentifier TMC4671::getInfo() {
 
 void TMC4671::setAddress(uint8_t address){
 	if (address == 1){
-		this->flashAddrs = TMC4671FlashAddrs({ADR_TMC1_MOTCONF, ADR_TMC1_CPR, ADR_TMC1_ENCA, ADR_TMC1_OFFSETFLUX, ADR_TMC1_TORQUE_P, ADR_TMC1_TORQUE_I, ADR_TMC1_FLUX_P, ADR_TMC1_FLUX_I});
+		this->flashAddrs = TMC4671FlashAddrs({ADR_TMC1_MOTCONF, ADR_TMC1_CPR, ADR_TMC1_ENCA, ADR_TMC1_OFFSETFLUX, ADR_TMC1_TORQUE_P, ADR_TMC1_TORQUE_I, ADR_TMC1_FLUX_P, ADR_TMC1_FLUX_I,
+				ADR_TMC1_ENC_SIG, ADR_TMC1_ADC_I0_OFS, ADR_TMC1_ADC_I1_OFS, ADR_TMC1_ENC_PHIE, ADR_TMC1_AENC0_OFS, ADR_TMC1_AENC0_SCALE, ADR_TMC1_AENC1_OFS, ADR_TMC1_AENC1_SCALE, ADR_TMC1_AENC2_OFS, ADR_TMC1_AENC2_SCALE});
 	}else if (address == 2)
 	{
-		this->flashAddrs = TMC4671FlashAddrs({ADR_TMC2_MOTCONF, ADR_TMC2_CPR, ADR_TMC2_ENCA, ADR_TMC2_OFFSETFLUX, ADR_TMC2_TORQUE_P, ADR_TMC2_TORQUE_I, ADR_TMC2_FLUX_P, ADR_TMC2_FLUX_I});
+		this->flashAddrs = TMC4671FlashAddrs({ADR_TMC2_MOTCONF, ADR_TMC2_CPR, ADR_TMC2_ENCA, ADR_TMC2_OFFSETFLUX, ADR_TMC2_TORQUE_P, ADR_TMC2_TORQUE_I, ADR_TMC2_FLUX_P, ADR_TMC2_FLUX_I,
+				ADR_TMC2_ENC_SIG, ADR_TMC2_ADC_I0_OFS, ADR_TMC2_ADC_I1_OFS, ADR_TMC2_ENC_PHIE, ADR_TMC2_AENC0_OFS, ADR_TMC2_AENC0_SCALE, ADR_TMC2_AENC1_OFS, ADR_TMC2_AENC1_SCALE, ADR_TMC2_AENC2_OFS, ADR_TMC2_AENC2_SCALE});
 	}else if (address == 3)
 	{
-		this->flashAddrs = TMC4671FlashAddrs({ADR_TMC3_MOTCONF, ADR_TMC3_CPR, ADR_TMC3_ENCA, ADR_TMC3_OFFSETFLUX, ADR_TMC3_TORQUE_P, ADR_TMC3_TORQUE_I, ADR_TMC3_FLUX_P, ADR_TMC3_FLUX_I});
+		this->flashAddrs = TMC4671FlashAddrs({ADR_TMC3_MOTCONF, ADR_TMC3_CPR, ADR_TMC3_ENCA, ADR_TMC3_OFFSETFLUX, ADR_TMC3_TORQUE_P, ADR_TMC3_TORQUE_I, ADR_TMC3_FLUX_P, ADR_TMC3_FLUX_I,
+				ADR_TMC3_ENC_SIG, ADR_TMC3_ADC_I0_OFS, ADR_TMC3_ADC_I1_OFS, ADR_TMC3_ENC_PHIE, ADR_TMC3_AENC0_OFS, ADR_TMC3_AENC0_SCALE, ADR_TMC3_AENC1_OFS, ADR_TMC3_AENC1_SCALE, ADR_TMC3_AENC2_OFS, ADR_TMC3_AENC2_SCALE});
 	}
 	//this->setAxis((char)('W'+address));
 }
@@ -112,6 +119,32 @@ void TMC4671::saveFlash(){
 	Flash_Write(flashAddrs.flux_i, curPids.fluxI);
 }
 
+/**
+ * Current loop pids for config profiles
+ */
+uint8_t TMC4671::saveProfile(uint16_t* buf,uint8_t maxLen){
+	if(maxLen < 4){
+		return 0;
+	}
+	buf[0] = curPids.torqueP;
+	buf[1] = curPids.torqueI;
+	buf[2] = curPids.fluxP;
+	buf[3] = curPids.fluxI;
+	return 4;
+}
+
+void TMC4671::loadProfile(const uint16_t* buf,uint8_t len){
+	if(len < 4){
+		return;
+	}
+	TMC4671PIDConf pids = curPids;
+	pids.torqueP = buf[0];
+	pids.torqueI = buf[1];
+	pids.fluxP = buf[2];
+	pids.fluxI = buf[3];
+	setPids(pids);
+}
+
 /**
  * Restores saved parameters
  * Call initialize() to apply some of the settings
@@ -141,6 +174,101 @@ void TMC4671::restoreFlash(){
 	}
 
 	setPids(curPids); // Write pid values to tmc
+	restoreAlignCache();
+}
+
+/**
+ * Hash of the settings the alignment cache depends on
+ */
+uint16_t TMC4671::alignCacheHash(){
+	uint32_t h = TMC4671::encodeMotToInt(this->conf.motconf);
+	h = h * 31 + getEncCpr();
+	h = h * 31 + (uint8_t)this->conf.hwconf.hwVersion;
+	return (h ^ (h >> 12) ^ (h >> 24)) & 0xfff;
+}
+
+/**
+ * Loads the cached encoder alignment and adc offsets if the signature matches the current configuration
+ * Call after the motor and encoder settings are restored
+ */
+void TMC4671::restoreAlignCache(){
+	alignCache = TMC4671AlignCache();
+	uint16_t sig;
+	if(!Flash_Read(flashAddrs.encSig, &sig) || (sig & 0xfff) != alignCacheHash()){
+		return;
+	}
+	uint16_t phiE;
+	if(!Flash_Read(flashAddrs.adcOffset0, &alignCache.adc_I0_offset) || !Flash_Read(flashAddrs.adcOffset1, &alignCache.adc_I1_offset) || !Flash_Read(flashAddrs.encPhiE, &phiE)){
+		return;
+	}
+	alignCache.phiE = phiE;
+
+	EncoderType_TMC enctype = this->conf.motconf.enctype;
+	if(enctype == EncoderType_TMC::abn){
+		this->abnconf.npol = (sig >> 12) & 0x01;
+		this->abnconf.apol = this->abnconf.npol;
+		this->abnconf.bpol = this->abnconf.npol;
+		this->abnconf.rdir = (sig >> 13) & 0x01;
+		alignCache.indexValid = (sig >> 15) & 0x01;
+	}else if(enctype == EncoderType_TMC::sincos || enctype == EncoderType_TMC::uvw){
+		uint16_t val;
+		if(Flash_Read(flashAddrs.aenc0Offset, &val))
+			this->aencconf.AENC0_offset = val;
+		if(Flash_Read(flashAddrs.aenc0Scale, &val))
+			this->aencconf.AENC0_scale = val;
+		if(Flash_Read(flashAddrs.aenc1Offset, &val))
+			this->aencconf.AENC1_offset = val;
+		if(Flash_Read(flashAddrs.aenc1Scale, &val))
+			this->aencconf.AENC1_scale = val;
+		if(Flash_Read(flashAddrs.aenc2Offset, &val))
+			this->aencconf.AENC2_offset = val;
+		if(Flash_Read(flashAddrs.aenc2Scale, &val))
+			this->aencconf.AENC2_scale = val;
+		this->aencconf.rdir = (sig >> 14) & 0x01;
+	}else{
+		return;
+	}
+	alignCache.valid = true;
+}
+
+/**
+ * Stores the current encoder alignment and adc offsets.
+ * The signature is written last so an interrupted save never validates partial data
+ */
+void TMC4671::saveAlignCache(){
+	EncoderType_TMC enctype = this->conf.motconf.enctype;
+	uint16_t sig = alignCacheHash();
+	if(enctype == EncoderType_TMC::abn){
+		sig |= (this->abnconf.npol & 0x01) << 12;
+		sig |= (this->abnconf.rdir & 0x01) << 13;
+		sig |= (alignCache.indexValid & 0x01) << 15;
+	}else if(enctype == EncoderType_TMC::sincos || enctype == EncoderType_TMC::uvw){
+		alignCache.phiE = readReg(0x45) >> 16;
+		sig |= (this->aencconf.rdir & 0x01) << 14;
+		Flash_Write(flashAddrs.aenc0Offset, this->aencconf.AENC0_offset);
+		Flash_Write(flashAddrs.aenc0Scale, this->aencconf.AENC0_scale);
+		Flash_Write(flashAddrs.aenc1Offset, this->aencconf.AENC1_offset);
+		Flash_Write(flashAddrs.aenc1Scale, this->aencconf.AENC1_scale);
+		Flash_Write(flashAddrs.aenc2Offset, this->aencconf.AENC2_offset);
+		Flash_Write(flashAddrs.aenc2Scale, this->aencconf.AENC2_scale);
+	}else{
+		return;
+	}
+	alignCache.adc_I0_offset = conf.adc_I0_offset;
+	alignCache.adc_I1_offset = conf.adc_I1_offset;
+	Flash_Write(flashAddrs.adcOffset0, alignCache.adc_I0_offset);
+	Flash_Write(flashAddrs.adcOffset1, alignCache.adc_I1_offset);
+	Flash_Write(flashAddrs.encPhiE, (uint16_t)alignCache.phiE);
+	Flash_Write(flashAddrs.encSig, sig);
+	alignCache.valid = true;
+}
+
+/**
+ * Forces a full calibration on the next encoder init
+ */
+void TMC4671::invalidateAlignCache(){
+	alignCache.valid = false;
+	alignCache.indexValid = false;
 }
 
 bool TMC4671::hasPower(){
@@ -192,7 +320,8 @@ bool TMC4671::initialize(){
 		// Initialize TMC6100 according to https://www.trinamic.com/fileadmin/assets/Products/Eval_Documents/TMC4671_TMC6100-BOB_v1.00.pdf
 
 		this->spiConfig.peripheral.BaudRatePrescaler = SPI_BAUDRATEPRESCALER_64;
-		spiPort.configurePort(&this->spiConfig.peripheral);
+		this->spiConfig.updateRegisterImage();
+		spiPort.configurePort(&this->spiConfig);
 
 		OutputPin t1 = spiConfig.cs;
 		OutputPin t3 = OutputPin(*SPI1_SS3_GPIO_Port, SPI1_SS3_Pin);
@@ -232,7 +361,8 @@ bool TMC4671::initialize(){
 		pulseClipLed();
 
 		this->spiConfig.peripheral.BaudRatePrescaler = SPI_BAUDRATEPRESCALER_64;
-		spiPort.configurePort(&this->spiConfig.peripheral);
+		this->spiConfig.updateRegisterImage();
+		spiPort.configurePort(&this->spiConfig);
 		oldTMCdetected = true;
 	}
 
@@ -252,12 +382,15 @@ bool TMC4671::initialize(){
 	setAdcOffset(conf.adc_I0_offset, conf.adc_I1_offset);
 	setAdcScale(conf.adc_I0_scale, conf.adc_I1_scale);
 
-	// Initial adc calibration
-	if(!calibrateAdcOffset(150)){
+	// Initial adc calibration. Only a short check if cached offsets are available
+	if(!calibrateAdcOffset(alignCache.valid ? 20 : 150)){
 		changeState(TMC_ControlState::HardError); // ADC or shunt amp is broken!
 		enablePin.reset();
 		return false;
 	}
+	if(alignCache.valid && (abs((int32_t)conf.adc_I0_offset - alignCache.adc_I0_offset) > adcCacheTolerance || abs((int32_t)conf.adc_I1_offset - alignCache.adc_I1_offset) > adcCacheTolerance)){
+		invalidateAlignCache(); // Hardware changed. Recalibrate everything
+	}
 	// brake res failsafe.
 //	/*
 //	 * Single ended input raw value
@@ -286,7 +419,7 @@ bool TMC4671::initialize(){
 	if(hasPower()){
 		enablePin.set();
 		setPwm(7);
-		calibrateAdcOffset(400); // Calibrate ADC again with power
+		calibrateAdcOffset(alignCache.valid ? 50 : 400); // Calibrate ADC again with power
 		active = true;
 	}
 	setEncoderType(conf.motconf.enctype);
@@ -332,39 +465,28 @@ bool TMC4671::motorReady(){
 }
 
 void TMC4671::Run(){
-	// Main state machine
+	powerState = hasPower();
+	supervisorStarted = true;
+	// Main state machine. Woken up by events or after a state dependent timeout
 	while(1){
+		uint32_t events = 0;
+		xTaskNotifyWait(0, 0xffffffff, &events, supervisorTimeout());
+
+		if(events & TMC_EVT_FLAG){
+			statusCheck(); // Status pin interrupt
+			statCheckInterval = statCheckIntervalMin; // Something happened. Check more often for a while
+		}else if(flagCheckInProgress){ // cause some delay until reenabling the status interrupt checking
+			setStatusFlags(0);
+			flagCheckInProgress = false;
+		}
 
 		switch(this->state){
 
 		case TMC_ControlState::Running:
-		{
 			// Check status, Temps, Everything alright?
-			uint32_t tick = HAL_GetTick();
-			if(tick - lastStatTime > 2000){ // Every 2s
-				lastStatTime = tick;
-				statusCheck();
-				// Get enable input. If tmc does not reply the result will read 0 or 0xffffffff (not possible normally)
-				uint32_t pins = readReg(0x76);
-				bool tmc_en = ((pins >> 15) & 0x01) && pins != 0xffffffff;
-				if(!tmc_en && active){ // Hardware emergency.
-					this->estopTriggered = true;
-					this->emergencyStop();
-					changeState(TMC_ControlState::HardError);
-				}
-
-				// Temperature sense
-				if(conf.hwconf.temperatureEnabled){
-					float temp = getTemp();
-					if(temp > conf.hwconf.temp_limit){
-						changeState(TMC_ControlState::OverTemp);
-						pulseErrLed();
-					}
-				}
-
+			if(HAL_GetTick() - lastStatTime >= statCheckInterval){
+				backgroundCheck();
 			}
-			Delay(200);
-		}
 		break;
 
 		case TMC_ControlState::Init_wait:
@@ -391,6 +513,20 @@ void TMC4671::Run(){
 
 		break; // Broken
 
+		case TMC_ControlState::PidAutotune:
+		{
+			bool tuned = autotuneCurrentPI(autotuneBandwidth);
+			if(tuned){
+				std::string reply = "R=" + std::to_string((int32_t)(motorIdent.resistance * 1000.0)) + "mOhm L=" + std::to_string((int32_t)(motorIdent.inductance * 1000000.0)) + "uH";
+				reply += " P=" + std::to_string(curPids.torqueP) + " I=" + std::to_string(curPids.torqueI);
+				CommandHandler::broadcastCommandReply(CommandReply(reply,1), (uint32_t)TMC4671_commands::pidautotune, CMDtype::get);
+			}else{
+				CommandHandler::broadcastCommandReply(CommandReply("Identification failed",0), (uint32_t)TMC4671_commands::pidautotune, CMDtype::get);
+			}
+			changeState(laststate); // Return to previous state
+		}
+		break;
+
 		case TMC_ControlState::OverTemp:
 			this->stopMotor();
 			changeState(TMC_ControlState::HardError); // Block
@@ -403,7 +539,9 @@ void TMC4671::Run(){
 				changeState(TMC_ControlState::Running);
 			}else{
 				stopMotor();
-				laststate = TMC_ControlState::Running; // Go to running when starting again
+				setMotionMode(MotionMode::stop,true);
+				changeState(TMC_ControlState::Shutdown); // Idle until started. startMotor goes to running from here
+				laststate = TMC_ControlState::Running;
 			}
 		break;
 
@@ -415,7 +553,6 @@ void TMC4671::Run(){
 				enablePin.set();
 			}
 			pulseErrLed();
-			Delay(100); // wait a bit more
 		break;
 
 		default:
@@ -434,14 +571,98 @@ void TMC4671::Run(){
 			enablePin.reset();
 		}
 
-		if(flagCheckInProgress){ // cause some delay until reenabling the status interrupt checking
-			setStatusFlags(0);
-			flagCheckInProgress = false;
+		if(indexCachePending){ // Store the electrical angle at the index for the next startup
+			indexCachePending = false;
+			int32_t countN = readReg(0x28);
+			alignCache.phiE = abnCountToPhiE(countN) + (int16_t)(readReg(0x29) >> 16);
+			alignCache.indexValid = true;
+			saveAlignCache();
 		}
-		Delay(10);
+
 	} // End while
 }
 
+/*
+ * Time until the state machine must run again if no event arrives
+ */
+uint32_t TMC4671::supervisorTimeout(){
+	if(flagCheckInProgress){
+		return 10; // Retry clearing the flags shortly
+	}
+	switch(this->state){
+	case TMC_ControlState::Running:
+	{
+		uint32_t elapsed = HAL_GetTick() - lastStatTime;
+		return elapsed >= statCheckInterval ? 0 : statCheckInterval - elapsed;
+	}
+	case TMC_ControlState::Init_wait:
+	case TMC_ControlState::No_power:
+		return 100;
+
+	case TMC_ControlState::ABN_init:
+	case TMC_ControlState::AENC_init:
+	case TMC_ControlState::PidAutotune:
+	case TMC_ControlState::OverTemp:
+	case TMC_ControlState::EncoderFinished:
+		return 0; // Continue immediately
+
+	default:
+		return statCheckIntervalMax; // Idle. Only events can change something here
+	}
+}
+
+/*
+ * Checks enable pin and temperature while running.
+ * Interval doubles each time nothing was found until statCheckIntervalMax is reached.
+ */
+void TMC4671::backgroundCheck(){
+	lastStatTime = HAL_GetTick();
+	bool fault = false;
+	if(!flagCheckInProgress){
+		statusCheck(); // In case a flag interrupt was missed
+	}
+	// Get enable input. If tmc does not reply the result will read 0 or 0xffffffff (not possible normally)
+	uint32_t pins = readReg(0x76);
+	bool tmc_en = ((pins >> 15) & 0x01) && pins != 0xffffffff;
+	if(!tmc_en && active){ // Hardware emergency.
+		this->estopTriggered = true;
+		this->emergencyStop();
+		changeState(TMC_ControlState::HardError);
+		fault = true;
+	}
+
+	// Temperature sense
+	if(conf.hwconf.temperatureEnabled){
+		float temp = getTemp();
+		if(temp > conf.hwconf.temp_limit){
+			changeState(TMC_ControlState::OverTemp);
+			pulseErrLed();
+			fault = true;
+		}
+	}
+
+	if(fault){
+		statCheckInterval = statCheckIntervalMin;
+	}else{
+		statCheckInterval = std::min<uint32_t>(statCheckInterval * 2, statCheckIntervalMax);
+	}
+}
+
+/*
+ * Wakes up the state machine thread. Can be called from isr
+ */
+void TMC4671::notifySupervisor(uint32_t events){
+	if(!supervisorStarted) // Thread not running yet. Handle invalid
+		return;
+	if(inIsr()){
+		BaseType_t taskWoken = 0;
+		xTaskNotifyFromISR(this->GetHandle(), events, eSetBits, &taskWoken);
+		portYIELD_FROM_ISR(taskWoken);
+	}else{
+		xTaskNotify(this->GetHandle(), events, eSetBits);
+	}
+}
+
 /*
  * Returns the current state of the driver controller
  */
@@ -449,11 +670,12 @@ TMC_ControlState TMC4671::getState(){
 	return this->state;
 }
 
-inline void TMC4671::changeState(TMC_ControlState newState){
+void TMC4671::changeState(TMC_ControlState newState){
 	if(newState != this->state){
 		this->laststate = this->state; // save last state if new state wants to jump back
+		this->state = newState;
+		notifySupervisor(TMC_EVT_STATE); // Process new state without waiting for a timeout
 	}
-	this->state = newState;
 }
 
 bool TMC4671::reachedPosition(uint16_t tolerance){
@@ -809,6 +1031,66 @@ bool TMC4671::checkEncoder(){
 	return result;
 }
 
+/**
+ * Rotates the motor slowly in open loop until the ABN index pulse is detected.
+ * Needs at most one mechanical rotation
+ */
+bool TMC4671::findEncoderIndex(){
+	if(this->conf.motconf.motor_type != MotorType::STEPPER && this->conf.motconf.motor_type != MotorType::BLDC){
+		return false;
+	}
+	blinkClipLed(100, 0);
+	PhiE lastphie = getPhiEtype();
+	MotionMode lastmode = getMotionMode();
+	setFluxTorque(0, 0);
+	runOpenLoop(0, 0, 30 * this->conf.motconf.pole_pairs, 100, true); // ~30 rpm mechanical
+	for(int16_t flux = 0; flux <= bangInitPower; flux+=20){
+		setFluxTorque(flux, 0);
+		Delay(2);
+	}
+	setStatusFlags(0); // Clear old index flags
+
+	bool found = false;
+	uint32_t tick = HAL_GetTick();
+	while(HAL_GetTick() - tick < 4000){
+		if(readFlags(false).flags.ENC_N){
+			found = true;
+			break;
+		}
+		Delay(1);
+	}
+
+	runOpenLoop(0, 0, 0, 1000, true);
+	setFluxTorque(0, 0);
+	setPhiEtype(lastphie);
+	setMotionMode(lastmode,true);
+	blinkClipLed(0, 0);
+	return found;
+}
+
+/**
+ * Converts an ABN count to the electrical angle the TMC calculates without offset
+ */
+int16_t TMC4671::abnCountToPhiE(int32_t count){
+	return (int16_t)(((int64_t)count * 0x10000 * this->conf.motconf.pole_pairs) / std::max<uint32_t>(1,abnconf.cpr));
+}
+
+/**
+ * Checks if the analog encoder signals match the cached offsets and amplitudes
+ */
+bool TMC4671::checkAencSignal(){
+	writeReg(0x03,2);
+	int32_t aencUX = (int32_t)(readReg(0x02)>>16) - this->aencconf.AENC0_offset;
+	writeReg(0x03,3);
+	int32_t aencWY = (int32_t)(readReg(0x02)>>16) - this->aencconf.AENC2_offset;
+
+	// Scale was calculated from the peak to peak amplitude during calibration
+	float amp0 = (0xF6FF00 / std::max<int32_t>(1,this->aencconf.AENC0_scale)) / 2.0;
+	float amp2 = (0xF6FF00 / std::max<int32_t>(1,this->aencconf.AENC2_scale)) / 2.0;
+	float r = sqrtf((aencUX*aencUX)/(amp0*amp0) + (aencWY*aencWY)/(amp2*amp2));
+	return r > 0.5 && r < 1.5;
+}
+
 void TMC4671::setup_ABN_Enc(TMC4671ABNConf encconf){
 	this->abnconf = encconf;
 
@@ -944,12 +1226,31 @@ void TMC4671::ABN_init(){
 					CommandHandler::broadcastCommandReply(CommandReply("DC motors don't support alignment",0), (uint32_t)TMC4671_commands::encalign, CMDtype::get);
 					//CommandHandler::sendSerial(this->getCommandHandlerInfo()->clsname,"encalign?","DC motors don't support alignment",this->getCommandHandlerInfo()->instance);
 				}
+			}else if(alignCache.valid && alignCache.indexValid){
+				setup_ABN_Enc(this->abnconf); // Polarity and direction from cache
+				encstate = ENC_InitState::indexSearch;
 			}else{
 				encstate = ENC_InitState::estimating;
 			}
 
 		break;
 
+		case ENC_InitState::indexSearch:
+			if(!hasPower())
+				break;
+			if(findEncoderIndex()){
+				// Restore the offset from the cached electrical angle at the index
+				int32_t countN = readReg(0x28);
+				this->abnconf.phiEoffset = alignCache.phiE - abnCountToPhiE(countN);
+				updateReg(0x29, (uint16_t)this->abnconf.phiEoffset, 0xffff, 16);
+				setPhiEtype(PhiE::abn);
+				encstate = ENC_InitState::OK;
+			}else{
+				invalidateAlignCache();
+				encstate = ENC_InitState::estimating;
+			}
+		break;
+
 		case ENC_InitState::estimating:
 		{
 			if(!hasPower())
@@ -981,6 +1282,8 @@ void TMC4671::ABN_init(){
 				encstate = ENC_InitState::OK;
 				setPhiEtype(PhiE::abn);
 				enc_retry = 0;
+				alignCache.indexValid = false; // Angle at index is stored when the index is hit next time
+				saveAlignCache();
 				if(manualEncAlign){
 					manualEncAlign = false;
 					CommandHandler::broadcastCommandReply(CommandReply("Aligned successfully",1), (uint32_t)TMC4671_commands::encalign, CMDtype::get);
@@ -1018,7 +1321,14 @@ void TMC4671::AENC_init(){
 			setPosSel(PosSelection::PhiM_aenc);
 			setPos(0);
 			setup_AENC(this->aencconf);
-			encstate = ENC_InitState::estimating;
+			// Cache is only usable if the encoder is absolute within an electrical period
+			if(alignCache.valid && (this->conf.motconf.pole_pairs % std::max<uint32_t>(1,this->aencconf.cpr)) == 0 && checkAencSignal()){
+				updateReg(0x45, (uint16_t)alignCache.phiE, 0xffff, 16);
+				setPhiEtype(PhiE::aenc);
+				encstate = ENC_InitState::OK;
+			}else{
+				encstate = ENC_InitState::estimating;
+			}
 		break;
 
 		case ENC_InitState::estimating:
@@ -1040,6 +1350,7 @@ void TMC4671::AENC_init(){
 				encstate =ENC_InitState::OK;
 				setPhiEtype(PhiE::aenc);
 				enc_retry = 0;
+				saveAlignCache();
 				if(manualEncAlign){
 					manualEncAlign = false;
 					CommandHandler::broadcastCommandReply(CommandReply("Aligned successfully",1), (uint32_t)TMC4671_commands::encalign, CMDtype::get);
@@ -1626,6 +1937,206 @@ void TMC4671::estimateABNparams(){
 
 
 
+/**
+ * Identifies the electrical parameters of the motor by applying a pseudo random binary sequence
+ * to the d axis voltage with a locked rotor and fitting a first order model to the measured flux current.
+ * Model: i[k+1] = a*i[k] + b*u[k]
+ * Blocks for about a second. Motor must be a stepper or BLDC.
+ * @param amplitude PRBS amplitude in Ud counts around the alignment voltage
+ */
+/**
+ * Paces the identification samples with the user timer so the thread blocks between samples.
+ * Fails if the timer is already used by the mainclass
+ */
+class TMC4671SampleTimer : public TimerHandler {
+public:
+	TMC4671SampleTimer(uint16_t period_us){
+		extern TIM_HandleTypeDef TIM_USER;
+		timer = &TIM_USER;
+		if(timer->Instance->CR1 & TIM_CR1_CEN){
+			return;
+		}
+		lastPsc = timer->Instance->PSC;
+		lastArr = timer->Instance->ARR;
+		timer->Instance->PSC = (SystemCoreClock / 1000000)-1;
+		timer->Instance->ARR = period_us-1;
+		timer->Instance->EGR = TIM_EGR_UG; // Load prescaler
+		__HAL_TIM_CLEAR_FLAG(timer, TIM_FLAG_UPDATE);
+		started = HAL_TIM_Base_Start_IT(timer) == HAL_OK;
+	}
+	~TMC4671SampleTimer(){
+		if(started){
+			HAL_TIM_Base_Stop_IT(timer);
+			timer->Instance->PSC = lastPsc;
+			timer->Instance->ARR = lastArr;
+		}
+	}
+	void timerElapsed(TIM_HandleTypeDef* htim){
+		if(htim == timer && started){
+			BaseType_t taskWoken = 0;
+			sem.GiveFromISR(&taskWoken);
+			portYIELD_FROM_ISR(taskWoken);
+		}
+	}
+	bool wait(){
+		return started && sem.Take(2);
+	}
+	bool started = false;
+private:
+	TIM_HandleTypeDef* timer;
+	uint32_t lastPsc = 0;
+	uint32_t lastArr = 0;
+	cpp_freertos::BinarySemaphore sem;
+};
+
+bool TMC4671::identifyCurrentLoop(TMC4671MotorIdent& ident,int16_t amplitude){
+	ident.valid = false;
+	if(!hasPower() || (this->conf.motconf.motor_type != MotorType::STEPPER && this->conf.motconf.motor_type != MotorType::BLDC)){
+		return false;
+	}
+	blinkClipLed(50, 0);
+	PhiE lastphie = getPhiEtype();
+	MotionMode lastmode = getMotionMode();
+
+	const uint16_t sampleTime = 100; // us
+	const uint16_t samples = 2032; // 16 periods of the 7 bit PRBS
+	const uint8_t prbsDiv = 2; // Samples per PRBS bit
+	const int16_t currentLimit = std::max<int16_t>(bangInitPower,10000); // Abort if exceeded
+	const int16_t offset = amplitude; // Bias keeps the rotor aligned to phiE 0
+
+	// Align rotor with a constant d voltage
+	setPhiE_ext(0);
+	setPhiEtype(PhiE::ext);
+	setUdUq(0, 0);
+	setMotionMode(MotionMode::uqudext,true);
+	for(int16_t ud = 0; ud <= offset; ud+=10){
+		setUdUq(ud, 0);
+		Delay(1);
+	}
+	Delay(200);
+
+	// Least squares sums
+	double s_i = 0, s_u = 0, s_i1 = 0;
+	double s_ii = 0, s_iu = 0, s_uu = 0, s_ii1 = 0, s_ui1 = 0;
+	uint32_t n = 0;
+	bool overcurrent = false;
+
+	uint8_t lfsr = 0x7f;
+	int16_t u = offset;
+	TMC4671SampleTimer sampleTimer(sampleTime);
+	int16_t i = (int16_t)(readReg(0x69) & 0xffff);
+	uint32_t elapsed = 0;
+	bool timeout = !sampleTimer.started;
+	sampleTimer.wait(); // Synchronize to the timer
+	uint16_t lastTime = micros();
+	for(uint16_t k = 0; k < samples && !timeout; k++){
+		if(k % prbsDiv == 0){
+			// x^7 + x^6 + 1
+			uint8_t bit = ((lfsr >> 6) ^ (lfsr >> 5)) & 0x01;
+			lfsr = ((lfsr << 1) | bit) & 0x7f;
+			u = offset + ((lfsr & 0x01) ? amplitude : -amplitude);
+		}
+		setUdUq(u, 0);
+		if(!sampleTimer.wait()){ // Blocks until the next sample is due
+			timeout = true;
+			break;
+		}
+		elapsed += (uint16_t)((uint16_t)micros() - lastTime);
+		lastTime = micros();
+		int16_t i1 = (int16_t)(readReg(0x69) & 0xffff);
+		if(abs(i1) > currentLimit){
+			overcurrent = true;
+			break;
+		}
+		s_i += i;		s_u += u;		s_i1 += i1;
+		s_ii += (double)i*i;	s_iu += (double)i*u;	s_uu += (double)u*u;
+		s_ii1 += (double)i*i1;	s_ui1 += (double)u*i1;
+		n++;
+		i = i1;
+	}
+
+	// Ramp down and restore
+	for(int16_t ud = offset; ud > 0; ud-=10){
+		setUdUq(ud, 0);
+		Delay(1);
+	}
+	setUdUq(0, 0);
+	setPhiE_ext(0);
+	setPhiEtype(lastphie);
+	setMotionMode(lastmode,true);
+	blinkClipLed(0, 0);
+
+	if(overcurrent || timeout || n < samples / 2){
+		return false;
+	}
+
+	// Center to remove the bias and adc offset
+	double cii = s_ii - s_i*s_i/n;
+	double ciu = s_iu - s_i*s_u/n;
+	double cuu = s_uu - s_u*s_u/n;
+	double cii1 = s_ii1 - s_i*s_i1/n;
+	double cui1 = s_ui1 - s_u*s_i1/n;
+	double det = cii*cuu - ciu*ciu;
+	if(det <= 0){
+		return false;
+	}
+	ident.a = (cii1*cuu - cui1*ciu) / det;
+	ident.b = (cui1*cii - cii1*ciu) / det;
+	ident.ts = (float)elapsed / (n * 1000000.0);
+	if(ident.a <= 0 || ident.a >= 1 || ident.b <= 0){
+		return false; // Not a stable first order response
+	}
+	ident.tau = -ident.ts / log(ident.a);
+
+	// Ud full scale equals half the supply voltage per phase
+	float kdc = ident.b / (1.0 - ident.a); // current counts per voltage count
+	float voltsPerCount = (getExtV() / 1000.0) / (2.0 * 0x7fff);
+	if(conf.hwconf.currentScaler > 0){
+		ident.resistance = voltsPerCount / (kdc * conf.hwconf.currentScaler);
+		ident.inductance = ident.resistance * ident.tau;
+	}
+	ident.valid = true;
+	return true;
+}
+
+/**
+ * Calculates PI gains that cancel the motor pole and place the crossover at the target bandwidth
+ * The integrator is updated at the pwm frequency and scaled by 1/256 twice
+ * @param bandwidth target bandwidth in Hz
+ */
+TMC4671PIDConf TMC4671::calculateCurrentPI(const TMC4671MotorIdent& ident,uint16_t bandwidth){
+	TMC4671PIDConf pids = curPids;
+	float wc = 2.0 * M_PI * bandwidth;
+	float kdc = ident.b / (1.0 - ident.a);
+	float kp = wc * ident.tau / kdc; // voltage counts per current count
+	float ki = kp / ident.tau; // per second
+	float fpwm = 100000000.0 / (conf.pwmcnt + 1);
+
+	float pScale = pidPrecision.current_P ? 4096 : 256; // Q4.12 or Q8.8
+	float iScale = pidPrecision.current_I ? 4096 : 256;
+	uint16_t p = clip<int32_t,int32_t>(kp * pScale, 1, 0x7fff);
+	uint16_t i = clip<int32_t,int32_t>(ki / fpwm * iScale * 256, 1, 0x7fff);
+	pids.fluxP = p;
+	pids.torqueP = p;
+	pids.fluxI = i;
+	pids.torqueI = i;
+	return pids;
+}
+
+/**
+ * Identifies the motor and applies new flux and torque PI gains for the requested bandwidth
+ * Keeps the previous gains if the identification fails
+ */
+bool TMC4671::autotuneCurrentPI(uint16_t bandwidth){
+	if(!identifyCurrentLoop(motorIdent,autotuneVoltage)){
+		return false;
+	}
+	setPids(calculateCurrentPI(motorIdent,bandwidth));
+	return true;
+}
+
+
+
 /**
  * Sets pwm mode: \n
  * 0 = pwm off \n
@@ -1717,7 +2228,7 @@ void TMC4671::updateReg(uint8_t reg,uint32_t dat,uint32_t mask,uint8_t shift){
 	writeReg(reg, t);
 }
 
-void TMC4671::beginSpiTransfer(SPIPort* port){
+void TMC4671::beginSpiTransfer(SPIPort* port,bool busOwned){
 	assertChipSelect();
 }
 void TMC4671::endSpiTransfer(SPIPort* port){
@@ -1780,13 +2291,29 @@ void TMC4671::statusCheck(){
 
 void TMC4671::exti(uint16_t GPIO_Pin){
 	if(GPIO_Pin == FLAG_Pin && !flagCheckInProgress){ // Flag pin went high and flag check is currently not in progress (prevents interrupt flooding)
-		statusCheck(); // In isr!
+		notifySupervisor(TMC_EVT_FLAG); // Flags are read in the thread. No spi transfers in the isr
+	}
+}
+
+/*
+ * Watches the supply voltage on each conversion and only wakes the thread if the power state changes
+ */
+void TMC4671::adcUpd(volatile uint32_t* ADC_BUF, uint8_t chans, ADC_HandleTypeDef* hadc){
+	if(hadc != &VSENSE_HADC)
+		return;
+	bool power = hasPower();
+	if(power != powerState){
+		powerState = power;
+		notifySupervisor(TMC_EVT_POWER);
 	}
 }
 
 void TMC4671::encoderIndexHit(){
 	//pulseClipLed();
 	setEncoderIndexFlagEnabled(false); // Found the index. disable flag
+	if(this->conf.motconf.enctype == EncoderType_TMC::abn && encstate == ENC_InitState::OK && !alignCache.indexValid){
+		indexCachePending = true; // Store in thread. May be called from isr
+	}
 }
 
 TMC4671MotConf TMC4671::decodeMotFromInt(uint16_t val){
@@ -2003,6 +2530,8 @@ void TMC4671::registerCommands(){
 	registerCommand("encdir", TMC4671_commands::encdir, "Encoder dir",CMDFLAG_DEBUG | CMDFLAG_GET | CMDFLAG_SET);
 	registerCommand("temp", TMC4671_commands::temp, "Temperature in C * 100",CMDFLAG_GET);
 	registerCommand("reg", TMC4671_commands::reg, "Read or write a TMC register at adr",CMDFLAG_DEBUG | CMDFLAG_GETADR | CMDFLAG_SETADR);
+	registerCommand("encCache", TMC4671_commands::encCache, "Cached encoder alignment. bit0=valid bit1=index known. Set 0 to clear",CMDFLAG_GET | CMDFLAG_SET);
+	registerCommand("pidautotune", TMC4671_commands::pidautotune, "Identify motor and tune current PI. Set bandwidth in Hz to start. Get last bandwidth",CMDFLAG_GET | CMDFLAG_SET);
 
 }
 
@@ -2052,6 +2581,7 @@ CommandStatus TMC4671::command(const ParsedCommand& cmd,std::vector<CommandReply
 
 	case TMC4671_commands::encalign:
 		if(cmd.type == CMDtype::get){
+			invalidateAlignCache(); // Force full alignment
 			encstate = ENC_InitState::uninitialized;
 			this->setEncoderType(this->conf.motconf.enctype);
 			manualEncAlign = true;
@@ -2194,6 +2724,34 @@ CommandStatus TMC4671::command(const ParsedCommand& cmd,std::vector<CommandReply
 		}
 		break;
 
+	case TMC4671_commands::encCache:
+		if(cmd.type == CMDtype::get){
+			replies.push_back(CommandReply(alignCache.valid | (alignCache.indexValid << 1)));
+		}else if(cmd.type == CMDtype::set && cmd.val == 0){
+			invalidateAlignCache();
+			Flash_Write(flashAddrs.encSig, (~alignCacheHash()) & 0xfff); // Never matches
+		}else{
+			return CommandStatus::ERR;
+		}
+		break;
+
+	case TMC4671_commands::pidautotune:
+		if(cmd.type == CMDtype::get){
+			replies.push_back(CommandReply(autotuneBandwidth));
+		}else if(cmd.type == CMDtype::set){
+			// Moves the motor. Only allowed while stopped with an aligned encoder
+			if(cmd.val <= 0 || !initialized || !hasPower() || encstate != ENC_InitState::OK
+					|| state != TMC_ControlState::Shutdown){
+				return CommandStatus::ERR;
+			}
+			autotuneBandwidth = cmd.val;
+			changeState(TMC_ControlState::PidAutotune);
+			return CommandStatus::NO_REPLY; // Result is broadcast when done
+		}else{
+			return CommandStatus::ERR;
+		}
+		break;
+
 	default:
 		return CommandStatus::NOT_FOUND;
 	}
@@ -8,6 +8,7 @@
 #ifdef VESC
 #include <VescCAN.h>
 #include "ClassIDs.h"
+#include "critical.hpp"
 
 // *****    static initializer for the VESC_1 instance (extend VESC_CAN) *****
 
@@ -44,19 +45,7 @@ VescCAN::VescCAN(uint8_t address) :
 	setAddress(address);
 	restoreFlash();
 
-	// Set up a filter to receive vesc commands
-	CAN_FilterTypeDef sFilterConfig;
-	sFilterConfig.FilterBank = 0;
-	sFilterConfig.FilterMode = CAN_FILTERMODE_IDMASK;
-	sFilterConfig.FilterScale = CAN_FILTERSCALE_32BIT;
-	sFilterConfig.FilterIdHigh = 0x0000;
-	sFilterConfig.FilterIdLow = 0x0000;
-	sFilterConfig.FilterMaskIdHigh = 0x0000;
-	sFilterConfig.FilterMaskIdLow = 0x0000;
-	sFilterConfig.FilterFIFOAssignment = CAN_RX_FIFO0;
-	sFilterConfig.FilterActivation = ENABLE;
-	sFilterConfig.SlaveStartFilterBank = 14;
-	this->filterId = this->port->addCanFilter(sFilterConfig);
+	setupCanFilter();
 
 	this->setCanRate(this->baudrate);
 
@@ -68,6 +57,30 @@ VescCAN::VescCAN(uint8_t address) :
 VescCAN::~VescCAN() {
 	this->stopMotor();
 	this->state = VescState::VESC_STATE_UNKNOWN;
+	for(int32_t& id : filterIds){
+		if(id >= 0)
+			this->port->removeCanFilter(id);
+	}
+}
+
+/**
+ * Sets up filters to receive only frames addressed to this axis and position broadcasts of the vesc.
+ * STATUS_4 frames are only accepted from a configured vesc id as every vesc on the bus broadcasts them
+ */
+void VescCAN::setupCanFilter(){
+	for(int32_t& id : filterIds){
+		if(id >= 0)
+			this->port->removeCanFilter(id);
+		id = -1;
+	}
+	filterIds[0] = this->port->addCanFilter(CANPort::extIdFilter(this->OFFB_can_Id, 0xFF), this);
+	uint32_t rotorPosId = ((uint32_t)VescCANMsg::CAN_PACKET_POLL_ROTOR_POS << 8) | this->VESC_can_Id;
+	uint32_t rotorPosMask = this->VESC_can_Id == 0xFF ? 0x1FFFFF00 : 0x1FFFFFFF; // Any vesc if id is not set
+	filterIds[1] = this->port->addCanFilter(CANPort::extIdFilter(rotorPosId, rotorPosMask), this);
+	if(streamPosition()){
+		uint32_t statusId = ((uint32_t)VescCANMsg::CAN_PACKET_STATUS_4 << 8) | this->VESC_can_Id;
+		filterIds[2] = this->port->addCanFilter(CANPort::extIdFilter(statusId, 0x1FFFFFFF), this);
+	}
 }
 
 void VescCAN::setAddress(uint8_t address) {
@@ -174,16 +187,53 @@ void VescCAN::saveFlashOffset() {
  */
 void VescCAN::setPos(int32_t pos) {
 	// Only change encoder count internally as offset
-	posOffset = lastPos - ((float) pos / (float) getCpr());
+	posOffset = extrapolatedPos() - ((float) pos / (float) getCpr());
 
 	saveFlashOffset(); // save the new offset for next restart
 }
 
+/**
+ * Position is streamed by the VESC status frames if a vesc id is set.
+ * Otherwise the rotor position is polled like before
+ */
 float VescCAN::getPos_f() {
-	if (state == VescState::VESC_STATE_READY) {
+	if (!streamPosition() && state == VescState::VESC_STATE_READY) {
 		this->askPositionEncoder();
 	}
-	return lastPos - posOffset;
+	return extrapolatedPos() - posOffset;
+}
+
+/**
+ * Extrapolates the last received position to the current time using the filtered velocity.
+ * Extrapolation is limited to maxExtrapolationTime so a stalled stream does not run away
+ */
+float VescCAN::extrapolatedPos() {
+	cpp_freertos::CriticalSection::Enter();
+	float pos = lastPos;
+	float vel = posVelocity;
+	uint16_t time = lastPosTime;
+	uint32_t tick = lastPosTick;
+	cpp_freertos::CriticalSection::Exit();
+
+	if (HAL_GetTick() - tick > maxFrameGap) {
+		return pos;
+	}
+	uint16_t age = (uint16_t)micros() - time;
+	if (age > maxExtrapolationTime) {
+		age = maxExtrapolationTime;
+	}
+	return pos + vel * (age / 1000000.0f);
+}
+
+/**
+ * Returns the time since the last position frame in µs
+ */
+uint32_t VescCAN::getPosAge() {
+	uint32_t tickAge = HAL_GetTick() - lastPosTick;
+	if (tickAge > maxFrameGap) {
+		return tickAge * 1000;
+	}
+	return (uint16_t)((uint16_t)micros() - lastPosTime);
 }
 
 int32_t VescCAN::getPos() {
@@ -208,6 +258,7 @@ void VescCAN::registerCommands() {
 	registerCommand("forceposread", VescCAN_commands::forcePosRead, "Force a position update", CMDFLAG_GET);
 	registerCommand("useencoder", VescCAN_commands::useEncoder, "Enable VESC encoder", CMDFLAG_GET | CMDFLAG_SET);
 	registerCommand("offset", VescCAN_commands::offset, "Get or set encoder offset", CMDFLAG_GET | CMDFLAG_SET);
+	registerCommand("posage", VescCAN_commands::posage, "Time since last position frame (us)", CMDFLAG_GET);
 }
 
 CommandStatus VescCAN::command(const ParsedCommand &cmd,
@@ -216,9 +267,15 @@ CommandStatus VescCAN::command(const ParsedCommand &cmd,
 	switch (static_cast<VescCAN_commands>(cmd.cmdId)) {
 
 	case VescCAN_commands::offbcanid:
-		return handleGetSet(cmd, replies, this->OFFB_can_Id);
+		handleGetSet(cmd, replies, this->OFFB_can_Id);
+		if(cmd.type == CMDtype::set)
+			setupCanFilter();
+		break;
 	case VescCAN_commands::vesccanid:
-		return handleGetSet(cmd, replies, this->VESC_can_Id);
+		handleGetSet(cmd, replies, this->VESC_can_Id);
+		if(cmd.type == CMDtype::set)
+			setupCanFilter();
+		break;
 	case VescCAN_commands::errorflags:
 		if (cmd.type == CMDtype::get)
 			replies.push_back(CommandReply(vescErrorFlag));
@@ -242,7 +299,7 @@ CommandStatus VescCAN::command(const ParsedCommand &cmd,
 		if (cmd.type == CMDtype::get) {
 			replies.push_back(
 					CommandReply(
-							(int32_t) ((lastPos - posOffset) * 1000000000)));
+							(int32_t) (getPos_f() * 1000000000)));
 		}
 		break;
 	case VescCAN_commands::torque:
@@ -273,6 +330,10 @@ CommandStatus VescCAN::command(const ParsedCommand &cmd,
 		if (cmd.type == CMDtype::get)
 			replies.push_back(CommandReply(voltage * 1000));
 		break;
+	case VescCAN_commands::posage:
+		if (cmd.type == CMDtype::get)
+			replies.push_back(CommandReply(getPosAge()));
+		break;
 
 	default:
 		return CommandStatus::NOT_FOUND;
@@ -384,7 +445,7 @@ void VescCAN::setTorque(float torque) {
 	this->buffer_append_float32(buffer, torque, 1e5, &send_index);
 
 	this->sendMsg((uint8_t) VescCANMsg::CAN_PACKET_SET_CURRENT_REL, buffer,
-			sizeof(buffer));
+			sizeof(buffer), CANPriority::high);
 
 }
 
@@ -407,8 +468,8 @@ void VescCAN::askGetValue() {
 }
 
 /**
- * Ask a position with the new system
- * Call the new short response command with a 2 messages communications
+ * Request a single position frame.
+ * Only used in the control loop if no vesc id is set. Otherwise the position is streamed with CAN_PACKET_STATUS_4
  */
 void VescCAN::askPositionEncoder() {
 	this->sendMsg((uint8_t) VescCANMsg::CAN_PACKET_POLL_ROTOR_POS, nullptr, 0);
@@ -429,23 +490,37 @@ void VescCAN::decodeEncoderPosition(const float newPos) {
 		mtPos += (delta > 0) ? -1.0 : 1.0;
 	}
 
-	lastPos = (newPos / 360.0) + mtPos; // normalize the position
+	float pos = (newPos / 360.0) + mtPos; // normalize the position
 	prevPos360 = newPos;
 
+	// Update the velocity estimate used to extrapolate between frames
+	uint16_t now = micros();
+	uint32_t tick = HAL_GetTick();
+	uint16_t dt = now - lastPosTime;
+	if (tick - lastPosTick > maxFrameGap) {
+		posVelocity = 0;
+	} else if (dt != 0) {
+		float vel = (pos - lastPos) * (1000000.0f / dt);
+		posVelocity = (posVelocity + vel) * 0.5f;
+	}
+	lastPos = pos;
+	lastPosTime = now;
+	lastPosTick = tick;
+
 	encCount++;
 }
 
 /**
  * send the message to the CAN with an Extended Can message
  */
-void VescCAN::sendMsg(uint8_t cmd, uint8_t *buffer, uint8_t len) {
+void VescCAN::sendMsg(uint8_t cmd, uint8_t *buffer, uint8_t len, CANPriority priority) {
 	CAN_tx_msg msg;
 	memcpy(&msg.data, buffer, len);
 	msg.header.RTR = CAN_RTR_DATA;
 	msg.header.DLC = len;
 	msg.header.IDE = CAN_ID_EXT;
 	msg.header.ExtId = this->VESC_can_Id | (cmd << 8);
-	port->sendMessage(msg);
+	port->sendMessage(msg,priority);
 }
 
 void VescCAN::decode_buffer(uint8_t *buffer, uint8_t len) {
@@ -544,6 +619,9 @@ void VescCAN::decode_buffer(uint8_t *buffer, uint8_t len) {
  *	Msg struct for CAN_PACKET_POLL_ROTOR_POS
  *	uint8_t[0]..uint8_t[3] : uint32 f_pos / 10000
  *
+ *	Msg struct for CAN_PACKET_STATUS_4 (sent periodically by the vesc)
+ *	uint8_t[6]..uint8_t[7] : int16 pid_pos / 50
+ *
  */
 void VescCAN::canRxPendCallback(CAN_HandleTypeDef *hcan, uint8_t *rxBuf,
 		CAN_RxHeaderTypeDef *rxHeader, uint32_t fifo) {
@@ -557,10 +635,13 @@ void VescCAN::canRxPendCallback(CAN_HandleTypeDef *hcan, uint8_t *rxBuf,
 	// Extract the command encoded in the ExtId
 	VescCANMsg cmd = (VescCANMsg) (rxHeader->ExtId >> 8);
 
+	bool isPositionMessage = (cmd == VescCANMsg::CAN_PACKET_POLL_ROTOR_POS)
+			|| (cmd == VescCANMsg::CAN_PACKET_STATUS_4 && streamPosition());
+
 	bool messageIsForThisVescAxis = destCanID == this->OFFB_can_Id;
-	messageIsForThisVescAxis |= (cmd == VescCANMsg::CAN_PACKET_POLL_ROTOR_POS) &&	// if it's a encoder position message
+	messageIsForThisVescAxis |= isPositionMessage &&	// if it's a encoder position message
 				(this->VESC_can_Id == 0xFF); // and the vescCanId is not the default one
-	messageIsForThisVescAxis |= (cmd == VescCANMsg::CAN_PACKET_POLL_ROTOR_POS)
+	messageIsForThisVescAxis |= isPositionMessage
 			&&	// if it's a encoder position message
 			(this->VESC_can_Id != 0xFF) && // and the vescCanId is not the default one
 			(destCanID == this->VESC_can_Id); // we check that emiterId is the vescId for this axis
@@ -622,12 +703,23 @@ void VescCAN::canRxPendCallback(CAN_HandleTypeDef *hcan, uint8_t *rxBuf,
 		break;
 
 	case VescCANMsg::CAN_PACKET_POLL_ROTOR_POS: { // decode encoder data
+		if (streamPosition())
+			break; // Encoder angle. Must not be mixed with the streamed pid_pos
 		int32_t index = 0;
 		float pos = this->buffer_get_int32(rxBuf, &index) / 100000.0; // extract the 0-360 float position
 		this->decodeEncoderPosition(pos);
 		break;
 	}
 
+	case VescCANMsg::CAN_PACKET_STATUS_4: { // streamed pid position
+		if (!streamPosition() || rxHeader->DLC < 8)
+			break;
+		int32_t index = 6;
+		float pos = this->buffer_get_int16(rxBuf, &index) / 50.0; // extract the pid_pos in 0.02° steps
+		this->decodeEncoderPosition(pos);
+		break;
+	}
+
 	default:
 		break;
 	}
@@ -12,6 +12,11 @@ Add all used addresses to the VirtAddVarTab[] array. This is important for the e
 This ensures that addresses that were once used are not copied again in a page transfer if they are not in this array.
 */
 
+// All words of one config profile
+#define PROFILE_ADRS_4(n,i) ADR_PROFILE(n,i),ADR_PROFILE(n,i+1),ADR_PROFILE(n,i+2),ADR_PROFILE(n,i+3)
+#define PROFILE_ADRS(n) PROFILE_ADRS_4(n,0),PROFILE_ADRS_4(n,4),PROFILE_ADRS_4(n,8),PROFILE_ADRS_4(n,12),PROFILE_ADRS_4(n,16),\
+		PROFILE_ADRS_4(n,20),PROFILE_ADRS_4(n,24),PROFILE_ADRS_4(n,28),PROFILE_ADRS_4(n,32)
+
 uint16_t VirtAddVarTab[NB_OF_VAR] =
 	{
 		ADR_HW_VERSION, ADR_SW_VERSION,
@@ -34,17 +39,24 @@ uint16_t VirtAddVarTab[NB_OF_VAR] =
 
 		ADR_AXIS1_CONFIG, ADR_AXIS1_POWER, ADR_AXIS1_DEGREES, ADR_AXIS1_ENDSTOP,ADR_AXIS1_EFFECTS1,
 		ADR_TMC1_MOTCONF, ADR_TMC1_CPR, ADR_TMC1_ENCA, ADR_TMC1_OFFSETFLUX, ADR_TMC1_TORQUE_P, ADR_TMC1_TORQUE_I, ADR_TMC1_FLUX_P, ADR_TMC1_FLUX_I,
+		ADR_TMC1_ENC_SIG,ADR_TMC1_ADC_I0_OFS,ADR_TMC1_ADC_I1_OFS,ADR_TMC1_ENC_PHIE,ADR_TMC1_AENC0_OFS,ADR_TMC1_AENC0_SCALE,ADR_TMC1_AENC1_OFS,ADR_TMC1_AENC1_SCALE,ADR_TMC1_AENC2_OFS,ADR_TMC1_AENC2_SCALE,
 
 		ADR_AXIS2_CONFIG,ADR_AXIS2_POWER,ADR_AXIS2_DEGREES,ADR_AXIS2_ENDSTOP,ADR_AXIS2_EFFECTS1,
 		ADR_TMC2_MOTCONF,ADR_TMC2_CPR,ADR_TMC2_ENCA,ADR_TMC2_OFFSETFLUX,ADR_TMC2_TORQUE_P,ADR_TMC2_TORQUE_I,ADR_TMC2_FLUX_P,ADR_TMC2_FLUX_I,
+		ADR_TMC2_ENC_SIG,ADR_TMC2_ADC_I0_OFS,ADR_TMC2_ADC_I1_OFS,ADR_TMC2_ENC_PHIE,ADR_TMC2_AENC0_OFS,ADR_TMC2_AENC0_SCALE,ADR_TMC2_AENC1_OFS,ADR_TMC2_AENC1_SCALE,ADR_TMC2_AENC2_OFS,ADR_TMC2_AENC2_SCALE,
 
 		ADR_AXIS3_CONFIG,ADR_AXIS3_POWER,ADR_AXIS3_DEGREES,ADR_AXIS3_ENDSTOP,ADR_AXIS3_EFFECTS1,
 		ADR_TMC3_MOTCONF,ADR_TMC3_CPR,ADR_TMC3_ENCA,ADR_TMC3_OFFSETFLUX,ADR_TMC3_TORQUE_P,ADR_TMC3_TORQUE_I,ADR_TMC3_FLUX_P,ADR_TMC3_FLUX_I,
+		ADR_TMC3_ENC_SIG,ADR_TMC3_ADC_I0_OFS,ADR_TMC3_ADC_I1_OFS,ADR_TMC3_ENC_PHIE,ADR_TMC3_AENC0_OFS,ADR_TMC3_AENC0_SCALE,ADR_TMC3_AENC1_OFS,ADR_TMC3_AENC1_SCALE,ADR_TMC3_AENC2_OFS,ADR_TMC3_AENC2_SCALE,
 		ADR_ODRIVE_CANID,ADR_ODRIVE_SETTING1_M0,ADR_ODRIVE_SETTING1_M1,
 
 		ADR_VESC1_CANID, ADR_VESC1_DATA, ADR_VESC1_OFFSET,
 		ADR_VESC2_CANID, ADR_VESC2_DATA, ADR_VESC2_OFFSET,
 		ADR_VESC3_CANID, ADR_VESC3_DATA, ADR_VESC3_OFFSET,
-		ADR_MTENC_CONF1
+		ADR_CANAXIS_NODEIDS, ADR_CANAXIS_NODE_CONF, ADR_CANAXIS_NODE_TYPES,
+		ADR_MTENC_CONF1,
+
+		ADR_PROFILE_ACTIVE,
+		PROFILE_ADRS(0), PROFILE_ADRS(1), PROFILE_ADRS(2), PROFILE_ADRS(3)
 
 	};
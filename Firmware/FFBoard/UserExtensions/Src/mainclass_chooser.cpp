@@ -22,6 +22,9 @@
 #ifdef CANBRIDGE
 #include "CanBridge.h"
 #endif
+#ifdef CANAXIS
+#include "CanAxisNode.h"
+#endif
 
 // Add all classes here
 const std::vector<class_entry<FFBoardMain>> class_registry =
@@ -38,6 +41,9 @@ const std::vector<class_entry<FFBoardMain>> class_registry =
 #endif
 #ifdef CANBRIDGE
 		add_class<CanBridge,FFBoardMain>(),
+#endif
+#ifdef CANAXIS
+		add_class<CanAxisNode,FFBoardMain>(),
 #endif
 		add_class<CustomMain,FFBoardMain>()
 };
@@ -167,6 +167,18 @@ __ALIGN_BEGIN const uint8_t hid_ffb_desc[USB_HID_FFB_REPORT_DESC_SIZE] __ALIGN_E
 				0x95, 0x01,                    //   REPORT_COUNT (1)
 				0x81, 0x02,                    //   INPUT (Data,Var,Abs)
 
+				0x85,HID_ID_HIDCMD_BATCH, //    Report ID
+				0x09, 0x07,                    //   USAGE (Vendor) batched commands
+				0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
+				0x26, 0xFF,	0x00,			   //   Logical Maximum 255
+				0x75, 0x08,                    //   REPORT_SIZE (8)
+				0x95, 0x3F,                    //   REPORT_COUNT (63)
+				0x91, 0x02,                    //   OUTPUT (Data,Var,Abs)
+
+				0x09, 0x07,                    //   USAGE (Vendor) batched replies
+				0x95, 0x3F,                    //   REPORT_COUNT (63)
+				0x81, 0x02,                    //   INPUT (Data,Var,Abs)
+
 
 
 		  0xc0,                          //   END_COLLECTION
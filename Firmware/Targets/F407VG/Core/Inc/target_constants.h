@@ -39,9 +39,11 @@
 #define CANBUS
 #define ODRIVE
 #define VESC
+#define CANAXIS // Remote axes on other boards
 #define MTENCODERSPI // requires SPI3
 
 #define UARTCOMMANDS
+//#define HEAPPROFILER // Count allocations per call site. sys.heapstats
 
 //#define TMCTEMP // Enable tmc temperature shutdown. replaced by hardware selection
 //----------------------
@@ -54,6 +56,8 @@
 
 #define TIM_MICROS htim10
 #define TIM_USER htim9 // Timer with full core clock speed available for the mainclass
+#define TIM_MTENC htim4 // Background sampling of the MT encoder
+extern TIM_HandleTypeDef TIM_MTENC;
 
 extern UART_HandleTypeDef huart1;
 #define UART_PORT_EXT huart1 // main uart port